@@ -88,6 +88,74 @@ static void submultrow(Matrix4x4& a, size_t dest, size_t src, double fac)
   a[dest][3] -= fac * a[src][3];
 }
 
+// For a rigid transformation the upper 3x3 is orthogonal, so its inverse is
+// its transpose, and a uniform scale s only divides that by s squared. The
+// rows of the inverse of any other 3x3 with columns a, b and c are b x c,
+// c x a and a x b over the determinant a . (b x c). In each case the
+// translation t goes to -(inverse * t).
+Matrix4x4 Matrix4x4::Invert(TransformKind kind) const {
+  if (kind == GENERAL) {
+    return Invert();
+  }
+
+  const Matrix4x4& m = *this;
+  Vector3D a(m[0][0], m[1][0], m[2][0]);
+  Vector3D b(m[0][1], m[1][1], m[2][1]);
+  Vector3D c(m[0][2], m[1][2], m[2][2]);
+
+  Vector3D rows[3];
+  if (kind == AFFINE) {
+    rows[0] = b.Cross(c);
+    rows[1] = c.Cross(a);
+    rows[2] = a.Cross(b);
+    double scale = 1.0 / a.Dot(rows[0]);
+    for (unsigned i = 0; i < 3; i++) {
+      rows[i] = scale * rows[i];
+    }
+  } else {
+    double scale = 1.0;
+    if (kind == UNIFORM_SCALE) {
+      scale = 3.0 / (a.Length2() + b.Length2() + c.Length2());
+    }
+    rows[0] = scale * a;
+    rows[1] = scale * b;
+    rows[2] = scale * c;
+  }
+
+  Vector3D t(m[0][3], m[1][3], m[2][3]);
+  Matrix4x4 ret;
+  for (unsigned i = 0; i < 3; i++) {
+    ret[i][0] = rows[i][0];
+    ret[i][1] = rows[i][1];
+    ret[i][2] = rows[i][2];
+    ret[i][3] = -rows[i].Dot(t);
+  }
+  return ret;
+}
+
+TransformKind Classify(const Matrix4x4& m) {
+  if (m[3][0] != 0.0 || m[3][1] != 0.0 || m[3][2] != 0.0 || m[3][3] != 1.0) {
+    return GENERAL;
+  }
+
+  Vector3D a(m[0][0], m[1][0], m[2][0]);
+  Vector3D b(m[0][1], m[1][1], m[2][1]);
+  Vector3D c(m[0][2], m[1][2], m[2][2]);
+  double aa = a.Length2();
+  double bb = b.Length2();
+  double cc = c.Length2();
+
+  // Orthogonal columns of equal length, relative to that length.
+  const double epsilon = 1e-9;
+  double tolerance = epsilon * aa;
+  if (fabs(a.Dot(b)) > tolerance || fabs(b.Dot(c)) > tolerance ||
+      fabs(c.Dot(a)) > tolerance || fabs(bb - aa) > tolerance ||
+      fabs(cc - aa) > tolerance || aa == 0.0) {
+    return AFFINE;
+  }
+  return fabs(aa - 1.0) > epsilon ? UNIFORM_SCALE : RIGID;
+}
+
 Matrix3x3 Matrix3x3::Invert() const {
   const double* v = this->Begin();
   Matrix3x3 ret;
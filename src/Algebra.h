@@ -290,6 +290,19 @@ inline std::ostream& operator<<(std::ostream& os, const Vector3D& v) {
 
 class Matrix4x4;
 
+// What a transformation is known to be made of, from the most specific to the
+// least, so it can be inverted in closed form rather than by elimination. A
+// product is of the less specific kind of its two factors.
+enum TransformKind {
+  // Rotations, reflections and translations.
+  RIGID,
+  // As RIGID, with the same scale along every axis.
+  UNIFORM_SCALE,
+  // Anything with a bottom row of 0 0 0 1.
+  AFFINE,
+  GENERAL
+};
+
 class Vector4D {
  public:
   Vector4D() {
@@ -419,12 +432,17 @@ public:
   }
 
   Matrix4x4 Invert() const;
+  // The inverse of a matrix of the given kind, which is taken on trust.
+  Matrix4x4 Invert(TransformKind kind) const;
   const double* Begin() const { return (double*)v_; }
   const double* End() const { return Begin() + 16; } 
  private:
   double v_[16];
 };
 
+// The most specific kind m is, to within rounding.
+TransformKind Classify(const Matrix4x4& m);
+
 inline Matrix4x4 operator*(const Matrix4x4& a, const Matrix4x4& b) {
   Matrix4x4 ret;
 
@@ -1,5 +1,8 @@
 #include "AppWindow.h"
 
+#include <iostream>
+
+using Gtk::Menu_Helpers::CheckMenuElem;
 using Gtk::Menu_Helpers::MenuElem;
 
 AppWindow::AppWindow(char mode)
@@ -7,6 +10,13 @@ AppWindow::AppWindow(char mode)
   set_title("Project");
 
   menubar_.items().push_back(MenuElem("_Dummy", dummy_));
+
+  profile_.items().push_back(CheckMenuElem("Show _Overlay",
+      sigc::mem_fun(*this, &AppWindow::ToggleProfile)));
+  profile_.items().push_back(MenuElem("_Save Trace",
+      sigc::mem_fun(*this, &AppWindow::SaveProfile)));
+  menubar_.items().push_back(MenuElem("_Profile", profile_));
+
   add(vbox_);
   vbox_.pack_start(menubar_, Gtk::PACK_SHRINK);
 
@@ -16,3 +26,13 @@ AppWindow::AppWindow(char mode)
   show_all();
 }
 
+void AppWindow::ToggleProfile() {
+  viewer_.SetProfileShown(!viewer_.IsProfileShown());
+}
+
+// Written to the working directory, beside test.hm.
+void AppWindow::SaveProfile() {
+  if (!viewer_.SaveProfile("profile.json")) {
+    std::cerr << "Unable to write profile.json" << std::endl;
+  }
+}
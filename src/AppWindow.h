@@ -12,8 +12,12 @@ class AppWindow : public Gtk::Window {
  private:
   Gtk::VBox vbox_;
 
+  void ToggleProfile();
+  void SaveProfile();
+
   Gtk::MenuBar menubar_;
   Gtk::Menu dummy_;
+  Gtk::Menu profile_;
 
   Viewer viewer_;
 };
@@ -0,0 +1,84 @@
+#include "AssetCache.h"
+
+#include <climits>
+#include <cstdlib>
+#include <sstream>
+
+#include "Material.h"
+#include "Primitive.h"
+
+using std::string;
+using std::stringstream;
+
+AssetCache::AssetMap AssetCache::assets_;
+
+void Asset::Release() {
+  if (--references_ > 0) {
+    return;
+  }
+
+  if (!key_.empty()) {
+    AssetCache::Forget(this);
+  }
+  delete this;
+}
+
+string AssetCache::MakeKey(char kind, const string& file_name,
+                           unsigned options) {
+  char path[PATH_MAX];
+  stringstream key;
+  key << kind << options << ':';
+  if (realpath(file_name.c_str(), path)) {
+    key << path;
+  } else {
+    key << file_name;
+  }
+  return key.str();
+}
+
+Asset* AssetCache::Find(const string& key) {
+  AssetMap::iterator it = assets_.find(key);
+  if (it == assets_.end()) {
+    return NULL;
+  }
+
+  it->second->Reference();
+  return it->second;
+}
+
+void AssetCache::Insert(const string& key, Asset* asset) {
+  asset->key_ = key;
+  assets_[key] = asset;
+}
+
+void AssetCache::Forget(Asset* asset) {
+  AssetMap::iterator it = assets_.find(asset->key_);
+  if (it != assets_.end() && it->second == asset) {
+    assets_.erase(it);
+  }
+  asset->key_.clear();
+}
+
+Texture* AssetCache::GetTexture(const string& file_name) {
+  return GetTexture(file_name, Texture::MIPMAPS);
+}
+
+Texture* AssetCache::GetTexture(const string& file_name, unsigned options) {
+  string key = MakeKey('t', file_name, options);
+  Texture* texture = static_cast<Texture*>(Find(key));
+  if (!texture) {
+    texture = new Texture(file_name, options);
+    Insert(key, texture);
+  }
+  return texture;
+}
+
+Object* AssetCache::GetObject(const string& file_name) {
+  string key = MakeKey('o', file_name);
+  Object* object = static_cast<Object*>(Find(key));
+  if (!object) {
+    object = new Object(file_name);
+    Insert(key, object);
+  }
+  return object;
+}
@@ -0,0 +1,60 @@
+#ifndef __ASSET_CACHE_H__
+#define __ASSET_CACHE_H__
+
+#include <map>
+#include <string>
+
+class Object;
+class Texture;
+
+// Something a number of nodes can share. An asset starts with one reference,
+// held by whoever made it, and is deleted when the last one is released.
+class Asset {
+ public:
+  void Reference() { references_++; }
+  void Release();
+  unsigned GetReferences() const { return references_; }
+
+ protected:
+  Asset() : references_(1) {}
+  virtual ~Asset() {}
+
+ private:
+  Asset(const Asset&);
+  Asset& operator=(const Asset&);
+
+  unsigned references_;
+  // Where the cache has this asset, or empty if it isn't cached.
+  std::string key_;
+
+  friend class AssetCache;
+};
+
+// Loads each file once. Asking for a file that is already loaded gives the
+// same asset with one more reference, to be released by the caller as usual;
+// the cache itself holds none, so an asset is unloaded as soon as nothing is
+// using it. Files are told apart by their canonical path.
+class AssetCache {
+ public:
+  // Textures loaded with different Texture::Options are different assets.
+  static Texture* GetTexture(const std::string& file_name);
+  static Texture* GetTexture(const std::string& file_name, unsigned options);
+  static Object* GetObject(const std::string& file_name);
+
+  static unsigned GetSize() { return assets_.size(); }
+
+ private:
+  typedef std::map<std::string, Asset*> AssetMap;
+
+  static std::string MakeKey(char kind, const std::string& file_name,
+                             unsigned options = 0);
+  static Asset* Find(const std::string& key);
+  static void Insert(const std::string& key, Asset* asset);
+  static void Forget(Asset* asset);
+
+  static AssetMap assets_;
+
+  friend class Asset;
+};
+
+#endif
@@ -0,0 +1,890 @@
+#include "Benchmark.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <list>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "FlockCore.h"
+#include "LSystem.h"
+#include "Node.h"
+#include "ObjLoader.h"
+#include "SimdAlgebra.h"
+#include "Terrain.h"
+#include "ThreadPool.h"
+#include "Weathering.h"
+
+using std::cout;
+using std::endl;
+using std::ifstream;
+using std::list;
+using std::numeric_limits;
+using std::pair;
+using std::string;
+using std::stringstream;
+using std::vector;
+
+namespace Benchmark {
+
+static double now() {
+  timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static HeightMap* randomTerrain(unsigned size) {
+  HeightMap* height_map = new HeightMap(size, size, 0.0, false);
+  srand(488);
+  for (unsigned i = 0; i < size; i++) {
+    for (unsigned j = 0; j < size; j++) {
+      (*height_map)[i][j] = 20.0 * sin(i * 0.05) * cos(j * 0.07) + rand() % 10;
+    }
+  }
+  return height_map;
+}
+
+// The original single threaded scatter loop, kept to check the engine against.
+static void referenceWeathering(HeightMap* height_map, unsigned iterations) {
+  static int neighbours[][2] = {
+    {-1, -1}, {-1, 0}, {-1, 1}, {0, -1}, {0, 1}, {1, -1}, {1, 0}, {1, 1}
+  };
+
+  HeightMap h1;
+  HeightMap h2;
+  h2 = *height_map;
+
+  for (unsigned t = 0; t < iterations; t++) {
+    h1 = h2;
+    for (int i = 0; (unsigned)i < h1.GetWidth(); i++) {
+      for (int j = 0; (unsigned)j < h1.GetLength(); j++) {
+        double total_diff = 0.0;
+        double min_diff = numeric_limits<double>::infinity();
+        vector<pair<unsigned, double> > neighbour_list;
+
+        for (unsigned n = 0; n < 8; n++) {
+          int ni = i + neighbours[n][0];
+          int nj = j + neighbours[n][1];
+          if (ni < 0 || (unsigned)ni >= h1.GetWidth() || nj < 0 ||
+              (unsigned)nj >= h1.GetLength()) {
+            continue;
+          }
+
+          double diff = h1[i][j] - h1[ni][nj];
+          if (diff > h1.GetTalus()) {
+            neighbour_list.push_back(pair<unsigned, double>(n, diff));
+            total_diff += diff;
+            if (diff < min_diff) {
+              min_diff = diff;
+            }
+          }
+        }
+
+        unsigned count = neighbour_list.size();
+        double redistribute = 0.0;
+        if (count > 0) {
+          redistribute = ((double)count / (count + 1)) * min_diff;
+          h2[i][j] -= redistribute;
+        }
+
+        for (unsigned k = 0; k < count; k++) {
+          unsigned n = neighbour_list[k].first;
+          double diff = neighbour_list[k].second;
+          h2[i + neighbours[n][0]][j + neighbours[n][1]] +=
+              (diff / total_diff) * redistribute;
+        }
+      }
+    }
+  }
+
+  *height_map = h2;
+}
+
+void Weathering(unsigned size, unsigned iterations) {
+  cout << "Thermal weathering, " << size << "x" << size << ", "
+       << iterations << " passes" << endl;
+
+  HeightMap* source = randomTerrain(size);
+
+  HeightMap reference(*source);
+  double start = now();
+  referenceWeathering(&reference, iterations);
+  double elapsed = now() - start;
+  cout << "  serial scatter: "
+       << (double)size * size * iterations / elapsed << " cells/s" << endl;
+
+  vector<unsigned> thread_counts;
+  unsigned cores = ThreadPool::GetCoreCount();
+  for (unsigned threads = 1; threads < cores; threads *= 2) {
+    thread_counts.push_back(threads);
+  }
+  thread_counts.push_back(cores);
+
+  for (unsigned t = 0; t < thread_counts.size(); t++) {
+    ThreadPool pool(thread_counts[t]);
+    WeatheringEngine engine(*source, &pool);
+
+    start = now();
+    engine.Step(iterations);
+    elapsed = now() - start;
+
+    HeightMap result(*source);
+    engine.CopyTo(result);
+    unsigned mismatches = 0;
+    for (unsigned i = 0; i < size; i++) {
+      for (unsigned j = 0; j < size; j++) {
+        if (result[i][j] != reference[i][j]) {
+          mismatches++;
+        }
+      }
+    }
+
+    cout << "  " << thread_counts[t] << " thread(s): "
+         << (double)engine.GetCellCount() * iterations / elapsed
+         << " cells/s, " << mismatches << " cells differ from serial" << endl;
+  }
+
+  delete source;
+}
+
+// The original scalar normal loop.
+static void referenceNormals(const HeightMap& height_map,
+                             vector<Vector3D>& normals) {
+  unsigned width = height_map.GetWidth();
+  unsigned length = height_map.GetLength();
+  for (unsigned i = 0; i < width; i++) {
+    for (unsigned j = 0; j < length; j++) {
+      double a = i > 0 ? height_map[i - 1][j] : 0.0;
+      double c = i < width - 1 ? height_map[i + 1][j] : 0.0;
+      double d = j > 0 ? height_map[i][j - 1] : 0.0;
+      double b = j < length - 1 ? height_map[i][j + 1] : 0.0;
+
+      Vector3D& N = normals[i * length + j];
+      N[0] = c - a;
+      N[2] = b - d;
+      N[1] = -200.0 * (1.0 / width + 1.0 / length);
+      N.Normalize();
+    }
+  }
+}
+
+void Normals(unsigned size, unsigned iterations) {
+  cout << "Normals, " << size << "x" << size << ", " << iterations
+       << " passes" << endl;
+
+  HeightMap* height_map = randomTerrain(size);
+  double cells = (double)size * size * iterations;
+
+  vector<Vector3D> reference(size * size);
+  double start = now();
+  for (unsigned t = 0; t < iterations; t++) {
+    referenceNormals(*height_map, reference);
+  }
+  double elapsed = now() - start;
+  cout << "  scalar loop: " << cells / elapsed << " cells/s" << endl;
+
+  start = now();
+  for (unsigned t = 0; t < iterations; t++) {
+    height_map->ComputeNormals();
+  }
+  elapsed = now() - start;
+
+  double error = 0.0;
+  for (unsigned i = 0; i < size; i++) {
+    for (unsigned j = 0; j < size; j++) {
+      const Vector3D& n = height_map->GetNormal(i, j);
+      const Vector3D& r = reference[i * size + j];
+      error = std::max(error, (n - r).Length());
+    }
+  }
+  cout << "  vector rows: " << cells / elapsed << " cells/s, max error "
+       << error << endl;
+  double full = elapsed / iterations;
+
+  // A typical weathering or ripple update only touches a small window.
+  unsigned window = std::min(size, 64u);
+  start = now();
+  for (unsigned t = 0; t < iterations; t++) {
+    unsigned offset = (t * 97) % (size - window + 1);
+    height_map->ComputeNormals(offset, offset, offset + window - 1,
+                               offset + window - 1);
+  }
+  elapsed = now() - start;
+  cout << "  " << window << "x" << window << " dirty region: "
+       << elapsed / iterations * 1e6 << " us/update, whole map "
+       << full * 1e6 << " us" << endl;
+
+  delete height_map;
+}
+
+// The flock as it was before the grid and FlockCore: each fish scans the
+// whole flock for neighbours, gathers them into fresh lists and moves its
+// node by a translation. Only the mesh and texture are left out. The three
+// numbers of a random velocity are drawn in x, y, z order, as FlockCore
+// draws them, so the two can be compared fish for fish.
+struct ReferenceFish {
+  ReferenceFish() : node_("Fish") {}
+
+  template <class List>
+  bool WillCollide(const List& flock) const {
+    typename List::const_iterator it;
+    for (it = flock.begin(); it != flock.end(); ++it) {
+      if ((position_ + velocity_).Distance((*it)->position_) <= 4) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void SetVelocity(const Vector3D& velocity) {
+    velocity_ = next_velocity_;
+    next_velocity_ = velocity;
+    next_velocity_[0] += (rand() % 8 / 10.0 - 1.0);
+    next_velocity_[1] += (rand() % 8 / 10.0 - 1.0);
+    next_velocity_[2] += (rand() % 8 / 10.0 - 1.0);
+    double speed = next_velocity_.Length();
+    if (speed > 0.3) {
+      next_velocity_ = (0.3 / speed) * next_velocity_;
+    }
+  }
+
+  template <class List>
+  bool Move(const List& flock) {
+    if (!WillCollide(flock) && velocity_.Length() > 0.01) {
+      position_ = position_ + velocity_;
+      node_.Translate(velocity_);
+      return true;
+    }
+    return false;
+  }
+
+  template <class List>
+  bool MoveToCenter(const List& flock) {
+    Point3D center;
+    typename List::const_iterator it;
+    for (it = flock.begin(); it != flock.end(); ++it) {
+      center = center + (*it)->position_;
+    }
+    center = (1.0 / flock.size()) * center;
+    Vector3D random = Random();
+    center = center + Point3D(random[0], random[1], random[2]);
+    SetVelocity(center - position_);
+    return Move(flock);
+  }
+
+  template <class List>
+  void MoveRandomly(const List& flock) {
+    do {
+      SetVelocity(Random());
+    } while (!Move(flock));
+  }
+
+  template <class List>
+  void Turn(const List& alignment, const List& attraction) {
+    Vector3D velocity;
+    typename List::const_iterator it;
+    for (it = alignment.begin(); it != alignment.end(); ++it) {
+      velocity = velocity + (*it)->velocity_;
+    }
+    if (!alignment.empty()) {
+      velocity = (1.0 / alignment.size()) * velocity;
+    }
+    SetVelocity(velocity);
+
+    if (!Move(alignment)) {
+      if (!MoveToCenter(attraction)) {
+        MoveRandomly(attraction);
+      }
+    }
+  }
+
+  Vector3D Random() const {
+    double x = rand() / (20.0 * RAND_MAX) - 0.025;
+    double y = rand() / (20.0 * RAND_MAX) - 0.025;
+    double z = rand() / (20.0 * RAND_MAX) - 0.025;
+    return Vector3D(x, y, z);
+  }
+
+  Node node_;
+  Point3D position_;
+  Vector3D velocity_;
+  Vector3D next_velocity_;
+};
+
+static void referenceFlock(vector<ReferenceFish>& flock) {
+  for (unsigned i = 0; i < flock.size(); i++) {
+    ReferenceFish& a = flock[i];
+    list<ReferenceFish*> alignment;
+    list<ReferenceFish*> attraction;
+
+    for (unsigned j = 0; j < flock.size(); j++) {
+      if (i == j) {
+        continue;
+      }
+      double distance = a.position_.Distance(flock[j].position_);
+      if (distance < 8) {
+        alignment.push_back(&flock[j]);
+      }
+      if (distance < 20) {
+        attraction.push_back(&flock[j]);
+      }
+    }
+
+    a.Turn(alignment, attraction);
+  }
+}
+
+// The same fish found through the grid, as Flock did before FlockCore: one
+// object per fish, with the queries widened by how far fish have moved since
+// the grid was built.
+static void gridFlock(vector<ReferenceFish>& flock, SpatialGrid& grid) {
+  unsigned count = flock.size();
+  vector<double> x(count), y(count), z(count);
+  for (unsigned i = 0; i < count; i++) {
+    x[i] = flock[i].position_[0];
+    y[i] = flock[i].position_[1];
+    z[i] = flock[i].position_[2];
+  }
+  grid.Build(&x[0], &y[0], &z[0], count, 20);
+  const vector<unsigned>& order = grid.GetOrder();
+
+  vector<pair<unsigned, unsigned> > ranges;
+  vector<unsigned> candidates;
+  vector<ReferenceFish*> alignment;
+  vector<ReferenceFish*> attraction;
+  double drift = 0.0;
+  for (unsigned i = 0; i < count; i++) {
+    ReferenceFish& a = flock[i];
+    Point3D start = a.position_;
+    grid.Query(start[0], start[1], start[2], 20 + drift, ranges);
+    candidates.clear();
+    for (unsigned r = 0; r < ranges.size(); r++) {
+      for (unsigned k = ranges[r].first; k < ranges[r].second; k++) {
+        candidates.push_back(order[k]);
+      }
+    }
+    std::sort(candidates.begin(), candidates.end());
+
+    alignment.clear();
+    attraction.clear();
+    for (unsigned c = 0; c < candidates.size(); c++) {
+      unsigned j = candidates[c];
+      if (i == j) {
+        continue;
+      }
+      double distance = a.position_.Distance(flock[j].position_);
+      if (distance < 8) {
+        alignment.push_back(&flock[j]);
+      }
+      if (distance < 20) {
+        attraction.push_back(&flock[j]);
+      }
+    }
+
+    a.Turn(alignment, attraction);
+    drift = std::max(drift, (a.position_ - start).Length());
+  }
+}
+
+static void placeFlock(vector<ReferenceFish>& flock) {
+  for (unsigned i = 0; i < flock.size(); i++) {
+    flock[i].position_ = Point3D((i % 5) * 10 + (rand() % 40) / 10.0 - 2.0,
+                                 (i / 5) * 10 + (rand() % 40) / 10.0 - 2.0, 0);
+    flock[i].node_.Translate(flock[i].position_ - Point3D());
+  }
+}
+
+static FlockCore* coreFlock(unsigned number, ThreadPool* pool) {
+  FlockCore::Params params;
+  params.size_ = 2;
+  params.alignment_ = 8;
+  params.attraction_ = 20;
+  params.max_speed_ = 0.3;
+  params.max_random_ = 20;
+
+  FlockCore* core = new FlockCore(params, pool, 488);
+  for (unsigned i = 0; i < number; i++) {
+    core->Add(Point3D((i % 5) * 10 + (rand() % 40) / 10.0 - 2.0,
+                      (i / 5) * 10 + (rand() % 40) / 10.0 - 2.0, 0));
+  }
+  return core;
+}
+
+// Steps the core and writes every fish's transform, as Flock does.
+static double timeCore(FlockCore& core, vector<Node>& nodes, unsigned steps) {
+  double start = now();
+  for (unsigned s = 0; s < steps; s++) {
+    core.Step();
+    for (unsigned i = 0; i < nodes.size(); i++) {
+      Point3D p = core.GetPosition(i);
+      nodes[i].SetTransformation(Matrix4x4(Vector4D(1, 0, 0, p[0]),
+                                           Vector4D(0, 0, -1, p[1]),
+                                           Vector4D(0, 1, 0, p[2]),
+                                           Vector4D(0, 0, 0, 1)),
+                                 RIGID);
+    }
+  }
+  return now() - start;
+}
+
+void Flocking(unsigned number, unsigned steps) {
+  cout << "Flocking, " << number << " fish, " << steps << " steps" << endl;
+
+  srand(488);
+  vector<ReferenceFish> reference(number);
+  placeFlock(reference);
+  double start = now();
+  for (unsigned t = 0; t < steps; t++) {
+    referenceFlock(reference);
+  }
+  double lists = steps / (now() - start);
+  cout << "  per fish lists: " << lists << " steps/s" << endl;
+
+  srand(488);
+  vector<ReferenceFish> objects(number);
+  placeFlock(objects);
+  SpatialGrid grid;
+  start = now();
+  for (unsigned t = 0; t < steps; t++) {
+    gridFlock(objects, grid);
+  }
+  double gridded = steps / (now() - start);
+  unsigned differ = 0;
+  for (unsigned i = 0; i < number; i++) {
+    if ((objects[i].position_ - reference[i].position_).Length2() != 0.0) {
+      differ++;
+    }
+  }
+  cout << "  grid, one object per fish: " << gridded << " steps/s, "
+       << gridded / lists << "x the lists, " << differ
+       << " fish differ from them" << endl;
+
+  srand(488);
+  FlockCore* core = coreFlock(number, NULL);
+  vector<Node> nodes(number, Node("Fish"));
+  double elapsed = timeCore(*core, nodes, steps);
+  differ = 0;
+  for (unsigned i = 0; i < number; i++) {
+    if ((core->GetPosition(i) - reference[i].position_).Length2() != 0.0) {
+      differ++;
+    }
+  }
+  cout << "  flock core, in place: " << steps / elapsed << " steps/s, "
+       << steps / elapsed / lists << "x the lists, "
+       << steps / elapsed / gridded << "x the grid objects, " << differ
+       << " fish differ from the lists" << endl;
+  delete core;
+
+  vector<unsigned> thread_counts;
+  unsigned cores = ThreadPool::GetCoreCount();
+  for (unsigned threads = 1; threads < cores; threads *= 2) {
+    thread_counts.push_back(threads);
+  }
+  thread_counts.push_back(cores);
+
+  vector<Point3D> first;
+  for (unsigned t = 0; t < thread_counts.size(); t++) {
+    ThreadPool pool(thread_counts[t]);
+    srand(488);
+    core = coreFlock(number, &pool);
+    elapsed = timeCore(*core, nodes, steps);
+
+    // Every thread count should land the fish in exactly the same places.
+    unsigned mismatches = 0;
+    for (unsigned i = 0; i < number; i++) {
+      if (t == 0) {
+        first.push_back(core->GetPosition(i));
+      } else if ((core->GetPosition(i) - first[i]).Length2() != 0.0) {
+        mismatches++;
+      }
+    }
+    delete core;
+
+    cout << "  flock core, double buffered, " << thread_counts[t]
+         << " thread(s): " << steps / elapsed << " steps/s, "
+         << mismatches << " fish differ from 1 thread" << endl;
+  }
+}
+
+// The original in-place rewriting loop, with parameters kept as text.
+static string referenceRewrite(LSystem::ExpandRules& expand,
+                               LSystem::TurtleState& state) {
+  string turtle = state.turtle_;
+  for (unsigned i = 0; i < state.iterations_; i++) {
+    for (unsigned j = 0; j < turtle.size(); j++) {
+      if (expand.find(turtle[j]) == expand.end()) {
+        continue;
+      }
+
+      LSystem::ExpandPair rule = expand[turtle[j]];
+      turtle.replace(j, 1, rule.first);
+      j += rule.first.size() - 1;
+
+      if (turtle[j + 1] == '(') {
+        size_t pos = turtle.find(')', j + 1);
+        stringstream ss(turtle.substr(j + 2, pos - j - 2));
+        double parameter;
+        ss >> parameter;
+
+        if (rule.second) {
+          parameter = rule.second(state, parameter);
+          turtle.erase(j + 2, pos - j - 2);
+          stringstream ss;
+          ss << parameter;
+          turtle.insert(j + 2, ss.str());
+        }
+
+        j = pos - 1;
+      }
+    }
+  }
+  return turtle;
+}
+
+// The text version rounds parameters every generation, so only the symbols
+// are compared.
+static string withoutParameters(const string& turtle) {
+  string symbols;
+  for (unsigned i = 0; i < turtle.size(); i++) {
+    if (turtle[i] == '(') {
+      i = turtle.find(')', i);
+      continue;
+    }
+    symbols += turtle[i];
+  }
+  return symbols;
+}
+
+static double elongate(LSystem::TurtleState&, double value) {
+  return 1.109 * value;
+}
+
+static double widen(LSystem::TurtleState&, double value) {
+  return 1.732 * value;
+}
+
+static void countSymbol(LSystem::TurtleState& state, double) {
+  (*(unsigned*)state.data_)++;
+}
+
+void Rewriting(unsigned iterations) {
+  cout << "L-system rewriting, " << iterations << " iterations" << endl;
+
+  LSystem::ExpandRules grass;
+  grass['F'] = LSystem::ExpandPair("FF", NULL);
+  grass['X'] = LSystem::ExpandPair("F-[[X]+X]+F[+FX]-X", NULL);
+
+  LSystem::ExpandRules tree;
+  tree['A'] = LSystem::ExpandPair("!(1.732)F(50)[&(18.95)F(50)A]<(94.74)"
+                                  "[&(18.95)F(50)A]<(132.63)[&(18.95)F(50)A]",
+                                  NULL);
+  tree['F'] = LSystem::ExpandPair("F", elongate);
+  tree['!'] = LSystem::ExpandPair("!", widen);
+
+  const char* names[] = { "grass", "tree" };
+  const char* axioms[] = { "X", "!(1)F(200)<(45)A" };
+  LSystem::ExpandRules* rules[] = { &grass, &tree };
+
+  LSystem::EvalRules count;
+  for (char c = '!'; c <= '~'; c++) {
+    count[c] = countSymbol;
+  }
+
+  for (unsigned r = 0; r < 2; r++) {
+    LSystem::TurtleState state(axioms[r], iterations);
+
+    double start = now();
+    string reference = referenceRewrite(*rules[r], state);
+    double before = now() - start;
+
+    LSystem::Tokens turtle;
+    start = now();
+    LSystem::Expand(*rules[r], state, turtle);
+    double elapsed = now() - start;
+
+    bool same = withoutParameters(reference) ==
+                withoutParameters(turtle.ToString());
+    cout << "  " << names[r] << ": " << turtle.symbols_.size()
+         << " symbols, in place " << before * 1e3 << " ms, tokens "
+         << elapsed * 1e3 << " ms, " << (same ? "same" : "different")
+         << " symbols" << endl;
+
+    unsigned symbols = 0;
+    state.data_ = &symbols;
+    start = now();
+    LSystem::Derive(*rules[r], count, state);
+    elapsed = now() - start;
+    cout << "    lazy: " << elapsed * 1e3 << " ms, " << symbols
+         << " symbols evaluated, final generation "
+         << turtle.symbols_.size() + turtle.parameters_.size() * sizeof(double)
+         << " bytes expanded" << endl;
+  }
+}
+
+// The original line by line sscanf loader, with its results kept as an
+// unindexed list of (position, texture) corners.
+static void referenceObject(const string& file_name, vector<Point3D>& vertices,
+                            list<pair<unsigned, int> >& face) {
+  ifstream file(file_name.c_str());
+  char line[256];
+  while (true) {
+    file.getline(line, 256);
+    if (file.eof()) {
+      break;
+    }
+
+    if (line[0] == 'v' && line[1] == ' ') {
+      char temp[4];
+      float x, y, z;
+      sscanf(line, "%s %f %f %f", temp, &x, &y, &z);
+      vertices.push_back(Point3D(x, y, z));
+    } else if (line[0] == 'f') {
+      char temp[4];
+      unsigned v1, v2, v3;
+      int vt1, vt2, vt3;
+      int matches = sscanf(line, "%s %u/%d %u/%d %u/%d", temp, &v1, &vt1, &v2,
+                           &vt2, &v3, &vt3);
+      if (matches != 7) {
+        sscanf(line, "%s %u %u %u", temp, &v1, &v2, &v3);
+        vt1 = vt2 = vt3 = 0;
+      }
+      v1--; v2--; v3--; vt1--; vt2--; vt3--;
+      face.push_back(pair<unsigned, int>(v1, vt1));
+      face.push_back(pair<unsigned, int>(v2, vt2));
+      face.push_back(pair<unsigned, int>(v3, vt3));
+    }
+  }
+}
+
+void ObjLoading(const string& file_name, unsigned repeats) {
+  cout << "OBJ loading, " << file_name << ", " << repeats << " loads" << endl;
+
+  vector<Point3D> reference_vertices;
+  list<pair<unsigned, int> > reference_face;
+  double start = now();
+  for (unsigned r = 0; r < repeats; r++) {
+    reference_vertices.clear();
+    reference_face.clear();
+    referenceObject(file_name, reference_vertices, reference_face);
+  }
+  double before = (now() - start) / repeats;
+
+  ObjLoader::VertexList vertices;
+  ObjLoader::IndexList indices;
+  start = now();
+  for (unsigned r = 0; r < repeats; r++) {
+    ObjLoader::Load(file_name, vertices, indices, false);
+  }
+  double parsed = (now() - start) / repeats;
+
+  ObjLoader::Load(file_name, vertices, indices);
+  start = now();
+  for (unsigned r = 0; r < repeats; r++) {
+    ObjLoader::Load(file_name, vertices, indices);
+  }
+  double cached = (now() - start) / repeats;
+
+  // The positions of every corner should match the original's.
+  unsigned mismatches = 0;
+  if (reference_face.size() != indices.size()) {
+    mismatches = reference_face.size() + indices.size();
+  } else {
+    list<pair<unsigned, int> >::const_iterator it = reference_face.begin();
+    for (unsigned i = 0; i < indices.size(); i++, it++) {
+      const Point3D& p = reference_vertices[it->first];
+      const float* q = vertices[indices[i]].position_;
+      if ((float)p[0] != q[0] || (float)p[1] != q[1] || (float)p[2] != q[2]) {
+        mismatches++;
+      }
+    }
+  }
+
+  cout << "  " << indices.size() / 3 << " triangles, " << vertices.size()
+       << " vertices for " << reference_face.size() << " corners" << endl;
+  cout << "  sscanf: " << before * 1e3 << " ms, parsed: " << parsed * 1e3
+       << " ms (" << before / parsed << "x), cached: " << cached * 1e3
+       << " ms (" << before / cached << "x), " << mismatches
+       << " mismatched corners" << endl;
+}
+
+// A random rotation, scale and shear followed by a translation, kept well
+// away from singular.
+static Matrix4x4 randomAffine() {
+  Matrix4x4 m;
+  for (unsigned i = 0; i < 3; i++) {
+    for (unsigned j = 0; j < 4; j++) {
+      m[i][j] = 2.0 * rand() / RAND_MAX - 1.0;
+    }
+    m[i][i] += 3.0;
+  }
+  return m;
+}
+
+static double maxError(const Mat4f& a, const Matrix4x4& b) {
+  double error = 0.0;
+  for (unsigned i = 0; i < 4; i++) {
+    for (unsigned j = 0; j < 4; j++) {
+      error = std::max(error, std::fabs(a.Begin()[4 * j + i] - b[i][j]));
+    }
+  }
+  return error;
+}
+
+static void reportMatrices(const string& name, double before, double after,
+                           unsigned operations, double error) {
+  cout << "  " << name << ": " << before / operations * 1e9 << " ns -> "
+       << after / operations * 1e9 << " ns (" << before / after
+       << "x), max error " << error << endl;
+}
+
+void Matrices(unsigned count, unsigned repeats) {
+  cout << "Matrices, " << count << " affine transformations, " << repeats
+       << " passes" << endl;
+
+  srand(1);
+  vector<Matrix4x4> doubles(count);
+  vector<Mat4f> floats(count);
+  for (unsigned i = 0; i < count; i++) {
+    doubles[i] = randomAffine();
+    floats[i] = Mat4f(doubles[i]);
+  }
+  unsigned operations = count * repeats;
+
+  // Each matrix times the next, as a parent times a child.
+  vector<Matrix4x4> double_out(count);
+  vector<Mat4f> float_out(count);
+  double start = now();
+  for (unsigned r = 0; r < repeats; r++) {
+    for (unsigned i = 0; i + 1 < count; i++) {
+      double_out[i] = doubles[i] * doubles[i + 1];
+    }
+  }
+  double before = now() - start;
+  start = now();
+  for (unsigned r = 0; r < repeats; r++) {
+    for (unsigned i = 0; i + 1 < count; i++) {
+      float_out[i] = floats[i] * floats[i + 1];
+    }
+  }
+  double after = now() - start;
+  double error = 0.0;
+  for (unsigned i = 0; i + 1 < count; i++) {
+    error = std::max(error, maxError(float_out[i], double_out[i]));
+  }
+  reportMatrices("multiply", before, after, operations, error);
+
+  start = now();
+  for (unsigned r = 0; r < repeats; r++) {
+    for (unsigned i = 0; i < count; i++) {
+      double_out[i] = doubles[i].Transpose();
+    }
+  }
+  before = now() - start;
+  start = now();
+  for (unsigned r = 0; r < repeats; r++) {
+    for (unsigned i = 0; i < count; i++) {
+      float_out[i] = floats[i].Transpose();
+    }
+  }
+  after = now() - start;
+  error = 0.0;
+  for (unsigned i = 0; i < count; i++) {
+    error = std::max(error, maxError(float_out[i], double_out[i]));
+  }
+  reportMatrices("transpose", before, after, operations, error);
+
+  start = now();
+  for (unsigned r = 0; r < repeats; r++) {
+    for (unsigned i = 0; i < count; i++) {
+      double_out[i] = doubles[i].Invert();
+    }
+  }
+  before = now() - start;
+  start = now();
+  for (unsigned r = 0; r < repeats; r++) {
+    for (unsigned i = 0; i < count; i++) {
+      float_out[i] = floats[i].AffineInverse();
+    }
+  }
+  after = now() - start;
+  error = 0.0;
+  for (unsigned i = 0; i < count; i++) {
+    error = std::max(error, maxError(float_out[i], double_out[i]));
+  }
+  reportMatrices("invert", before, after, operations, error);
+
+  // The same inverses in double precision, by kind rather than elimination.
+  vector<Matrix4x4> closed_form(count);
+  start = now();
+  for (unsigned r = 0; r < repeats; r++) {
+    for (unsigned i = 0; i < count; i++) {
+      closed_form[i] = doubles[i].Invert(Classify(doubles[i]));
+    }
+  }
+  after = now() - start;
+  error = 0.0;
+  for (unsigned i = 0; i < count; i++) {
+    for (unsigned k = 0; k < 16; k++) {
+      error = std::max(error, std::fabs(closed_form[i].Begin()[k] -
+                                        double_out[i].Begin()[k]));
+    }
+  }
+  reportMatrices("classify and invert, double", before, after, operations,
+                 error);
+
+  // A mesh's worth of points through one matrix.
+  vector<Point3D> points(count);
+  vector<Point3D> double_points(count);
+  vector<float> float_points(3 * count);
+  vector<float> transformed(3 * count);
+  for (unsigned i = 0; i < count; i++) {
+    for (unsigned k = 0; k < 3; k++) {
+      points[i][k] = 10.0 * rand() / RAND_MAX - 5.0;
+      float_points[3 * i + k] = points[i][k];
+    }
+  }
+  start = now();
+  for (unsigned r = 0; r < repeats; r++) {
+    for (unsigned i = 0; i < count; i++) {
+      double_points[i] = doubles[r % count] * points[i];
+    }
+  }
+  before = now() - start;
+  start = now();
+  for (unsigned r = 0; r < repeats; r++) {
+    TransformPoints(floats[r % count], &float_points[0], &transformed[0],
+                    count);
+  }
+  after = now() - start;
+  error = 0.0;
+  for (unsigned i = 0; i < count; i++) {
+    for (unsigned k = 0; k < 3; k++) {
+      error = std::max(error, std::fabs(transformed[3 * i + k] -
+                                        double_points[i][k]));
+    }
+  }
+  reportMatrices("transform points", before, after, operations, error);
+}
+
+void Run() {
+  Weathering(1024, 20);
+  // The size we weather offline. The old loop needs seconds per pass here.
+  Weathering(4096, 2);
+  Normals(1024, 20);
+  Normals(4096, 5);
+  Flocking(1000, 50);
+  Flocking(10000, 5);
+  Rewriting(8);
+  ObjLoading("data/mesh/goldfish.obj", 20);
+  Matrices(10000, 100);
+}
+
+}
@@ -0,0 +1,17 @@
+#ifndef __BENCHMARK_H__
+#define __BENCHMARK_H__
+
+#include <string>
+
+// Offline timing runs, started with the 'b' mode. These don't need a display.
+namespace Benchmark {
+  void Run();
+  void Weathering(unsigned size, unsigned iterations);
+  void Normals(unsigned size, unsigned iterations);
+  void Flocking(unsigned number, unsigned steps);
+  void Rewriting(unsigned iterations);
+  void ObjLoading(const std::string& file_name, unsigned repeats);
+  void Matrices(unsigned count, unsigned repeats);
+};
+
+#endif
@@ -0,0 +1,538 @@
+#include "ChunkedTerrain.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <GL/gl.h>
+#include <GL/glu.h>
+
+#include "Terrain.h"
+
+using std::max;
+using std::min;
+using std::vector;
+
+static Colour getColour(double height) {
+  // 0..100
+  double c = height / 100.0 + 0.5;
+  return Colour(c, c, c);
+}
+
+ChunkedTerrain::ChunkedTerrain(const HeightMap& height_map, unsigned patch_size)
+    : height_map_(height_map)
+    , patch_size_(max(patch_size, 1u))
+    , pixel_error_(2.0)
+    , skirt_(0.0)
+    , index_buffer_(0)
+    , index_count_(0) {
+  unsigned cells = max(height_map.GetWidth(), height_map.GetLength()) - 1;
+  unsigned size = patch_size_;
+  while (size < cells) {
+    size *= 2;
+  }
+
+  Build(0, 0, size);
+}
+
+ChunkedTerrain::~ChunkedTerrain() {
+  for (unsigned k = 0; k < chunks_.size(); k++) {
+    if (chunks_[k].buffer_) {
+      glDeleteBuffers(1, &chunks_[k].buffer_);
+    }
+  }
+
+  if (index_buffer_) {
+    glDeleteBuffers(1, &index_buffer_);
+  }
+}
+
+int ChunkedTerrain::Build(unsigned x0, unsigned z0, unsigned size) {
+  if (x0 + 1 >= height_map_.GetWidth() || z0 + 1 >= height_map_.GetLength()) {
+    return -1;
+  }
+
+  Chunk chunk;
+  chunk.x0_ = x0;
+  chunk.z0_ = z0;
+  chunk.x1_ = min(x0 + size, height_map_.GetWidth() - 1);
+  chunk.z1_ = min(z0 + size, height_map_.GetLength() - 1);
+  chunk.step_ = max(size / patch_size_, 1u);
+  chunk.min_height_ = chunk.max_height_ = chunk.error_ = 0.0;
+  chunk.bounds_dirty_ = true;
+  chunk.error_begin_ = 0;
+  chunk.error_end_ = 0;
+  chunk.buffer_ = 0;
+  chunk.dirty_begin_ = 0;
+  chunk.dirty_end_ = patch_size_ + 1;
+  chunk.uploaded_skirt_ = -1.0;
+  chunk.children_[0] = chunk.children_[1] = -1;
+  chunk.children_[2] = chunk.children_[3] = -1;
+
+  int index = chunks_.size();
+  chunks_.push_back(chunk);
+
+  if (size > patch_size_) {
+    chunks_[index].row_errors_.assign(patch_size_, 0.0);
+    chunks_[index].error_end_ = patch_size_;
+
+    unsigned half = size / 2;
+    // Children are pushed after the parent, so index through the vector
+    // rather than holding on to a reference.
+    int children[4];
+    children[0] = Build(x0, z0, half);
+    children[1] = Build(x0 + half, z0, half);
+    children[2] = Build(x0, z0 + half, half);
+    children[3] = Build(x0 + half, z0 + half, half);
+    for (unsigned k = 0; k < 4; k++) {
+      chunks_[index].children_[k] = children[k];
+    }
+  }
+
+  return index;
+}
+
+static void appendStrip(vector<GLushort>& indices,
+                        const vector<GLushort>& strip) {
+  // Join strips with a pair of degenerate triangles. Every strip has an even
+  // length, so the winding of the next strip is preserved.
+  if (!indices.empty()) {
+    indices.push_back(indices.back());
+    indices.push_back(strip[0]);
+  }
+  indices.insert(indices.end(), strip.begin(), strip.end());
+}
+
+void ChunkedTerrain::BuildIndices() {
+  // Every chunk has the same layout: a (patch_size + 1)^2 grid of vertices,
+  // row a holding the samples at x = Sample(a), followed by the bottom
+  // vertices of the four skirts.
+  unsigned n = patch_size_ + 1;
+  unsigned skirts = n * n;
+  vector<GLushort> indices;
+  vector<GLushort> strip;
+
+  for (unsigned a = 0; a < patch_size_; a++) {
+    strip.clear();
+    for (unsigned b = 0; b < n; b++) {
+      strip.push_back(a * n + b);
+      strip.push_back((a + 1) * n + b);
+    }
+    appendStrip(indices, strip);
+  }
+
+  // Skirt strips alternate between the grid edge and the dropped copy of it,
+  // ordered so the skirts face outwards.
+  for (unsigned edge = 0; edge < 4; edge++) {
+    strip.clear();
+    for (unsigned k = 0; k < n; k++) {
+      GLushort top;
+      switch (edge) {
+        case 0:
+          top = k * n;
+          break;
+        case 1:
+          top = k * n + patch_size_;
+          break;
+        case 2:
+          top = k;
+          break;
+        default:
+          top = patch_size_ * n + k;
+          break;
+      }
+
+      GLushort bottom = skirts + edge * n + k;
+      if (edge == 1 || edge == 2) {
+        strip.push_back(bottom);
+        strip.push_back(top);
+      } else {
+        strip.push_back(top);
+        strip.push_back(bottom);
+      }
+    }
+    appendStrip(indices, strip);
+  }
+
+  index_count_ = indices.size();
+  glGenBuffers(1, &index_buffer_);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_buffer_);
+  glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLushort),
+               &indices[0], GL_STATIC_DRAW);
+}
+
+void ChunkedTerrain::Samples(unsigned begin, unsigned end, unsigned step,
+                             vector<unsigned>& samples) const {
+  samples.clear();
+  for (unsigned i = begin; i < end; i += step) {
+    samples.push_back(i);
+  }
+  samples.push_back(end);
+}
+
+unsigned ChunkedTerrain::Sample(const Chunk& chunk, unsigned index,
+                               bool along_x) const {
+  // Chunks on the far edges of the map clamp their last samples, which only
+  // produces degenerate triangles.
+  if (along_x) {
+    return min(chunk.x0_ + index * chunk.step_, chunk.x1_);
+  }
+  return min(chunk.z0_ + index * chunk.step_, chunk.z1_);
+}
+
+void ChunkedTerrain::ComputeError(Chunk& chunk) const {
+  vector<unsigned> xs;
+  vector<unsigned> zs;
+  Samples(chunk.x0_, chunk.x1_, chunk.step_, xs);
+  Samples(chunk.z0_, chunk.z1_, chunk.step_, zs);
+
+  // The children sample every half step. Both surfaces are bilinear between
+  // the children's samples, so comparing the bilinear surface through this
+  // chunk's samples at just those vertices gives the largest difference.
+  unsigned half = chunk.step_ / 2;
+  unsigned end = min(chunk.error_end_, (unsigned)xs.size() - 1);
+  for (unsigned a = chunk.error_begin_; a < end; a++) {
+    double error = 0.0;
+    double dx = xs[a + 1] - xs[a];
+    for (unsigned b = 0; b + 1 < zs.size(); b++) {
+      double h00 = height_map_[xs[a]][zs[b]];
+      double h10 = height_map_[xs[a + 1]][zs[b]];
+      double h01 = height_map_[xs[a]][zs[b + 1]];
+      double h11 = height_map_[xs[a + 1]][zs[b + 1]];
+      double dz = zs[b + 1] - zs[b];
+
+      // Samples clamped to the edge of the map are closer than half a step.
+      for (unsigned i = xs[a]; ; i = min(i + half, xs[a + 1])) {
+        double u = (i - xs[a]) / dx;
+        for (unsigned j = zs[b]; ; j = min(j + half, zs[b + 1])) {
+          double v = (j - zs[b]) / dz;
+          double h = (1 - u) * ((1 - v) * h00 + v * h01) +
+              u * ((1 - v) * h10 + v * h11);
+          error = max(error, fabs(height_map_[i][j] - h));
+          if (j == zs[b + 1]) {
+            break;
+          }
+        }
+        if (i == xs[a + 1]) {
+          break;
+        }
+      }
+    }
+    chunk.row_errors_[a] = error;
+  }
+
+  chunk.error_begin_ = chunk.error_end_ = 0;
+}
+
+void ChunkedTerrain::Update(int index) {
+  Chunk& chunk = chunks_[index];
+  if (!chunk.bounds_dirty_) {
+    return;
+  }
+
+  bool leaf = true;
+  double child_error = 0.0;
+  chunk.min_height_ = chunk.max_height_ = height_map_[chunk.x0_][chunk.z0_];
+  for (unsigned k = 0; k < 4; k++) {
+    int child_index = chunk.children_[k];
+    if (child_index < 0) {
+      continue;
+    }
+
+    leaf = false;
+    Update(child_index);
+    const Chunk& child = chunks_[child_index];
+    chunk.min_height_ = min(chunk.min_height_, child.min_height_);
+    chunk.max_height_ = max(chunk.max_height_, child.max_height_);
+    child_error = max(child_error, child.error_);
+  }
+
+  // Leaves sample every vertex, so they have no error of their own.
+  chunk.error_ = 0.0;
+  if (leaf) {
+    for (unsigned i = chunk.x0_; i <= chunk.x1_; i++) {
+      for (unsigned j = chunk.z0_; j <= chunk.z1_; j++) {
+        chunk.min_height_ = min(chunk.min_height_, height_map_[i][j]);
+        chunk.max_height_ = max(chunk.max_height_, height_map_[i][j]);
+      }
+    }
+  } else {
+    ComputeError(chunk);
+    chunk.error_ = child_error +
+        *std::max_element(chunk.row_errors_.begin(), chunk.row_errors_.end());
+  }
+
+  chunk.bounds_dirty_ = false;
+}
+
+void ChunkedTerrain::Invalidate() {
+  for (unsigned k = 0; k < chunks_.size(); k++) {
+    chunks_[k].bounds_dirty_ = true;
+    chunks_[k].error_begin_ = 0;
+    chunks_[k].error_end_ = chunks_[k].row_errors_.size();
+    chunks_[k].dirty_begin_ = 0;
+    chunks_[k].dirty_end_ = patch_size_ + 1;
+  }
+}
+
+void ChunkedTerrain::Invalidate(unsigned i0, unsigned j0, unsigned i1,
+                                unsigned j1) {
+  if (chunks_.empty()) {
+    return;
+  }
+
+  i0 = i0 > 0 ? i0 - 1 : 0;
+  j0 = j0 > 0 ? j0 - 1 : 0;
+  Invalidate(0, i0, j0, i1 + 1, j1 + 1);
+}
+
+void ChunkedTerrain::Invalidate(int index, unsigned i0, unsigned j0,
+                                unsigned i1, unsigned j1) {
+  Chunk& chunk = chunks_[index];
+  if (i1 < chunk.x0_ || i0 > chunk.x1_ || j1 < chunk.z0_ || j0 > chunk.z1_) {
+    return;
+  }
+
+  chunk.bounds_dirty_ = true;
+
+  // The error changes between the sample rows either side of the rectangle.
+  if (!chunk.row_errors_.empty()) {
+    unsigned e0 = i0 > chunk.x0_ ? (i0 - chunk.x0_ - 1) / chunk.step_ : 0;
+    unsigned e1 = min((i1 - chunk.x0_) / chunk.step_, patch_size_ - 1);
+    if (chunk.error_begin_ >= chunk.error_end_) {
+      chunk.error_begin_ = e0;
+      chunk.error_end_ = e1 + 1;
+    } else {
+      chunk.error_begin_ = min(chunk.error_begin_, e0);
+      chunk.error_end_ = max(chunk.error_end_, e1 + 1);
+    }
+  }
+
+  // Only rows and columns of samples inside the rectangle hold stale
+  // vertices; a change between samples just moves the error.
+  unsigned a0 = i0 <= chunk.x0_ ? 0 :
+      (i0 - chunk.x0_ + chunk.step_ - 1) / chunk.step_;
+  unsigned a1 = i1 >= chunk.x1_ ? patch_size_ : (i1 - chunk.x0_) / chunk.step_;
+  unsigned b0 = j0 <= chunk.z0_ ? 0 :
+      (j0 - chunk.z0_ + chunk.step_ - 1) / chunk.step_;
+  unsigned b1 = j1 >= chunk.z1_ ? patch_size_ : (j1 - chunk.z0_) / chunk.step_;
+  if (a0 <= a1 && b0 <= b1) {
+    if (chunk.dirty_begin_ >= chunk.dirty_end_) {
+      chunk.dirty_begin_ = a0;
+      chunk.dirty_end_ = a1 + 1;
+    } else {
+      chunk.dirty_begin_ = min(chunk.dirty_begin_, a0);
+      chunk.dirty_end_ = max(chunk.dirty_end_, a1 + 1);
+    }
+  }
+
+  for (unsigned k = 0; k < 4; k++) {
+    if (chunk.children_[k] >= 0) {
+      Invalidate(chunk.children_[k], i0, j0, i1, j1);
+    }
+  }
+}
+
+bool ChunkedTerrain::IsVisible(const Chunk& chunk, const View& view) const {
+  for (unsigned p = 0; p < 6; p++) {
+    const double* plane = view.planes_[p];
+    // Test the corner of the box furthest along the plane normal.
+    double x = plane[0] > 0 ? chunk.x1_ : chunk.x0_;
+    double y = plane[1] > 0 ? chunk.max_height_ : chunk.min_height_ - skirt_;
+    double z = plane[2] > 0 ? chunk.z1_ : chunk.z0_;
+    if (plane[0] * x + plane[1] * y + plane[2] * z + plane[3] < 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+double ChunkedTerrain::Distance(const Chunk& chunk, const View& view) const {
+  double dx = max(max(chunk.x0_ - view.eye_[0], view.eye_[0] - chunk.x1_), 0.0);
+  double dy = max(max(chunk.min_height_ - view.eye_[1],
+                      view.eye_[1] - chunk.max_height_), 0.0);
+  double dz = max(max(chunk.z0_ - view.eye_[2], view.eye_[2] - chunk.z1_), 0.0);
+  return sqrt(dx * dx + dy * dy + dz * dz);
+}
+
+void ChunkedTerrain::Select(int index, const View& view) {
+  Chunk& chunk = chunks_[index];
+  if (!IsVisible(chunk, view)) {
+    return;
+  }
+
+  bool leaf = chunk.children_[0] < 0 && chunk.children_[1] < 0 &&
+      chunk.children_[2] < 0 && chunk.children_[3] < 0;
+  double distance = Distance(chunk, view);
+  if (leaf || chunk.error_ * view.pixels_per_unit_ <= pixel_error_ * distance) {
+    Upload(chunk);
+    Draw(chunk);
+    return;
+  }
+
+  for (unsigned k = 0; k < 4; k++) {
+    if (chunk.children_[k] >= 0) {
+      Select(chunk.children_[k], view);
+    }
+  }
+}
+
+void ChunkedTerrain::MakeVertex(unsigned i, unsigned j, double drop,
+                                Vertex& vertex) const {
+  const Vector3D& normal = height_map_.GetNormal(i, j);
+  double height = height_map_[i][j];
+
+  vertex.position_[0] = i;
+  vertex.position_[1] = height - drop;
+  vertex.position_[2] = j;
+  vertex.normal_[0] = normal[0];
+  vertex.normal_[1] = normal[1];
+  vertex.normal_[2] = normal[2];
+  Colour c = getColour(height);
+  vertex.colour_[0] = c.R();
+  vertex.colour_[1] = c.G();
+  vertex.colour_[2] = c.B();
+  // The texture repeats once per cell.
+  vertex.tex_coord_[0] = i;
+  vertex.tex_coord_[1] = j;
+}
+
+void ChunkedTerrain::Upload(Chunk& chunk) {
+  unsigned n = patch_size_ + 1;
+
+  if (!chunk.buffer_) {
+    glGenBuffers(1, &chunk.buffer_);
+    glBindBuffer(GL_ARRAY_BUFFER, chunk.buffer_);
+    glBufferData(GL_ARRAY_BUFFER, (n * n + 4 * n) * sizeof(Vertex), NULL,
+                 GL_DYNAMIC_DRAW);
+  } else {
+    glBindBuffer(GL_ARRAY_BUFFER, chunk.buffer_);
+  }
+
+  bool rows_dirty = chunk.dirty_begin_ < chunk.dirty_end_;
+  if (rows_dirty) {
+    vertices_.resize((chunk.dirty_end_ - chunk.dirty_begin_) * n);
+    for (unsigned a = chunk.dirty_begin_; a < chunk.dirty_end_; a++) {
+      for (unsigned b = 0; b < n; b++) {
+        MakeVertex(Sample(chunk, a, true), Sample(chunk, b, false), 0.0,
+                   vertices_[(a - chunk.dirty_begin_) * n + b]);
+      }
+    }
+
+    glBufferSubData(GL_ARRAY_BUFFER, chunk.dirty_begin_ * n * sizeof(Vertex),
+                    vertices_.size() * sizeof(Vertex), &vertices_[0]);
+  }
+
+  if (rows_dirty || chunk.uploaded_skirt_ != skirt_) {
+    // Edges on the border of the map have no neighbour to crack against, so
+    // their skirts are left flat.
+    bool border[4];
+    border[0] = chunk.z0_ == 0;
+    border[1] = chunk.z1_ + 1 == height_map_.GetLength();
+    border[2] = chunk.x0_ == 0;
+    border[3] = chunk.x1_ + 1 == height_map_.GetWidth();
+
+    vertices_.resize(4 * n);
+    for (unsigned edge = 0; edge < 4; edge++) {
+      double drop = border[edge] ? 0.0 : skirt_;
+      for (unsigned k = 0; k < n; k++) {
+        unsigned a = edge < 2 ? k : (edge == 2 ? 0 : patch_size_);
+        unsigned b = edge < 2 ? (edge == 0 ? 0 : patch_size_) : k;
+        MakeVertex(Sample(chunk, a, true), Sample(chunk, b, false), drop,
+                   vertices_[edge * n + k]);
+      }
+    }
+
+    glBufferSubData(GL_ARRAY_BUFFER, n * n * sizeof(Vertex),
+                    vertices_.size() * sizeof(Vertex), &vertices_[0]);
+    chunk.uploaded_skirt_ = skirt_;
+  }
+
+  chunk.dirty_begin_ = chunk.dirty_end_ = 0;
+}
+
+void ChunkedTerrain::Draw(const Chunk& chunk) const {
+  glBindBuffer(GL_ARRAY_BUFFER, chunk.buffer_);
+  glVertexPointer(3, GL_FLOAT, sizeof(Vertex),
+                  (const GLvoid*)offsetof(Vertex, position_));
+  glNormalPointer(GL_FLOAT, sizeof(Vertex),
+                  (const GLvoid*)offsetof(Vertex, normal_));
+  glTexCoordPointer(2, GL_FLOAT, sizeof(Vertex),
+                    (const GLvoid*)offsetof(Vertex, tex_coord_));
+  glColorPointer(3, GL_FLOAT, sizeof(Vertex),
+                 (const GLvoid*)offsetof(Vertex, colour_));
+
+  glDrawElements(GL_TRIANGLE_STRIP, index_count_, GL_UNSIGNED_SHORT, 0);
+}
+
+void ChunkedTerrain::Render() {
+  if (chunks_.empty()) {
+    return;
+  }
+
+  if (chunks_[0].bounds_dirty_) {
+    Update(0);
+    skirt_ = max(skirt_, chunks_[0].error_ + 1.0);
+  }
+
+  double modelview[16];
+  double projection[16];
+  GLint viewport[4];
+  glGetDoublev(GL_MODELVIEW_MATRIX, modelview);
+  glGetDoublev(GL_PROJECTION_MATRIX, projection);
+  glGetIntegerv(GL_VIEWPORT, viewport);
+
+  // Frustum planes in the map's own space come straight out of the rows of
+  // projection * modelview. OpenGL matrices are column major.
+  double m[16];
+  for (unsigned c = 0; c < 4; c++) {
+    for (unsigned r = 0; r < 4; r++) {
+      m[c * 4 + r] = 0.0;
+      for (unsigned k = 0; k < 4; k++) {
+        m[c * 4 + r] += projection[k * 4 + r] * modelview[c * 4 + k];
+      }
+    }
+  }
+
+  View view;
+  for (unsigned p = 0; p < 6; p++) {
+    unsigned row = p / 2;
+    double sign = (p % 2 == 0) ? 1.0 : -1.0;
+    for (unsigned c = 0; c < 4; c++) {
+      view.planes_[p][c] = m[c * 4 + 3] + sign * m[c * 4 + row];
+    }
+  }
+
+  Matrix4x4 view_transform = Matrix4x4(modelview).Transpose();
+  Matrix4x4 inverse = view_transform.Invert(Classify(view_transform));
+  Point3D eye = inverse * Point3D(0.0, 0.0, 0.0);
+  view.eye_[0] = eye[0];
+  view.eye_[1] = eye[1];
+  view.eye_[2] = eye[2];
+  view.pixels_per_unit_ = viewport[3] * 0.5 * projection[5];
+
+  if (!index_buffer_) {
+    BuildIndices();
+  }
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_buffer_);
+
+  glFrontFace(GL_CW);
+
+  glEnableClientState(GL_VERTEX_ARRAY);
+  glEnableClientState(GL_NORMAL_ARRAY);
+  glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+  if (height_map_.texture_) {
+    glColorMaterial(GL_FRONT_AND_BACK, GL_DIFFUSE);
+    glEnableClientState(GL_COLOR_ARRAY);
+  }
+
+  Select(0, view);
+
+  glDisableClientState(GL_COLOR_ARRAY);
+  glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+  glDisableClientState(GL_NORMAL_ARRAY);
+  glDisableClientState(GL_VERTEX_ARRAY);
+
+  // Everything else still draws from client memory.
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
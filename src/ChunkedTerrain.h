@@ -0,0 +1,117 @@
+#ifndef __CHUNKED_TERRAIN_H__
+#define __CHUNKED_TERRAIN_H__
+
+#define GL_GLEXT_PROTOTYPES
+
+#include <GL/gl.h>
+#include <vector>
+
+class HeightMap;
+
+// Level of detail renderer for a HeightMap.
+//
+// The map is covered by a quadtree of square chunks. Every chunk is drawn as
+// a patch of patch_size x patch_size quads, so a chunk twice the size of its
+// children samples every second vertex. Each frame the tree is walked from
+// the root: chunks outside the view frustum are skipped, and a chunk is drawn
+// instead of its children once its geometric error projects to fewer than
+// pixel_error pixels. Chunks hang skirts from their inner edges so the seams
+// between neighbouring levels never show cracks.
+//
+// A chunk's vertices are kept in a vertex buffer object once it has been
+// drawn, and every chunk shares one triangle strip index buffer. Invalidate()
+// marks the rows of cached vertices a change touches, and only those rows are
+// uploaded again the next time the chunk is drawn.
+class ChunkedTerrain {
+ public:
+  ChunkedTerrain(const HeightMap& height_map, unsigned patch_size = 32);
+  ~ChunkedTerrain();
+
+  // Call whenever heights change. The rectangle is the inclusive range of
+  // cells written; neighbours are included since their normals change too.
+  void Invalidate();
+  void Invalidate(unsigned i0, unsigned j0, unsigned i1, unsigned j1);
+  void SetPixelError(double pixel_error) { pixel_error_ = pixel_error; }
+
+  void Render();
+
+ private:
+  struct Chunk {
+    // Inclusive vertex range covered, and the spacing between samples.
+    unsigned x0_;
+    unsigned z0_;
+    unsigned x1_;
+    unsigned z1_;
+    unsigned step_;
+
+    double min_height_;
+    double max_height_;
+    // Bounds the height difference between the full resolution map and this
+    // chunk's sampling of it: the largest difference from its children's
+    // samplings, plus the largest of their errors.
+    double error_;
+    bool bounds_dirty_;
+    // The largest difference from the children's samplings between each pair
+    // of sample rows, and the half-open range of those that are stale.
+    std::vector<double> row_errors_;
+    unsigned error_begin_;
+    unsigned error_end_;
+
+    GLuint buffer_;
+    // Half-open range of sample rows whose cached vertices are stale.
+    unsigned dirty_begin_;
+    unsigned dirty_end_;
+    double uploaded_skirt_;
+
+    int children_[4];
+  };
+
+  struct View {
+    double planes_[6][4];
+    double eye_[3];
+    double pixels_per_unit_;
+  };
+
+  struct Vertex {
+    float position_[3];
+    float normal_[3];
+    float colour_[3];
+    float tex_coord_[2];
+  };
+
+  ChunkedTerrain(const ChunkedTerrain&);
+  ChunkedTerrain& operator=(const ChunkedTerrain&);
+
+  int Build(unsigned x0, unsigned z0, unsigned size);
+  void BuildIndices();
+  void Update(int index);
+  void Invalidate(int index, unsigned i0, unsigned j0, unsigned i1,
+                  unsigned j1);
+  void ComputeError(Chunk& chunk) const;
+  void Samples(unsigned begin, unsigned end, unsigned step,
+               std::vector<unsigned>& samples) const;
+  unsigned Sample(const Chunk& chunk, unsigned index, bool along_x) const;
+
+  bool IsVisible(const Chunk& chunk, const View& view) const;
+  double Distance(const Chunk& chunk, const View& view) const;
+  void Select(int index, const View& view);
+  void Upload(Chunk& chunk);
+  void Draw(const Chunk& chunk) const;
+  void MakeVertex(unsigned i, unsigned j, double drop, Vertex& vertex) const;
+
+  const HeightMap& height_map_;
+  unsigned patch_size_;
+  double pixel_error_;
+
+  std::vector<Chunk> chunks_;
+  // Skirt depth. It only ever grows to cover the root's error, which bounds
+  // every crack in the tree.
+  double skirt_;
+
+  GLuint index_buffer_;
+  unsigned index_count_;
+
+  std::vector<Vertex> vertices_;
+};
+
+#endif
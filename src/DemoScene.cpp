@@ -0,0 +1,302 @@
+#include "DemoScene.h"
+
+#include <cstdlib>
+#include <GL/gl.h>
+#include <GL/glu.h>
+#include <vector>
+
+#include "Flock.h"
+#include "Forest.h"
+#include "LSystem.h"
+#include "Node.h"
+#include "Profiler.h"
+#include "Terrain.h"
+#include "Water.h"
+#include "Weathering.h"
+
+using std::vector;
+
+// The flock swims between random destinations. Its positions are
+// interpolated between ticks, since they move far enough per tick to judder
+// otherwise.
+class FlockSimulation : public Simulation {
+ public:
+  FlockSimulation(Flock* flock) : flock_(flock) {}
+
+  virtual void Step();
+  virtual Snapshot* TakeSnapshot() const;
+  virtual void Present(const Snapshot& previous, const Snapshot& current,
+                       double alpha);
+
+ private:
+  struct Positions : public Snapshot {
+    vector<Point3D> positions_;
+  };
+
+  Flock* flock_;
+  // The interpolated positions, kept to save allocating them every frame.
+  vector<Point3D> positions_;
+};
+
+void FlockSimulation::Step() {
+  PROFILE_ZONE("Flock");
+  flock_->Step();
+  if (flock_->AtDestination()) {
+    flock_->SetDestination(Point3D(-(rand() % 100), (rand() % 200) - 100, 0));
+  }
+}
+
+Simulation::Snapshot* FlockSimulation::TakeSnapshot() const {
+  Positions* snapshot = new Positions;
+  flock_->GetPositions(snapshot->positions_);
+  return snapshot;
+}
+
+void FlockSimulation::Present(const Snapshot& previous,
+                              const Snapshot& current, double alpha) {
+  const vector<Point3D>& from = ((const Positions&)previous).positions_;
+  const vector<Point3D>& to = ((const Positions&)current).positions_;
+  if (from.size() != to.size()) {
+    flock_->Place(to);
+    return;
+  }
+
+  positions_.resize(to.size());
+  for (unsigned i = 0; i < to.size(); i++) {
+    positions_[i] = from[i] + alpha * (to[i] - from[i]);
+  }
+  flock_->Place(positions_);
+}
+
+// A height field stepped away from the one drawn, which is brought up to date
+// with the newest tick. Interpolating would cost a pass over every cell each
+// frame for changes too small to see between two ticks.
+class HeightSimulation : public Simulation {
+ public:
+  HeightSimulation() : steps_(0), shown_(0) {}
+
+  virtual void Step();
+  virtual Snapshot* TakeSnapshot() const;
+  virtual void Present(const Snapshot& previous, const Snapshot& current,
+                       double alpha);
+
+ protected:
+  struct Heights : public Snapshot {
+    unsigned step_;
+    vector<double> heights_;
+  };
+
+  virtual void StepHeights() = 0;
+  virtual void GetHeights(vector<double>& heights) const = 0;
+  virtual void Show(const vector<double>& heights) = 0;
+
+ private:
+  unsigned steps_;
+  // The step last shown, since comparing every cell again for a frame
+  // drawn between two ticks would be wasted.
+  unsigned shown_;
+};
+
+void HeightSimulation::Step() {
+  StepHeights();
+  steps_++;
+}
+
+Simulation::Snapshot* HeightSimulation::TakeSnapshot() const {
+  Heights* snapshot = new Heights;
+  snapshot->step_ = steps_;
+  GetHeights(snapshot->heights_);
+  return snapshot;
+}
+
+void HeightSimulation::Present(const Snapshot&, const Snapshot& current,
+                               double) {
+  const Heights& heights = (const Heights&)current;
+  if (heights.step_ != shown_) {
+    Show(heights.heights_);
+    shown_ = heights.step_;
+  }
+}
+
+class WeatheringSimulation : public HeightSimulation {
+ public:
+  WeatheringSimulation(HeightMap* terrain)
+      : terrain_(terrain)
+      , engine_(*terrain) {}
+
+ protected:
+  virtual void StepHeights() {
+    PROFILE_ZONE("Weathering");
+    engine_.Step(1);
+  }
+  virtual void GetHeights(vector<double>& heights) const {
+    heights.assign(engine_.GetHeights(),
+                   engine_.GetHeights() + engine_.GetCellCount());
+  }
+  virtual void Show(const vector<double>& heights) {
+    terrain_->SetHeights(&heights[0]);
+  }
+
+ private:
+  HeightMap* terrain_;
+  WeatheringEngine engine_;
+};
+
+class WaterSimulation : public HeightSimulation {
+ public:
+  WaterSimulation(Water* water) : water_(water) {}
+
+ protected:
+  virtual void StepHeights() {
+    PROFILE_ZONE("Water");
+    water_->Animate(false);
+  }
+  virtual void GetHeights(vector<double>& heights) const {
+    heights = water_->GetSurface();
+  }
+  virtual void Show(const vector<double>& heights) {
+    water_->Show(heights);
+  }
+
+ private:
+  Water* water_;
+};
+
+DemoScene::DemoScene(char mode)
+    : mode_(mode)
+    , root_(NULL)
+    , terrain_(NULL)
+    , water_(NULL)
+    , flock_(NULL)
+    , simulation_(NULL) {}
+
+DemoScene::~DemoScene() {
+  // The simulation thread may still be using what's deleted below.
+  scheduler_.Stop();
+  delete simulation_;
+
+  delete water_;
+  delete flock_;
+  delete root_;
+}
+
+void DemoScene::Realize() {
+  glClearColor(0.0, 0.0, 0.0, 0);
+  glShadeModel(GL_SMOOTH);
+  glEnable(GL_DEPTH_TEST);
+  glEnable(GL_COLOR_MATERIAL);
+
+  glEnable(GL_CULL_FACE);
+  glCullFace(GL_BACK);
+
+  glEnable(GL_TEXTURE_2D);
+
+  glEnable(GL_LIGHTING);
+  glEnable(GL_LIGHT0);
+
+  float pos[] = {0.0, 0.0, -1.0, 0.0};
+  glLightfv(GL_LIGHT0, GL_POSITION, pos);
+
+  float ambient[] = {0.3, 0.3, 0.3, 1.0};
+  float diffuse[] = {0.8, 0.8, 0.8, 1.0};
+  float specular[] = {0.5, 0.5, 0.5, 1.0};
+
+  glLightModelfv(GL_LIGHT_MODEL_AMBIENT, ambient);
+  glLightfv(GL_LIGHT0, GL_DIFFUSE, diffuse);
+  glLightfv(GL_LIGHT0, GL_SPECULAR, specular);
+
+  Node* bush;
+  Node* tree;
+  if (mode_ == 'l') {
+    bush = LSystem::GenerateBush("Bush");
+    bush->Translate(Vector3D(3, -5, -15));
+    bush->Scale(Vector3D(0.005, 0.005, 0.005));
+
+    tree = LSystem::GenerateTree("Tree");
+    tree->Translate(Vector3D(-3, -5, -15));
+    tree->Scale(Vector3D(0.01, 0.01, 0.01));
+  }
+
+  // 't', 'v' and 'o' show the same lake, with water from either backend.
+  bool lake = mode_ == 't' || mode_ == 'v' || mode_ == 'o';
+  if (lake || mode_ == 'w') {
+    terrain_ = Terrain::GenerateTerrain("test.hm", lake);
+    Node* terrain_node = terrain_->GetNode();
+
+    if (lake) {
+      terrain_node->Translate(Vector3D(50, -8, -100));
+      terrain_node->Rotate('y', -90);
+
+      water_ = new Water(*terrain_, 5.0, mode_ == 'v' ?
+                         Water::WAVE_EQUATION : Water::RIPPLES);
+      terrain_node->AddChild(water_->GetNode());
+
+      if (mode_ == 'o') {
+        // A few tree shapes shared by every tree on the dry ground.
+        Forest* forest = new Forest("forest");
+        forest->Scatter(*terrain_, LSystem::GenerateTree, 5, 4, 150,
+                        0.004, 0.007, 5.5, 1);
+        terrain_node->AddChild(forest);
+      }
+    } else {
+      terrain_node->Translate(Vector3D(20, -20, -200));
+      terrain_node->Rotate('y', -45);
+    }
+  }
+
+
+  if (mode_ == 'f') {
+    flock_ = new Flock();
+    Node* flock_node = flock_->GetNode();
+    flock_node->Translate(Vector3D(0, 0, -50));
+    flock_node->Scale(Vector3D(0.2, 0.2, 0.2));
+  }
+
+  root_ = new Node("root");
+
+  if (lake || mode_ == 'w') {
+    root_->AddChild(terrain_->GetNode());
+  } else if (mode_ == 'l') {
+    root_->AddChild(bush);
+    root_->AddChild(tree);
+  } else if (mode_ == 'f') {
+    root_->AddChild(flock_->GetNode());
+  }
+  scene_.SetRoot(root_);
+
+  if (mode_ == 'f') {
+    simulation_ = new FlockSimulation(flock_);
+  } else if (mode_ == 'w') {
+    simulation_ = new WeatheringSimulation(terrain_);
+  } else if (lake) {
+    simulation_ = new WaterSimulation(water_);
+  }
+  if (simulation_) {
+    scheduler_.Add(simulation_);
+  }
+}
+
+void DemoScene::StartSimulation() {
+  scheduler_.Start();
+}
+
+void DemoScene::Draw(unsigned width, unsigned height) {
+  glMatrixMode(GL_PROJECTION);
+  glLoadIdentity();
+  glViewport(0, 0, width, height);
+  gluPerspective(40.0, (GLfloat)width / height, 0.1, 1000.0);
+
+  glMatrixMode(GL_MODELVIEW);
+  glLoadIdentity();
+
+  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+  if (!scheduler_.IsRunning()) {
+    scheduler_.Tick();
+  }
+  scheduler_.Present();
+
+  PROFILE_ZONE("Scene");
+  PROFILE_GPU_ZONE("Scene");
+  scene_.Render();
+}
@@ -0,0 +1,52 @@
+#ifndef __DEMO_SCENE_H__
+#define __DEMO_SCENE_H__
+
+#include "FlatScene.h"
+#include "Scheduler.h"
+
+class Flock;
+class HeightMap;
+class Node;
+class Water;
+
+// What each mode shows: 'l' an L-system bush and tree, 't' a terrain with
+// rippling water, 'v' the same with the water as a wave equation, 'o' the
+// same with a forest, 'w' a terrain weathering and 'f' a flock of fish.
+// Shared by the window and headless renders, so both draw the same frames.
+class DemoScene {
+ public:
+  DemoScene(char mode);
+  ~DemoScene();
+
+  // Sets up lighting and builds the scene. Needs a current GL context.
+  void Realize();
+
+  // Steps whatever the mode animates at a fixed rate on a thread of its own
+  // from now on. Call after Realize().
+  void StartSimulation();
+
+  // Draws the scene into a width x height viewport. Once the simulation is
+  // started that shows it as of now; until then every call steps it once
+  // first, which gives the same frames on every run.
+  void Draw(unsigned width, unsigned height);
+
+  char GetMode() const { return mode_; }
+  // The node every other hangs from, for moving the whole scene around.
+  Node* GetRoot() { return root_; }
+
+ private:
+  char mode_;
+
+  Node* root_;
+  FlatScene scene_;
+
+  HeightMap* terrain_;
+  Water* water_;
+  Flock* flock_;
+
+  // Whichever of the above the mode animates, or NULL.
+  Simulation* simulation_;
+  Scheduler scheduler_;
+};
+
+#endif
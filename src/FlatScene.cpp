@@ -0,0 +1,137 @@
+#include "FlatScene.h"
+
+#include <algorithm>
+#include <GL/gl.h>
+
+#include "Node.h"
+#include "Profiler.h"
+
+// out = a * b, without the row temporaries of operator*.
+static void multiply(const Matrix4x4& a, const Matrix4x4& b,
+                     Matrix4x4& out) {
+  const double* x = a.Begin();
+  const double* y = b.Begin();
+  double* z = out.GetRow(0);
+  for (unsigned i = 0; i < 4; i++) {
+    for (unsigned j = 0; j < 4; j++) {
+      z[4 * i + j] = x[4 * i] * y[j] + x[4 * i + 1] * y[4 + j] +
+                     x[4 * i + 2] * y[8 + j] + x[4 * i + 3] * y[12 + j];
+    }
+  }
+}
+
+FlatScene::FlatScene()
+    : root_(NULL)
+    , built_(false)
+    , graph_revision_(0) {}
+
+void FlatScene::SetRoot(const Node* root) {
+  root_ = root;
+  built_ = false;
+}
+
+void FlatScene::Build() {
+  entries_.clear();
+  if (root_) {
+    Add(root_, kNoParent);
+  }
+
+  world_.resize(entries_.size());
+  draw_.resize(entries_.size());
+  updated_.assign(entries_.size(), true);
+  world_inverse_.resize(entries_.size());
+  inverse_valid_.assign(entries_.size(), false);
+
+  graph_revision_ = Node::graph_revision_;
+  built_ = true;
+}
+
+void FlatScene::Add(const Node* node, unsigned parent) {
+  Entry entry;
+  entry.node_ = node;
+  entry.geometry_ = dynamic_cast<const GeometryNode*>(node);
+  entry.parent_ = parent;
+  entry.revision_ = node->revision_;
+  entry.renders_subtree_ = node->RendersSubtree();
+
+  unsigned index = entries_.size();
+  entries_.push_back(entry);
+  if (entry.renders_subtree_) {
+    return;
+  }
+
+  Node::ChildList::const_iterator it = node->children_.begin();
+  for (; it != node->children_.end(); it++) {
+    Add(*it, index);
+  }
+}
+
+// Parents come before their children, so one pass in order sees every
+// parent's world transformation settled before it is used.
+void FlatScene::Update() {
+  PROFILE_ZONE("Scene update");
+  bool rebuilt = !built_ || graph_revision_ != Node::graph_revision_;
+  if (rebuilt) {
+    Build();
+  }
+
+  for (unsigned i = 0; i < entries_.size(); i++) {
+    Entry& entry = entries_[i];
+    const Node* node = entry.node_;
+    bool changed = rebuilt || entry.revision_ != node->revision_ ||
+                   (entry.parent_ != kNoParent && updated_[entry.parent_]);
+    updated_[i] = changed;
+    if (!changed) {
+      continue;
+    }
+
+    entry.revision_ = node->revision_;
+    if (entry.parent_ == kNoParent) {
+      world_[i] = node->transformation_;
+      entry.kind_ = node->transformation_kind_;
+    } else {
+      multiply(world_[entry.parent_], node->transformation_, world_[i]);
+      entry.kind_ = std::max(entries_[entry.parent_].kind_,
+                             node->transformation_kind_);
+    }
+    if (entry.geometry_) {
+      multiply(world_[i], entry.geometry_->scale_transformation_, draw_[i]);
+    }
+    inverse_valid_[i] = false;
+  }
+}
+
+const Matrix4x4& FlatScene::GetWorldInverse(unsigned index) const {
+  if (!inverse_valid_[index]) {
+    TransformKind kind = entries_[index].kind_;
+    if (kind == GENERAL) {
+      kind = Classify(world_[index]);
+    }
+    world_inverse_[index] = world_[index].Invert(kind);
+    inverse_valid_[index] = true;
+  }
+  return world_inverse_[index];
+}
+
+void FlatScene::Render() {
+  Update();
+
+  queue_.Clear();
+  for (unsigned i = 0; i < entries_.size(); i++) {
+    const Entry& entry = entries_[i];
+    if (entry.renders_subtree_) {
+      if (entry.parent_ == kNoParent) {
+        queue_.Add(entry.node_, identity_);
+      } else {
+        queue_.Add(entry.node_, world_[entry.parent_]);
+      }
+    } else if (entry.geometry_) {
+      queue_.Add(entry.geometry_->material_, entry.geometry_->primitive_,
+                 draw_[i]);
+    }
+  }
+
+  double view[16];
+  glGetDoublev(GL_MODELVIEW_MATRIX, view);
+  queue_.Submit(view);
+}
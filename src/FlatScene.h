@@ -0,0 +1,81 @@
+#ifndef __FLAT_SCENE_H__
+#define __FLAT_SCENE_H__
+
+#include <vector>
+
+#include "Algebra.h"
+#include "RenderQueue.h"
+
+class GeometryNode;
+class Node;
+
+// A node graph laid out in arrays in depth first order, each node beside the
+// index of its parent and its world transformation. Rendering walks the
+// arrays instead of recursing through the nodes, and loads each geometry
+// node's world matrix rather than pushing and multiplying down the tree.
+//
+// World transformations are kept from frame to frame and only recomputed
+// under nodes that have moved since. Adding, removing or deleting any node
+// lays the arrays out again on the next Update(). A node that renders its
+// own subtree, like a Forest, is drawn with its Render().
+//
+// Draws go through a RenderQueue, so nodes sharing a material are drawn
+// together.
+class FlatScene {
+ public:
+  FlatScene();
+
+  // The scene doesn't own the root, which may be NULL.
+  void SetRoot(const Node* root);
+
+  // Brings the layout and the world transformations up to date.
+  void Update();
+  // Updates, then draws the scene under the current modelview matrix.
+  void Render();
+
+  unsigned GetSize() const { return entries_.size(); }
+  const RenderQueue& GetQueue() const { return queue_; }
+  const Node* GetNode(unsigned index) const { return entries_[index].node_; }
+  const Matrix4x4& GetWorld(unsigned index) const { return world_[index]; }
+  // Computed on first use after the world transformation changes.
+  const Matrix4x4& GetWorldInverse(unsigned index) const;
+
+ private:
+  struct Entry {
+    const Node* node_;
+    // Set for geometry nodes, the only ones drawn directly.
+    const GeometryNode* geometry_;
+    // Index of the parent, or kNoParent for the root.
+    unsigned parent_;
+    // The node's revision when its world transformation was computed.
+    unsigned revision_;
+    // What the world transformation is known to be, from the node's own
+    // kind and its parent's.
+    TransformKind kind_;
+    bool renders_subtree_;
+  };
+
+  static const unsigned kNoParent = ~0u;
+
+  void Build();
+  void Add(const Node* node, unsigned parent);
+
+  const Node* root_;
+  bool built_;
+  unsigned graph_revision_;
+
+  std::vector<Entry> entries_;
+  std::vector<Matrix4x4> world_;
+  // World transformations with the geometry nodes' scale applied, as drawn.
+  std::vector<Matrix4x4> draw_;
+  // Which world transformations the last Update() changed.
+  std::vector<char> updated_;
+  mutable std::vector<Matrix4x4> world_inverse_;
+  mutable std::vector<char> inverse_valid_;
+
+  // Where a root that renders its own subtree is drawn.
+  Matrix4x4 identity_;
+  RenderQueue queue_;
+};
+
+#endif
@@ -4,116 +4,135 @@
 #include <sstream>
 
 #include "Node.h"
+#include "ThreadPool.h"
 
 using std::stringstream;
+using std::vector;
 
 class Fish : public Flock::Animal {
  public:
-  Fish(unsigned i);
+  Fish(FlockCore* core, unsigned i);
   ~Fish();
 
-  bool WillCollide(const Flock::FlockList& flock);
-  virtual void SetVelocity(const Vector3D& velocity);
-  virtual bool Move(const Flock::FlockList& flock);
-  virtual bool MoveToCenter(const Flock::FlockList& flock);
-  virtual bool MoveRandomly(const Flock::FlockList& flock);
+  static FlockCore::Params GetParams();
+  virtual void Update(const Point3D& position);
 
  private:
-  double size_;
-  double max_speed_;
-  double max_random_;
-
-  Vector3D next_velocity_;
+  Point3D start_;
 };
 
-Fish::Fish(unsigned i) {
+Fish::Fish(FlockCore* core, unsigned i)
+    : Animal(core) {
   stringstream ss;
   ss << "Fish" << i;
   node_ = Node::CreateObjectNode(ss.str(), "data/mesh/goldfish.obj", "data/img/goldfish.tif");
   node_->Scale(Vector3D(120, 120, 120));
 
-  max_speed_ = 0.3;
-  max_random_ = 20;
-
-  size_ = 2;
-  alignment_ = 8;
-  attraction_ = 20;
-
   double x = (i % 5) * 10 + ((rand() % 40) / 10.0 - 2.0);
   double y = (i / 5) * 10 + ((rand() % 40) / 10.0 - 2.0);
-  position_ = Point3D(x, y, 0);
-  node_->Translate(Vector3D(x, y, 0));
-  node_->Rotate('x', 90);
+  start_ = Point3D(x, y, 0);
+  index_ = core_->Add(start_);
+  Fetch();
+  Update(start_);
 }
 
-bool Fish::WillCollide(const Flock::FlockList& flock) {
-  Flock::FlockList::const_iterator it;
-  for (it = flock.begin(); it != flock.end(); ++it) {
-    if ((position_ + velocity_).Distance((*it)->GetPosition()) <= size_ * 2) {
-      return true;
-    }
-  }
-  return false;
-}
-
-void Fish::SetVelocity(const Vector3D& velocity) {
-  velocity_ = next_velocity_;
-  next_velocity_ = velocity;
-  next_velocity_[0] += (rand() % 8 / 10.0 - 1.0);
-  next_velocity_[1] += (rand() % 8 / 10.0 - 1.0);
-  next_velocity_[2] += (rand() % 8 / 10.0 - 1.0);
-  double speed = next_velocity_.Length();
-  if (speed > max_speed_) {
-    next_velocity_ = (max_speed_ / speed) * next_velocity_;
-  }
+FlockCore::Params Fish::GetParams() {
+  FlockCore::Params params;
+  params.size_ = 2;
+  params.alignment_ = 8;
+  params.attraction_ = 20;
+  params.max_speed_ = 0.3;
+  params.max_random_ = 20;
+  return params;
 }
 
-bool Fish::Move(const Flock::FlockList& flock) {
-  if (!WillCollide(flock) && velocity_.Length() > 0.01) {
-    position_ = position_ + velocity_;
-    node_->Translate(velocity_);
-    return true;
-  }
-  return false;
+void Fish::Update(const Point3D& position) {
+  // Placed at the start, turned a quarter about x and then moved within the
+  // turned frame, as the fish always has been.
+  Vector3D d = position - start_;
+  node_->SetTransformation(Matrix4x4(Vector4D(1, 0, 0, start_[0] + d[0]),
+                                     Vector4D(0, 0, -1, start_[1] - d[2]),
+                                     Vector4D(0, 1, 0, start_[2] + d[1]),
+                                     Vector4D(0, 0, 0, 1)),
+                           RIGID);
 }
 
-bool Fish::MoveToCenter(const Flock::FlockList& flock) {
-  Flock::FlockList::const_iterator it;
-  Point3D center;
-  for (it = flock.begin(); it != flock.end(); ++it) {
-    center = center + (*it)->GetPosition();
+Fish::~Fish() {
+  if (!node_->IsAttached()) {
+    delete node_;
   }
+}
 
-  center = (1.0 / flock.size()) * center;
-  center = center + Point3D((rand() / (max_random_ * RAND_MAX)) - (0.5 / max_random_),
-                            (rand() / (max_random_ * RAND_MAX)) - (0.5 / max_random_),
-                            (rand() / (max_random_ * RAND_MAX)) - (0.5 / max_random_));
-  SetVelocity(center - position_);
-  return Move(flock);
+bool Flock::Animal::InAlignment(const Animal* other) const {
+  double alignment = core_->GetParams().alignment_;
+  return (position_ - other->position_).Length2() < alignment * alignment;
 }
 
-bool Fish::MoveRandomly(const Flock::FlockList& flock) {
-  do {
-    SetVelocity(Vector3D((rand() / (max_random_ * RAND_MAX)) - (0.5 / max_random_),
-                         (rand() / (max_random_ * RAND_MAX)) - (0.5 / max_random_),
-                         (rand() / (max_random_ * RAND_MAX)) - (0.5 / max_random_)));
-  } while (!Move(flock));
-  return true;
+bool Flock::Animal::InAttraction(const Animal* other) const {
+  double attraction = core_->GetParams().attraction_;
+  return (position_ - other->position_).Length2() < attraction * attraction;
 }
 
-Fish::~Fish() {
-  if (!node_->IsAttached()) {
-    delete node_;
+void Flock::Animal::SetVelocity(const Vector3D& velocity) {
+  core_->SetVelocity(index_, velocity);
+  Fetch();
+}
+
+bool Flock::Animal::Move(const FlockList& flock) {
+  vector<unsigned> neighbours;
+  Indices(flock, neighbours);
+  bool moved = core_->Move(index_, neighbours);
+  Fetch();
+  Update(position_);
+  return moved;
+}
+
+bool Flock::Animal::MoveToCenter(const FlockList& flock) {
+  vector<unsigned> neighbours;
+  Indices(flock, neighbours);
+  bool moved = core_->MoveToCenter(index_, neighbours);
+  Fetch();
+  Update(position_);
+  return moved;
+}
+
+bool Flock::Animal::MoveRandomly(const FlockList& flock) {
+  vector<unsigned> neighbours;
+  Indices(flock, neighbours);
+  bool moved = core_->MoveRandomly(index_, neighbours);
+  Fetch();
+  Update(position_);
+  return moved;
+}
+
+void Flock::Animal::Fetch() {
+  position_ = core_->GetPosition(index_);
+  velocity_ = core_->GetVelocity(index_);
+}
+
+void Flock::Animal::Indices(const FlockList& flock,
+                            vector<unsigned>& indices) {
+  indices.clear();
+  FlockList::const_iterator it;
+  for (it = flock.begin(); it != flock.end(); ++it) {
+    indices.push_back((*it)->index_);
   }
 }
 
-Flock::Flock(Type type, unsigned number)
-    : at_destination_(true) {
+Flock::Flock(Type type, unsigned number, bool parallel)
+    : core_(NULL)
+    , at_destination_(true) {
   node_ = new Node("Flock-wrapper");
 
   if (type == FISH) {
+    if (parallel) {
+      core_ = new FlockCore(Fish::GetParams(), ThreadPool::GetDefault(),
+                            rand());
+    } else {
+      core_ = new FlockCore(Fish::GetParams());
+    }
     for (unsigned i = 0; i < number; i++) {
-      Animal* a = new Fish(i);
+      Animal* a = new Fish(core_, i);
       flock_.push_back(a);
 
       node_->AddChild(a->GetNode());
@@ -122,10 +141,10 @@ Flock::Flock(Type type, unsigned number)
 }
 
 Flock::~Flock() {
-  FlockList::iterator it;
-  for (it = flock_.begin(); it != flock_.end(); ++it) {
-    delete (*it);
+  for (unsigned i = 0; i < flock_.size(); i++) {
+    delete flock_[i];
   }
+  delete core_;
 
   if (!node_->IsAttached()) {
     delete node_;
@@ -137,58 +156,43 @@ void Flock::SetBounds(HeightMap& map, unsigned height) {
 }
 
 void Flock::Move() {
-  FlockList::iterator it;
-  Point3D center;
-  for (it = flock_.begin(); it != flock_.end(); ++it) {
-    Animal* a = *it;
-
-    Vector3D velocity;
-    unsigned count = 0;
-
-    FlockList alignment;
-    FlockList attraction;
-    center = center + (*it)->GetPosition();
-
-    FlockList::iterator other_it;
-    for (other_it = flock_.begin(); other_it != flock_.end(); ++other_it) {
-      Animal* other = *other_it;
-      if (a == other) {
-        continue;
-      }
-
-      if (a->InAlignment(other)) {
-        alignment.push_back(other);
-        count++;
-        velocity = velocity + other->GetVelocity();
-      }
-
-      if (a->InAttraction(other)) {
-        attraction.push_back(other);
-      }
-    }
+  Step();
 
-    if (count > 0) {
-      velocity = (1.0 / count) * velocity;
-    }
-    a->SetVelocity(velocity);
+  for (unsigned i = 0; i < flock_.size(); i++) {
+    flock_[i]->Update(flock_[i]->GetPosition());
+  }
+}
 
-    if (!at_destination_) {
-      bool move_to_destination = ((rand() % 5) == 0);
-      if (move_to_destination) {
-        a->SetVelocity(destination_ - a->GetPosition());
-      }
-    }
+void Flock::Step() {
+  if (!core_) {
+    return;
+  }
 
-    if (!a->Move(alignment)) {
-      if (!a->MoveToCenter(attraction)) {
-        a->MoveRandomly(attraction);
-      }
-    }
+  if (at_destination_) {
+    core_->ClearDestination();
+  } else {
+    core_->SetDestination(destination_);
+  }
+  core_->Step();
+  for (unsigned i = 0; i < flock_.size(); i++) {
+    flock_[i]->Fetch();
   }
 
-  center = (1.0 / flock_.size()) * center;
+  Point3D center = core_->GetCenter();
   if ((center - destination_).Length() < flock_.size()) {
     at_destination_ = true;
   }
 }
 
+void Flock::GetPositions(vector<Point3D>& positions) const {
+  positions.resize(flock_.size());
+  for (unsigned i = 0; i < flock_.size(); i++) {
+    positions[i] = flock_[i]->GetPosition();
+  }
+}
+
+void Flock::Place(const vector<Point3D>& positions) {
+  for (unsigned i = 0; i < flock_.size() && i < positions.size(); i++) {
+    flock_[i]->Update(positions[i]);
+  }
+}
@@ -2,8 +2,10 @@
 #define __FLOCK_H__
 
 #include <list>
+#include <vector>
 
 #include "Algebra.h"
+#include "FlockCore.h"
 
 class HeightMap;
 class Node;
@@ -14,7 +16,11 @@ class Flock {
     FISH
   };
 
-  Flock(Type type = FISH, unsigned number = 20);
+  // A parallel flock steps across the default thread pool, with every animal
+  // going by where the others were after the last step and random numbers
+  // that come out the same however many threads there are. Otherwise the
+  // animals move one after another, as they always have.
+  Flock(Type type = FISH, unsigned number = 20, bool parallel = false);
   ~Flock();
 
   void SetBounds(HeightMap& map, unsigned height);
@@ -23,13 +29,25 @@ class Flock {
     destination_ = destination; at_destination_ = false; }
   bool AtDestination() { return at_destination_; }
   void Move();
+
+  // Move() in two halves, so the flock can be stepped on one thread and drawn
+  // on another. Step() only touches the core and the animals' state, and
+  // Place() only the nodes.
+  void Step();
+  void GetPositions(std::vector<Point3D>& positions) const;
+  // Moves the animals' nodes to positions, one per animal.
+  void Place(const std::vector<Point3D>& positions);
  
   class Animal;
   typedef std::list<Animal*> FlockList;
 
+  // One animal of the flock. Its state lives in the flock's core, which
+  // steps the whole flock at once; these calls run the same rules for one
+  // animal by hand. The position and velocity are copies brought up to date
+  // whenever the animal moves.
   class Animal {
    public:
-    Animal() : node_(NULL) {}
+    Animal(FlockCore* core) : node_(NULL), core_(core), index_(0) {}
     virtual ~Animal() {}
 
     virtual Node* GetNode() { return node_; }
@@ -37,27 +55,34 @@ class Flock {
     virtual const Vector3D& GetVelocity() const { return velocity_; }
     virtual const Point3D& GetPosition() const { return position_; }
 
-    virtual bool InAlignment(const Animal* other) const {
-      return position_.Distance(other->position_) < alignment_; }
-    virtual bool InAttraction(const Animal* other) const {
-      return position_.Distance(other->position_) < attraction_; }
-    virtual void SetVelocity(const Vector3D& velocity) { velocity_ = velocity; }
-    virtual bool Move(const FlockList& flock) = 0;
-    virtual bool MoveToCenter(const FlockList& flock) = 0;
-    virtual bool MoveRandomly(const FlockList& flock) = 0;
+    virtual bool InAlignment(const Animal* other) const;
+    virtual bool InAttraction(const Animal* other) const;
+    virtual void SetVelocity(const Vector3D& velocity);
+    virtual bool Move(const FlockList& flock);
+    virtual bool MoveToCenter(const FlockList& flock);
+    virtual bool MoveRandomly(const FlockList& flock);
+
+    // Moves the node to show the animal at position.
+    virtual void Update(const Point3D& position) = 0;
 
    protected:
+    friend class Flock;
+    // Copies the animal's state out of the core.
+    void Fetch();
+    static void Indices(const FlockList& flock,
+                        std::vector<unsigned>& indices);
+
     Node* node_;
+    FlockCore* core_;
+    unsigned index_;
 
     Point3D position_;
     Vector3D velocity_;
-
-    double alignment_;
-    double attraction_;
   };
 
  private:
-  FlockList flock_;
+  FlockCore* core_;
+  std::vector<Animal*> flock_;
   Node* node_;
 
   bool at_destination_;
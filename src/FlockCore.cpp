@@ -0,0 +1,424 @@
+#include "FlockCore.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+#include "Random.h"
+#include "ThreadPool.h"
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+using std::max;
+using std::sort;
+using std::vector;
+
+// The neighbour search is written once against these, whichever instruction
+// set it ends up in. Distances are worked out exactly as the scalar loop does
+// them, so an animal finds the same neighbours in either.
+#if defined(__AVX__)
+typedef __m256d Lanes;
+static const unsigned kLanes = 4;
+static inline Lanes splat(double x) { return _mm256_set1_pd(x); }
+static inline Lanes load(const double* p) { return _mm256_loadu_pd(p); }
+static inline Lanes add(Lanes a, Lanes b) { return _mm256_add_pd(a, b); }
+static inline Lanes sub(Lanes a, Lanes b) { return _mm256_sub_pd(a, b); }
+static inline Lanes mul(Lanes a, Lanes b) { return _mm256_mul_pd(a, b); }
+static inline unsigned below(Lanes a, Lanes b) {
+  return _mm256_movemask_pd(_mm256_cmp_pd(a, b, _CMP_LT_OQ)); }
+#elif defined(__SSE2__)
+typedef __m128d Lanes;
+static const unsigned kLanes = 2;
+static inline Lanes splat(double x) { return _mm_set1_pd(x); }
+static inline Lanes load(const double* p) { return _mm_loadu_pd(p); }
+static inline Lanes add(Lanes a, Lanes b) { return _mm_add_pd(a, b); }
+static inline Lanes sub(Lanes a, Lanes b) { return _mm_sub_pd(a, b); }
+static inline Lanes mul(Lanes a, Lanes b) { return _mm_mul_pd(a, b); }
+static inline unsigned below(Lanes a, Lanes b) {
+  return _mm_movemask_pd(_mm_cmplt_pd(a, b)); }
+#endif
+
+// Below this many animals a step is quicker than waking the pool.
+static const unsigned kParallelMinimum = 512;
+
+// Random numbers for steps on the calling thread.
+class RandDice {
+ public:
+  int Roll() { return rand(); }
+};
+
+// Random numbers for steps on the pool: the animal's own run of a step's
+// stream, so it draws the same numbers whichever thread moves it.
+class CounterDice {
+ public:
+  CounterDice(const CounterRandom& random, unsigned animal)
+      : random_(random)
+      , counter_((uint64_t)animal << 32) {}
+
+  int Roll() {
+    return (int)(random_.Get(counter_++) % ((uint64_t)RAND_MAX + 1));
+  }
+
+ private:
+  const CounterRandom& random_;
+  uint64_t counter_;
+};
+
+FlockCore::FlockCore(const Params& params, ThreadPool* pool, uint64_t seed)
+    : params_(params)
+    , seek_(false)
+    , pool_(pool)
+    , seed_(seed)
+    , step_(0) {}
+
+unsigned FlockCore::Add(const Point3D& position) {
+  Animal animal;
+  animal.position_ = position;
+
+  unsigned i = GetCount();
+  State* states[] = { &state_, &next_ };
+  for (unsigned s = 0; s < 2; s++) {
+    State& state = *states[s];
+    state.x_.resize(i + 1);
+    state.y_.resize(i + 1);
+    state.z_.resize(i + 1);
+    state.vx_.resize(i + 1);
+    state.vy_.resize(i + 1);
+    state.vz_.resize(i + 1);
+    state.nx_.resize(i + 1);
+    state.ny_.resize(i + 1);
+    state.nz_.resize(i + 1);
+  }
+  Store(state_, i, animal);
+  return i;
+}
+
+Point3D FlockCore::GetCenter() const {
+  double x = 0.0, y = 0.0, z = 0.0;
+  unsigned count = GetCount();
+  for (unsigned i = 0; i < count; i++) {
+    x += state_.x_[i];
+    y += state_.y_[i];
+    z += state_.z_[i];
+  }
+  double scale = count == 0 ? 0.0 : 1.0 / count;
+  return Point3D(x * scale, y * scale, z * scale);
+}
+
+void FlockCore::State::Swap(State& other) {
+  x_.swap(other.x_);
+  y_.swap(other.y_);
+  z_.swap(other.z_);
+  vx_.swap(other.vx_);
+  vy_.swap(other.vy_);
+  vz_.swap(other.vz_);
+  nx_.swap(other.nx_);
+  ny_.swap(other.ny_);
+  nz_.swap(other.nz_);
+}
+
+FlockCore::Animal FlockCore::Load(unsigned i) const {
+  Animal animal;
+  animal.position_ = Point3D(state_.x_[i], state_.y_[i], state_.z_[i]);
+  animal.velocity_ = Vector3D(state_.vx_[i], state_.vy_[i], state_.vz_[i]);
+  animal.next_velocity_ = Vector3D(state_.nx_[i], state_.ny_[i],
+                                   state_.nz_[i]);
+  return animal;
+}
+
+void FlockCore::Store(State& state, unsigned i, const Animal& animal) {
+  state.x_[i] = animal.position_[0];
+  state.y_[i] = animal.position_[1];
+  state.z_[i] = animal.position_[2];
+  state.vx_[i] = animal.velocity_[0];
+  state.vy_[i] = animal.velocity_[1];
+  state.vz_[i] = animal.velocity_[2];
+  state.nx_[i] = animal.next_velocity_[0];
+  state.ny_[i] = animal.next_velocity_[1];
+  state.nz_[i] = animal.next_velocity_[2];
+}
+
+void FlockCore::Step() {
+  unsigned count = GetCount();
+  if (count == 0) {
+    return;
+  }
+
+  Sort();
+
+  if (pool_) {
+    if (count >= kParallelMinimum) {
+      pool_->Run(StepBlock, this, count);
+    } else {
+      StepBlock(this, 0, count);
+    }
+    state_.Swap(next_);
+    step_++;
+    return;
+  }
+
+  // Animals move as the loop goes, so queries are widened by the furthest
+  // any of them has got from where the grid saw it.
+  double radius = max(params_.alignment_, params_.attraction_);
+  double drift = 0.0;
+  RandDice dice;
+  for (unsigned i = 0; i < count; i++) {
+    Animal animal = Load(i);
+    Point3D start = animal.position_;
+    FindNeighbours(i, start, radius + drift, ranges_, alignment_,
+                   attraction_);
+    Turn(animal, alignment_, attraction_, dice);
+    Store(state_, i, animal);
+
+    unsigned slot = slots_[i];
+    sx_[slot] = animal.position_[0];
+    sy_[slot] = animal.position_[1];
+    sz_[slot] = animal.position_[2];
+    drift = max(drift, (animal.position_ - start).Length());
+  }
+  step_++;
+}
+
+void FlockCore::StepBlock(void* core, unsigned begin, unsigned end) {
+  FlockCore* self = (FlockCore*)core;
+  double radius = max(self->params_.alignment_, self->params_.attraction_);
+  CounterRandom random(self->seed_, self->step_);
+
+  RangeList ranges;
+  vector<unsigned> alignment;
+  vector<unsigned> attraction;
+  for (unsigned i = begin; i < end; i++) {
+    Animal animal = self->Load(i);
+    CounterDice dice(random, i);
+    self->FindNeighbours(i, animal.position_, radius, ranges, alignment,
+                         attraction);
+    self->Turn(animal, alignment, attraction, dice);
+    Store(self->next_, i, animal);
+  }
+}
+
+// Copies the positions into grid order, so each bucket can be read as a run
+// of contiguous lanes.
+void FlockCore::Sort() {
+  unsigned count = GetCount();
+  double radius = max(params_.alignment_, params_.attraction_);
+  grid_.Build(&state_.x_[0], &state_.y_[0], &state_.z_[0], count, radius);
+
+  const vector<unsigned>& order = grid_.GetOrder();
+  sx_.resize(count);
+  sy_.resize(count);
+  sz_.resize(count);
+  slots_.resize(count);
+  for (unsigned slot = 0; slot < count; slot++) {
+    unsigned i = order[slot];
+    sx_[slot] = state_.x_[i];
+    sy_[slot] = state_.y_[i];
+    sz_[slot] = state_.z_[i];
+    slots_[i] = slot;
+  }
+}
+
+void FlockCore::FindNeighbours(unsigned i, const Point3D& position,
+                               double radius, RangeList& ranges,
+                               vector<unsigned>& alignment,
+                               vector<unsigned>& attraction) const {
+  alignment.clear();
+  attraction.clear();
+
+  double x = position[0];
+  double y = position[1];
+  double z = position[2];
+  double alignment2 = params_.alignment_ * params_.alignment_;
+  double attraction2 = params_.attraction_ * params_.attraction_;
+  const vector<unsigned>& order = grid_.GetOrder();
+  unsigned own = slots_[i];
+
+  grid_.Query(x, y, z, radius, ranges);
+
+#if defined(__AVX__) || defined(__SSE2__)
+  Lanes lx = splat(x), ly = splat(y), lz = splat(z);
+  Lanes la2 = splat(alignment2);
+  Lanes lc2 = splat(attraction2);
+#endif
+
+  for (unsigned r = 0; r < ranges.size(); r++) {
+    unsigned j = ranges[r].first;
+    unsigned end = ranges[r].second;
+
+#if defined(__AVX__) || defined(__SSE2__)
+    for (; j + kLanes <= end; j += kLanes) {
+      Lanes dx = sub(lx, load(&sx_[j]));
+      Lanes dy = sub(ly, load(&sy_[j]));
+      Lanes dz = sub(lz, load(&sz_[j]));
+      Lanes d2 = add(add(mul(dx, dx), mul(dy, dy)), mul(dz, dz));
+      unsigned aligned = below(d2, la2);
+      unsigned attracted = below(d2, lc2);
+      if ((aligned | attracted) == 0) {
+        continue;
+      }
+
+      for (unsigned lane = 0; lane < kLanes; lane++) {
+        if (j + lane == own) {
+          continue;
+        }
+        if (aligned & (1u << lane)) {
+          alignment.push_back(order[j + lane]);
+        }
+        if (attracted & (1u << lane)) {
+          attraction.push_back(order[j + lane]);
+        }
+      }
+    }
+#endif
+
+    for (; j < end; j++) {
+      if (j == own) {
+        continue;
+      }
+      double dx = x - sx_[j];
+      double dy = y - sy_[j];
+      double dz = z - sz_[j];
+      double d2 = dx * dx + dy * dy + dz * dz;
+      if (d2 < alignment2) {
+        alignment.push_back(order[j]);
+      }
+      if (d2 < attraction2) {
+        attraction.push_back(order[j]);
+      }
+    }
+  }
+
+  // The rules add up neighbours in flock order.
+  sort(alignment.begin(), alignment.end());
+  sort(attraction.begin(), attraction.end());
+}
+
+template <class Dice>
+void FlockCore::Turn(Animal& animal, const vector<unsigned>& alignment,
+                     const vector<unsigned>& attraction, Dice& dice) const {
+  Vector3D velocity;
+  for (unsigned k = 0; k < alignment.size(); k++) {
+    unsigned j = alignment[k];
+    velocity = velocity + Vector3D(state_.vx_[j], state_.vy_[j],
+                                   state_.vz_[j]);
+  }
+  if (!alignment.empty()) {
+    velocity = (1.0 / alignment.size()) * velocity;
+  }
+  SetVelocity(animal, velocity, dice);
+
+  if (seek_ && dice.Roll() % 5 == 0) {
+    SetVelocity(animal, destination_ - animal.position_, dice);
+  }
+
+  if (!Move(animal, alignment)) {
+    if (!MoveToCenter(animal, attraction, dice)) {
+      MoveRandomly(animal, attraction, dice);
+    }
+  }
+}
+
+template <class Dice>
+void FlockCore::SetVelocity(Animal& animal, const Vector3D& velocity,
+                            Dice& dice) const {
+  animal.velocity_ = animal.next_velocity_;
+  animal.next_velocity_ = velocity;
+  animal.next_velocity_[0] += (dice.Roll() % 8 / 10.0 - 1.0);
+  animal.next_velocity_[1] += (dice.Roll() % 8 / 10.0 - 1.0);
+  animal.next_velocity_[2] += (dice.Roll() % 8 / 10.0 - 1.0);
+  double speed = animal.next_velocity_.Length();
+  if (speed > params_.max_speed_) {
+    animal.next_velocity_ = (params_.max_speed_ / speed) *
+        animal.next_velocity_;
+  }
+}
+
+bool FlockCore::Move(Animal& animal, const vector<unsigned>& neighbours) const {
+  Point3D next = animal.position_ + animal.velocity_;
+  double limit2 = params_.size_ * params_.size_ * 4;
+  for (unsigned k = 0; k < neighbours.size(); k++) {
+    unsigned j = neighbours[k];
+    Point3D other(state_.x_[j], state_.y_[j], state_.z_[j]);
+    if ((next - other).Length2() <= limit2) {
+      return false;
+    }
+  }
+
+  if (animal.velocity_.Length() > 0.01) {
+    animal.position_ = next;
+    return true;
+  }
+  return false;
+}
+
+template <class Dice>
+bool FlockCore::MoveToCenter(Animal& animal,
+                             const vector<unsigned>& neighbours,
+                             Dice& dice) const {
+  Point3D center;
+  for (unsigned k = 0; k < neighbours.size(); k++) {
+    unsigned j = neighbours[k];
+    center = center + Point3D(state_.x_[j], state_.y_[j], state_.z_[j]);
+  }
+
+  center = (1.0 / neighbours.size()) * center;
+  double x = Random(dice);
+  double y = Random(dice);
+  double z = Random(dice);
+  center = center + Point3D(x, y, z);
+  SetVelocity(animal, center - animal.position_, dice);
+  return Move(animal, neighbours);
+}
+
+template <class Dice>
+bool FlockCore::MoveRandomly(Animal& animal,
+                             const vector<unsigned>& neighbours,
+                             Dice& dice) const {
+  do {
+    double x = Random(dice);
+    double y = Random(dice);
+    double z = Random(dice);
+    SetVelocity(animal, Vector3D(x, y, z), dice);
+  } while (!Move(animal, neighbours));
+  return true;
+}
+
+template <class Dice>
+double FlockCore::Random(Dice& dice) const {
+  return (dice.Roll() / (params_.max_random_ * RAND_MAX)) -
+      (0.5 / params_.max_random_);
+}
+
+void FlockCore::SetVelocity(unsigned i, const Vector3D& velocity) {
+  Animal animal = Load(i);
+  RandDice dice;
+  SetVelocity(animal, velocity, dice);
+  Store(state_, i, animal);
+}
+
+bool FlockCore::Move(unsigned i, const vector<unsigned>& neighbours) {
+  Animal animal = Load(i);
+  bool moved = Move(animal, neighbours);
+  Store(state_, i, animal);
+  return moved;
+}
+
+bool FlockCore::MoveToCenter(unsigned i, const vector<unsigned>& neighbours) {
+  Animal animal = Load(i);
+  RandDice dice;
+  bool moved = MoveToCenter(animal, neighbours, dice);
+  Store(state_, i, animal);
+  return moved;
+}
+
+bool FlockCore::MoveRandomly(unsigned i, const vector<unsigned>& neighbours) {
+  Animal animal = Load(i);
+  RandDice dice;
+  bool moved = MoveRandomly(animal, neighbours, dice);
+  Store(state_, i, animal);
+  return moved;
+}
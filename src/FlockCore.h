@@ -0,0 +1,139 @@
+#ifndef __FLOCK_CORE_H__
+#define __FLOCK_CORE_H__
+
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+#include "Algebra.h"
+#include "SpatialGrid.h"
+
+class ThreadPool;
+
+// A flock's animals as flat double precision arrays, moved by the rules the
+// fish have always followed. Each animal takes the average velocity of the
+// neighbours within alignment range. If that would bring it within twice
+// its size of one of them, it heads for the centre of those within
+// attraction range instead, and failing that it swims off at random. The
+// neighbour search tests a few animals per SIMD lane set, reading their
+// positions in grid order; the rules themselves are scalar.
+//
+// Without a pool a step moves the animals one at a time in place, so later
+// animals see where earlier ones went, and draws from rand(), as the fish
+// always have. Given a pool, a step reads only the state the previous step
+// left and is split across the pool's threads. Its random numbers then come
+// from a counter based generator keyed by the seed and step number, so a run
+// gives the same result for any number of threads.
+class FlockCore {
+ public:
+  struct Params {
+    double size_;         // animals keep twice this apart
+    double alignment_;    // neighbours closer than this are matched in velocity
+    double attraction_;   // neighbours closer than this are swum towards
+    double max_speed_;
+    double max_random_;   // random velocities are within 1 / (2 * this) per axis
+  };
+
+  FlockCore(const Params& params, ThreadPool* pool = 0, uint64_t seed = 0);
+
+  // Returns the new animal's index.
+  unsigned Add(const Point3D& position);
+
+  unsigned GetCount() const { return state_.x_.size(); }
+  Point3D GetPosition(unsigned i) const {
+    return Point3D(state_.x_[i], state_.y_[i], state_.z_[i]); }
+  Vector3D GetVelocity(unsigned i) const {
+    return Vector3D(state_.vx_[i], state_.vy_[i], state_.vz_[i]); }
+  Point3D GetCenter() const;
+  const Params& GetParams() const { return params_; }
+
+  // While there's a destination, one animal in five heads for it each step.
+  void SetDestination(const Point3D& destination) {
+    destination_ = destination; seek_ = true; }
+  void ClearDestination() { seek_ = false; }
+
+  void Step();
+
+  // The rules for one animal, as Step() applies them in place, for moving
+  // animals by hand between steps. neighbours are animal indices.
+  void SetVelocity(unsigned i, const Vector3D& velocity);
+  bool Move(unsigned i, const std::vector<unsigned>& neighbours);
+  bool MoveToCenter(unsigned i, const std::vector<unsigned>& neighbours);
+  bool MoveRandomly(unsigned i, const std::vector<unsigned>& neighbours);
+
+ private:
+  typedef std::vector<std::pair<unsigned, unsigned> > RangeList;
+
+  // The whole flock, indexed by animal.
+  struct State {
+    std::vector<double> x_, y_, z_;
+    // The velocity the animal last moved along.
+    std::vector<double> vx_, vy_, vz_;
+    // The velocity it will move along next. Animals turn a step late.
+    std::vector<double> nx_, ny_, nz_;
+
+    void Swap(State& other);
+  };
+
+  // One animal's state while its rules run.
+  struct Animal {
+    Point3D position_;
+    Vector3D velocity_;
+    Vector3D next_velocity_;
+  };
+
+  static void StepBlock(void* core, unsigned begin, unsigned end);
+
+  Animal Load(unsigned i) const;
+  static void Store(State& state, unsigned i, const Animal& animal);
+
+  void Sort();
+  // Fills alignment and attraction with the animals other than i in range
+  // of position, in index order. The grid must hold every animal within
+  // radius of position.
+  void FindNeighbours(unsigned i, const Point3D& position, double radius,
+                      RangeList& ranges, std::vector<unsigned>& alignment,
+                      std::vector<unsigned>& attraction) const;
+
+  // The rules. Dice gives numbers from 0 to RAND_MAX, as rand() does.
+  template <class Dice>
+  void Turn(Animal& animal, const std::vector<unsigned>& alignment,
+            const std::vector<unsigned>& attraction, Dice& dice) const;
+  template <class Dice>
+  void SetVelocity(Animal& animal, const Vector3D& velocity,
+                   Dice& dice) const;
+  bool Move(Animal& animal, const std::vector<unsigned>& neighbours) const;
+  template <class Dice>
+  bool MoveToCenter(Animal& animal, const std::vector<unsigned>& neighbours,
+                    Dice& dice) const;
+  template <class Dice>
+  bool MoveRandomly(Animal& animal, const std::vector<unsigned>& neighbours,
+                    Dice& dice) const;
+  template <class Dice>
+  double Random(Dice& dice) const;
+
+  Params params_;
+  bool seek_;
+  Point3D destination_;
+
+  ThreadPool* pool_;
+  uint64_t seed_;
+  uint64_t step_;
+
+  State state_;
+  // Where a step on the pool writes the flock, swapped with state_ after.
+  State next_;
+
+  // The positions in grid order, so the animals in a bucket are contiguous.
+  SpatialGrid grid_;
+  std::vector<double> sx_, sy_, sz_;
+  // Each animal's place in grid order.
+  std::vector<unsigned> slots_;
+
+  // Reused by steps on the calling thread.
+  RangeList ranges_;
+  std::vector<unsigned> alignment_;
+  std::vector<unsigned> attraction_;
+};
+
+#endif
@@ -0,0 +1,164 @@
+#include "Forest.h"
+
+#include <cmath>
+#include <functional>
+#include <sstream>
+#include <GL/gl.h>
+
+#include "Logging.h"
+#include "Random.h"
+#include "Terrain.h"
+#include "TextureLoader.h"
+
+using std::string;
+using std::stringstream;
+using std::vector;
+
+// Height of the map between cells, interpolated from the four around it.
+static double heightAt(const HeightMap& map, double x, double z) {
+  unsigned i = (unsigned)x;
+  unsigned j = (unsigned)z;
+  double fx = x - i;
+  double fz = z - j;
+
+  double top = map[i][j] * (1 - fz) + map[i][j + 1] * fz;
+  double bottom = map[i + 1][j] * (1 - fz) + map[i + 1][j + 1] * fz;
+  return top * (1 - fx) + bottom * fx;
+}
+
+bool Forest::Key::operator<(const Key& other) const {
+  if (generator_ != other.generator_) {
+    return std::less<LSystem::Generator>()(generator_, other.generator_);
+  }
+  if (iterations_ != other.iterations_) {
+    return iterations_ < other.iterations_;
+  }
+  return seed_ < other.seed_;
+}
+
+Forest::Forest(const string& name)
+    : Node(name) {}
+
+Forest::~Forest() {
+  SpeciesMap::iterator it = species_.begin();
+  for (; it != species_.end(); it++) {
+    if (it->second.list_) {
+      glDeleteLists(it->second.list_, 1);
+    }
+    delete it->second.plant_;
+  }
+}
+
+Forest::Species* Forest::GetSpecies(LSystem::Generator generator,
+                                    unsigned iterations, unsigned seed) {
+  Key key = {generator, iterations, seed};
+  SpeciesMap::iterator it = species_.find(key);
+  if (it != species_.end()) {
+    return &it->second;
+  }
+
+  stringstream ss;
+  ss << name_ << '-' << species_.size();
+  Node* plant = generator(ss.str(), iterations, seed);
+  if (!plant) {
+    ERROR("Could not generate " << ss.str());
+    return NULL;
+  }
+
+  Species& species = species_[key];
+  species.plant_ = plant;
+  species.list_ = 0;
+  return &species;
+}
+
+void Forest::AddInstance(LSystem::Generator generator, unsigned iterations,
+                         unsigned seed, const Matrix4x4& transform) {
+  Species* species = GetSpecies(generator, iterations, seed);
+  if (species) {
+    species->instances_.push_back(transform.Transpose());
+  }
+}
+
+unsigned Forest::Scatter(const HeightMap& map, LSystem::Generator generator,
+                         unsigned iterations, unsigned variants,
+                         unsigned count, double min_scale, double max_scale,
+                         double min_height, unsigned seed) {
+  if (map.GetWidth() < 2 || map.GetLength() < 2 || !variants) {
+    return 0;
+  }
+
+  CounterRandom random(seed);
+  double width = map.GetWidth() - 1;
+  double length = map.GetLength() - 1;
+
+  // Give up on low ground after a fixed number of tries rather than looping
+  // forever over a map that is mostly under min_height.
+  unsigned placed = 0;
+  for (unsigned attempt = 0; placed < count && attempt < 8 * count;
+       attempt++) {
+    uint64_t counter = 5 * (uint64_t)attempt;
+    double x = random.Uniform(counter) * width;
+    double z = random.Uniform(counter + 1) * length;
+    double height = heightAt(map, x, z);
+    if (height < min_height) {
+      continue;
+    }
+
+    double angle = 2 * M_PI * random.Uniform(counter + 2);
+    double scale = min_scale +
+                   (max_scale - min_scale) * random.Uniform(counter + 3);
+    unsigned variant = random.Get(counter + 4) % variants;
+
+    double c = cos(angle) * scale;
+    double s = sin(angle) * scale;
+    Matrix4x4 transform(Vector4D(c, 0, s, x),
+                        Vector4D(0, scale, 0, height),
+                        Vector4D(-s, 0, c, z),
+                        Vector4D(0, 0, 0, 1));
+    AddInstance(generator, iterations, seed + variant, transform);
+    placed++;
+  }
+
+  return placed;
+}
+
+unsigned Forest::GetInstanceCount() const {
+  unsigned count = 0;
+  SpeciesMap::const_iterator it = species_.begin();
+  for (; it != species_.end(); it++) {
+    count += it->second.instances_.size();
+  }
+  return count;
+}
+
+void Forest::Render() const {
+  glPushMatrix();
+  glMultTransposeMatrixd(transformation_.Begin());
+
+  SpeciesMap::const_iterator it = species_.begin();
+  for (; it != species_.end(); it++) {
+    const Species& species = it->second;
+    if (!species.list_) {
+      TextureLoader::GetDefault()->Finish();
+      species.list_ = glGenLists(1);
+      glNewList(species.list_, GL_COMPILE);
+      species.plant_->Render();
+      glEndList();
+    }
+
+    vector<Matrix4x4>::const_iterator instance = species.instances_.begin();
+    for (; instance != species.instances_.end(); instance++) {
+      glPushMatrix();
+      glMultMatrixd(instance->Begin());
+      glCallList(species.list_);
+      glPopMatrix();
+    }
+  }
+
+  ChildList::const_iterator child = children_.begin();
+  for (; child != children_.end(); child++) {
+    (*child)->Render();
+  }
+
+  glPopMatrix();
+}
@@ -0,0 +1,69 @@
+#ifndef __FOREST_H__
+#define __FOREST_H__
+
+#include <map>
+#include <vector>
+
+#include "Algebra.h"
+#include "LSystem.h"
+#include "Node.h"
+
+class HeightMap;
+
+// Many placements of a few plants. Each distinct (generator, iterations,
+// seed) is generated once, and its node graph is compiled into a display list
+// on first render. Every placement of it then costs one transform and one
+// call of that list, so memory and traversal grow with the number of species
+// rather than the number of plants.
+//
+// Placements are in the forest node's coordinates; add the forest under a
+// height map's node to scatter plants over the map.
+class Forest : public Node {
+ public:
+  Forest(const std::string& name);
+  virtual ~Forest();
+
+  void AddInstance(LSystem::Generator generator, unsigned iterations,
+                   unsigned seed, const Matrix4x4& transform);
+
+  // Places count plants at random points of the map at or above min_height,
+  // each turned by a random angle and scaled by between min_scale and
+  // max_scale. The plants are spread over variants seeds starting at seed.
+  // Returns the number placed, which is fewer than count if too few points
+  // are high enough.
+  unsigned Scatter(const HeightMap& map, LSystem::Generator generator,
+                   unsigned iterations, unsigned variants, unsigned count,
+                   double min_scale, double max_scale, double min_height,
+                   unsigned seed);
+
+  unsigned GetSpeciesCount() const { return species_.size(); }
+  unsigned GetInstanceCount() const;
+
+  virtual void Render() const;
+  virtual bool RendersSubtree() const { return true; }
+
+ private:
+  struct Key {
+    LSystem::Generator generator_;
+    unsigned iterations_;
+    unsigned seed_;
+
+    bool operator<(const Key& other) const;
+  };
+
+  struct Species {
+    Node* plant_;
+    mutable unsigned list_;
+    // Transposed, ready for glMultMatrixd.
+    std::vector<Matrix4x4> instances_;
+  };
+
+  typedef std::map<Key, Species> SpeciesMap;
+
+  Species* GetSpecies(LSystem::Generator generator, unsigned iterations,
+                      unsigned seed);
+
+  SpeciesMap species_;
+};
+
+#endif
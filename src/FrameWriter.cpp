@@ -0,0 +1,188 @@
+#include "FrameWriter.h"
+
+#include <csetjmp>
+#include <cstdio>
+#include <jpeglib.h>
+
+#include "Logging.h"
+#include "Profiler.h"
+
+using std::string;
+using std::vector;
+
+FrameWriter::FrameWriter(unsigned limit, int quality)
+    : quit_(false)
+    , writing_(0)
+    , limit_(limit ? limit : 1)
+    , failures_(0)
+    , quality_(quality) {
+  pthread_mutex_init(&mutex_, NULL);
+  pthread_cond_init(&queued_, NULL);
+  pthread_cond_init(&written_, NULL);
+  pthread_create(&thread_, NULL, WorkerMain, this);
+}
+
+FrameWriter::~FrameWriter() {
+  Finish();
+
+  pthread_mutex_lock(&mutex_);
+  quit_ = true;
+  pthread_cond_broadcast(&queued_);
+  pthread_mutex_unlock(&mutex_);
+  pthread_join(thread_, NULL);
+
+  pthread_cond_destroy(&written_);
+  pthread_cond_destroy(&queued_);
+  pthread_mutex_destroy(&mutex_);
+}
+
+void FrameWriter::Write(const string& file_name, unsigned width,
+                        unsigned height, vector<unsigned char>& pixels) {
+  Frame* frame = new Frame;
+  frame->file_name_ = file_name;
+  frame->width_ = width;
+  frame->height_ = height;
+  frame->pixels_.swap(pixels);
+
+  PROFILE_ZONE("Frame writer wait");
+  pthread_mutex_lock(&mutex_);
+  while (queue_.size() >= limit_) {
+    pthread_cond_wait(&written_, &mutex_);
+  }
+  queue_.push_back(frame);
+  pthread_cond_signal(&queued_);
+  pthread_mutex_unlock(&mutex_);
+}
+
+unsigned FrameWriter::Finish() {
+  pthread_mutex_lock(&mutex_);
+  while (!queue_.empty() || writing_ > 0) {
+    pthread_cond_wait(&written_, &mutex_);
+  }
+  unsigned failures = failures_;
+  pthread_mutex_unlock(&mutex_);
+  return failures;
+}
+
+void* FrameWriter::WorkerMain(void* arg) {
+  FrameWriter* writer = (FrameWriter*)arg;
+  Profiler::SetThreadName("Frame writer");
+
+  while (true) {
+    pthread_mutex_lock(&writer->mutex_);
+    while (!writer->quit_ && writer->queue_.empty()) {
+      pthread_cond_wait(&writer->queued_, &writer->mutex_);
+    }
+
+    if (writer->queue_.empty()) {
+      pthread_mutex_unlock(&writer->mutex_);
+      return NULL;
+    }
+
+    Frame* frame = writer->queue_.front();
+    writer->queue_.pop_front();
+    writer->writing_++;
+    pthread_mutex_unlock(&writer->mutex_);
+
+    bool written;
+    {
+      PROFILE_ZONE("Frame encode");
+      written = writer->Encode(*frame);
+    }
+    if (!written) {
+      ERROR("Unable to write " << frame->file_name_);
+    }
+    delete frame;
+
+    pthread_mutex_lock(&writer->mutex_);
+    writer->writing_--;
+    if (!written) {
+      writer->failures_++;
+    }
+    pthread_cond_broadcast(&writer->written_);
+    pthread_mutex_unlock(&writer->mutex_);
+  }
+}
+
+// libjpeg reports fatal errors through error_exit, which exits by default.
+// Jump back out of the encode instead.
+struct JpegError {
+  jpeg_error_mgr manager_;
+  jmp_buf jump_;
+};
+
+static void jpegErrorExit(j_common_ptr info) {
+  longjmp(((JpegError*)info->err)->jump_, 1);
+}
+
+static bool writeJpeg(FILE* out_file, unsigned width, unsigned height,
+                      const vector<unsigned char>& pixels, int quality) {
+  jpeg_compress_struct jpeg_info;
+  JpegError jpeg_error;
+  jpeg_info.err = jpeg_std_error(&jpeg_error.manager_);
+  jpeg_error.manager_.error_exit = jpegErrorExit;
+  if (setjmp(jpeg_error.jump_)) {
+    jpeg_destroy_compress(&jpeg_info);
+    return false;
+  }
+
+  jpeg_create_compress(&jpeg_info);
+  jpeg_stdio_dest(&jpeg_info, out_file);
+  jpeg_info.image_width = width;
+  jpeg_info.image_height = height;
+  jpeg_info.input_components = 3;
+  jpeg_info.in_color_space = JCS_RGB;
+  jpeg_set_defaults(&jpeg_info);
+  jpeg_set_quality(&jpeg_info, quality, TRUE);
+  jpeg_start_compress(&jpeg_info, TRUE);
+
+  // GL's rows go from the bottom up and JPEG's from the top down.
+  unsigned stride = width * 3;
+  while (jpeg_info.next_scanline < height) {
+    unsigned row = height - 1 - jpeg_info.next_scanline;
+    JSAMPROW line = (JSAMPROW)&pixels[row * stride];
+    jpeg_write_scanlines(&jpeg_info, &line, 1);
+  }
+
+  jpeg_finish_compress(&jpeg_info);
+  jpeg_destroy_compress(&jpeg_info);
+  return true;
+}
+
+static bool writePpm(FILE* out_file, unsigned width, unsigned height,
+                     const vector<unsigned char>& pixels) {
+  fprintf(out_file, "P6\n%u %u\n255\n", width, height);
+  unsigned stride = width * 3;
+  for (unsigned row = height; row-- > 0;) {
+    if (fwrite(&pixels[row * stride], 1, stride, out_file) != stride) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool FrameWriter::Encode(const Frame& frame) const {
+  if (frame.pixels_.size() < frame.width_ * frame.height_ * 3) {
+    return false;
+  }
+
+  FILE* out_file = fopen(frame.file_name_.c_str(), "wb");
+  if (!out_file) {
+    return false;
+  }
+
+  const string& name = frame.file_name_;
+  bool ppm = name.size() >= 4 && name.compare(name.size() - 4, 4, ".ppm") == 0;
+  bool written;
+  if (ppm) {
+    written = writePpm(out_file, frame.width_, frame.height_, frame.pixels_);
+  } else {
+    written = writeJpeg(out_file, frame.width_, frame.height_, frame.pixels_,
+                        quality_);
+  }
+
+  if (fclose(out_file) != 0) {
+    written = false;
+  }
+  return written;
+}
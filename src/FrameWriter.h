@@ -0,0 +1,58 @@
+#ifndef __FRAME_WRITER_H__
+#define __FRAME_WRITER_H__
+
+#include <deque>
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+// Encodes rendered frames to image files on a thread of its own, so the GL
+// thread can draw the next frame while the last one is written. File names
+// ending in .ppm get a binary PPM and anything else a JPEG.
+//
+// Write() waits while limit frames are already queued, so a slow disk holds
+// rendering back rather than filling memory.
+class FrameWriter {
+ public:
+  FrameWriter(unsigned limit = 4, int quality = 90);
+  // Writes whatever is still queued first.
+  ~FrameWriter();
+
+  // Takes the pixels, tightly packed RGB rows from the bottom up as
+  // glReadPixels returns them, and leaves pixels empty.
+  void Write(const std::string& file_name, unsigned width, unsigned height,
+             std::vector<unsigned char>& pixels);
+
+  // Waits for everything queued to be written. Returns how many files
+  // couldn't be, ever.
+  unsigned Finish();
+
+ private:
+  FrameWriter(const FrameWriter&);
+  FrameWriter& operator=(const FrameWriter&);
+
+  struct Frame {
+    std::string file_name_;
+    unsigned width_;
+    unsigned height_;
+    std::vector<unsigned char> pixels_;
+  };
+
+  static void* WorkerMain(void* writer);
+  bool Encode(const Frame& frame) const;
+
+  pthread_t thread_;
+  pthread_mutex_t mutex_;
+  pthread_cond_t queued_;
+  pthread_cond_t written_;
+  bool quit_;
+
+  std::deque<Frame*> queue_;
+  // Frames taken off the queue and not yet written.
+  unsigned writing_;
+  unsigned limit_;
+  unsigned failures_;
+  int quality_;
+};
+
+#endif
@@ -0,0 +1,196 @@
+#include "Headless.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <GL/gl.h>
+#include <iostream>
+#include <vector>
+
+#include "DemoScene.h"
+#include "FrameWriter.h"
+#include "Profiler.h"
+
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+
+namespace Headless {
+
+// Mesa's surfaceless platform needs no window system at all; anything else
+// gets whatever the default display is.
+static EGLDisplay openDisplay() {
+  const char* extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+  PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+      (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress(
+          "eglGetPlatformDisplayEXT");
+  if (extensions && getPlatformDisplay &&
+      strstr(extensions, "EGL_MESA_platform_surfaceless")) {
+    EGLDisplay display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA,
+                                            EGL_DEFAULT_DISPLAY, NULL);
+    if (display != EGL_NO_DISPLAY && eglInitialize(display, NULL, NULL)) {
+      return display;
+    }
+  }
+
+  EGLDisplay display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+  if (display != EGL_NO_DISPLAY && eglInitialize(display, NULL, NULL)) {
+    return display;
+  }
+  return EGL_NO_DISPLAY;
+}
+
+// Whether pattern has exactly one conversion, and that one for an int: %d,
+// %i or %u, optionally with flags, a width and a precision, like %04d. It's
+// handed straight to snprintf, so anything else would read arguments that
+// aren't there, and a pattern without one would write every frame to one
+// file.
+static bool checkPattern(const string& pattern) {
+  unsigned conversions = 0;
+  for (size_t i = 0; i < pattern.size(); i++) {
+    if (pattern[i] != '%') {
+      continue;
+    }
+    i++;
+    if (i < pattern.size() && pattern[i] == '%') {
+      continue;
+    }
+
+    while (i < pattern.size() && pattern[i] && strchr("-+ #0", pattern[i])) {
+      i++;
+    }
+    while (i < pattern.size() && isdigit(pattern[i])) {
+      i++;
+    }
+    if (i < pattern.size() && pattern[i] == '.') {
+      i++;
+      while (i < pattern.size() && isdigit(pattern[i])) {
+        i++;
+      }
+    }
+    if (i >= pattern.size() || !pattern[i] || !strchr("diu", pattern[i])) {
+      return false;
+    }
+    conversions++;
+  }
+  return conversions == 1;
+}
+
+bool Render(char mode, unsigned frames, unsigned width, unsigned height,
+            const string& pattern) {
+  if (!pattern.empty() && !checkPattern(pattern)) {
+    std::cerr << "The file pattern needs exactly one %d, like "
+              << "frames/%04d.jpg" << endl;
+    return false;
+  }
+
+  EGLDisplay display = openDisplay();
+  if (display == EGL_NO_DISPLAY) {
+    std::cerr << "Unable to open an EGL display" << endl;
+    return false;
+  }
+
+  EGLint config_attributes[] = {
+    EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+    EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+    EGL_RED_SIZE, 8,
+    EGL_GREEN_SIZE, 8,
+    EGL_BLUE_SIZE, 8,
+    EGL_DEPTH_SIZE, 24,
+    EGL_NONE
+  };
+  EGLint surface_attributes[] = {
+    EGL_WIDTH, (EGLint)width,
+    EGL_HEIGHT, (EGLint)height,
+    EGL_NONE
+  };
+  EGLConfig config;
+  EGLint configs = 0;
+  EGLSurface surface = EGL_NO_SURFACE;
+  EGLContext context = EGL_NO_CONTEXT;
+  if (eglChooseConfig(display, config_attributes, &config, 1, &configs) &&
+      configs > 0 && eglBindAPI(EGL_OPENGL_API)) {
+    surface = eglCreatePbufferSurface(display, config, surface_attributes);
+    context = eglCreateContext(display, config, EGL_NO_CONTEXT, NULL);
+  }
+  if (surface == EGL_NO_SURFACE || context == EGL_NO_CONTEXT ||
+      !eglMakeCurrent(display, surface, surface, context)) {
+    std::cerr << "Unable to create an offscreen GL context" << endl;
+    eglTerminate(display);
+    return false;
+  }
+
+  cout << "Rendering " << frames << " frames of '" << mode << "' at "
+       << width << "x" << height << " with "
+       << (const char*)glGetString(GL_RENDERER) << endl;
+
+  Profiler::SetThreadName("Main");
+  srand(1);
+
+  unsigned failures = 0;
+  vector<double> times;
+  uint64_t start = Profiler::Now();
+  {
+    DemoScene scene(mode);
+    scene.Realize();
+    double setup = (Profiler::Now() - start) * 1e-9;
+    cout << "  setup: " << setup * 1e3 << " ms" << endl;
+
+    FrameWriter writer;
+    vector<unsigned char> pixels;
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+
+    start = Profiler::Now();
+    for (unsigned i = 0; i < frames; i++) {
+      uint64_t frame_start = Profiler::Now();
+      scene.Draw(width, height);
+
+      if (!pattern.empty()) {
+        PROFILE_ZONE("Read pixels");
+        pixels.resize(width * height * 3);
+        glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE,
+                     &pixels[0]);
+
+        char file_name[1024];
+        snprintf(file_name, sizeof(file_name), pattern.c_str(), i);
+        writer.Write(file_name, width, height, pixels);
+      } else {
+        glFinish();
+      }
+
+      Profiler::EndFrame();
+      times.push_back((Profiler::Now() - frame_start) * 1e-9);
+    }
+    failures = writer.Finish();
+  }
+  double elapsed = (Profiler::Now() - start) * 1e-9;
+
+  if (!times.empty()) {
+    vector<double> sorted = times;
+    std::sort(sorted.begin(), sorted.end());
+    double total = 0.0;
+    for (unsigned i = 0; i < times.size(); i++) {
+      total += times[i];
+    }
+    cout << "  frames: mean " << total / times.size() * 1e3 << " ms, median "
+         << sorted[sorted.size() / 2] * 1e3 << " ms, min "
+         << sorted.front() * 1e3 << " ms, max " << sorted.back() * 1e3
+         << " ms" << endl;
+    cout << "  " << frames / elapsed << " frames/s including writing, "
+         << failures << " frames not written" << endl;
+  }
+
+  eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+  eglDestroyContext(display, context);
+  eglDestroySurface(display, surface);
+  eglTerminate(display);
+
+  return failures == 0;
+}
+
+}
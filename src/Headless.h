@@ -0,0 +1,23 @@
+#ifndef __HEADLESS_H__
+#define __HEADLESS_H__
+
+#include <string>
+
+// Rendering without a display, started with the 'h' mode. Frames are drawn
+// into an EGL pbuffer, which with Mesa and no display at all means llvmpipe's
+// software rasteriser.
+namespace Headless {
+  // Draws frames frames of the scene for mode (as the window would show it)
+  // at width x height, writes frame i to the file named by printf'ing i into
+  // pattern, like "frames/%04d.jpg", then prints how long frames took. An
+  // empty pattern only times the frames; any other needs exactly one %d, %i
+  // or %u, with any flags and width. The scene is seeded the same way on
+  // every run, so runs can be compared.
+  //
+  // Returns false if there is no context to render with or any frame
+  // couldn't be written.
+  bool Render(char mode, unsigned frames, unsigned width, unsigned height,
+              const std::string& pattern);
+};
+
+#endif
@@ -1,12 +1,16 @@
 #include "LSystem.h"
 
+#include <algorithm>
 #include <cstdlib>
 #include <sstream>
 
 #include "Logging.h"
+#include "Random.h"
 
+using std::fill;
 using std::string;
 using std::stringstream;
+using std::vector;
 
 void yawLeft(LSystem::TurtleState&, double);
 void yawRight(LSystem::TurtleState&, double);
@@ -20,6 +24,7 @@ void decreaseWidth(LSystem::TurtleState&, double);
 void drawForward(LSystem::TurtleState&, double);
 
 LSystem::EvalRules LSystem::common_eval_;
+const unsigned char LSystem::Tokens::kParameter;
 
 void LSystem::InitializeCommonRules() {
   common_eval_['+'] = yawLeft;
@@ -33,115 +38,334 @@ void LSystem::InitializeCommonRules() {
   common_eval_['!'] = decreaseWidth;
 }
 
-Node* LSystem::Generate(ExpandRules expand, EvalRules eval, TurtleState state) {
-  if (!common_eval_.size()) {
-    InitializeCommonRules();
+bool LSystem::Tokens::Parse(const string& text) {
+  Clear();
+  symbols_.reserve(text.size());
+
+  for (unsigned i = 0; i < text.size(); i++) {
+    unsigned char c = text[i];
+    bool parameter = c == '(' && !symbols_.empty() &&
+                     !(symbols_[symbols_.size() - 1] & kParameter);
+
+    if (parameter) {
+      size_t pos = text.find(')', i);
+      if (pos == string::npos) {
+        stringstream ss;
+        ss << "Parse error (pos: " << i << "): Unmatched '(' in turtle!";
+        ERROR(ss.str());
+        Clear();
+        return false;
+      }
+
+      stringstream ss(text.substr(i + 1, pos - i - 1));
+      double value = 0.0;
+      ss >> value;
+      parameters_.push_back(value);
+      symbols_[symbols_.size() - 1] |= kParameter;
+      i = pos;
+      continue;
+    }
+
+    if (c & kParameter) {
+      stringstream ss;
+      ss << "Parse error (pos: " << i << "): Non-ASCII symbol in turtle!";
+      ERROR(ss.str());
+      Clear();
+      return false;
+    }
+    symbols_ += c;
   }
 
-  // Insert rules into a copy of common_eval so the caller can overwrite any of
-  // the common_eval rules.
-  EvalRules temp = common_eval_;
-  temp.insert(eval.begin(), eval.end());
-  eval = temp;
+  return true;
+}
 
-  if (!eval['F']) {
-    eval['F'] = drawForward;
+string LSystem::Tokens::ToString() const {
+  stringstream ss;
+  unsigned p = 0;
+  for (unsigned i = 0; i < symbols_.size(); i++) {
+    unsigned char c = symbols_[i];
+    ss << (char)(c & ~kParameter);
+    if (c & kParameter) {
+      ss << '(' << parameters_[p++] << ')';
+    }
   }
+  return ss.str();
+}
 
-  for (unsigned i = 0; i < state.iterations_; i++) {
-    for (unsigned j = 0; j < state.turtle_.size(); j++) {
-      if (expand.find(state.turtle_[j]) == expand.end()) {
-        continue;
+// An expand rule with its replacement already parsed, held in a table
+// indexed by symbol.
+struct CompiledRule {
+  CompiledRule() : callback_(NULL), defined_(false) {}
+
+  LSystem::Tokens replacement_;
+  LSystem::ExpandCallback callback_;
+  bool defined_;
+};
+
+static bool compileRules(const LSystem::ExpandRules& expand,
+                         vector<CompiledRule>& rules) {
+  rules.assign(LSystem::Tokens::kParameter, CompiledRule());
+
+  LSystem::ExpandRules::const_iterator it;
+  for (it = expand.begin(); it != expand.end(); ++it) {
+    unsigned char symbol = it->first;
+    if (symbol & LSystem::Tokens::kParameter) {
+      continue;
+    }
+
+    CompiledRule& rule = rules[symbol];
+    if (!rule.replacement_.Parse(it->second.first)) {
+      return false;
+    }
+    rule.callback_ = it->second.second;
+    rule.defined_ = true;
+  }
+
+  return true;
+}
+
+// One generation. A symbol's own parameter, passed through the rule's
+// callback, moves to the last symbol of its replacement.
+static void rewrite(const vector<CompiledRule>& rules,
+                    LSystem::TurtleState& state, const LSystem::Tokens& in,
+                    LSystem::Tokens& out) {
+  const unsigned char kParameter = LSystem::Tokens::kParameter;
+  out.Clear();
+
+  unsigned p = 0;
+  for (unsigned i = 0; i < in.symbols_.size(); i++) {
+    unsigned char c = in.symbols_[i];
+    double parameter = 0.0;
+    if (c & kParameter) {
+      parameter = in.parameters_[p++];
+    }
+
+    const CompiledRule& rule = rules[c & ~kParameter];
+    if (!rule.defined_) {
+      out.symbols_ += c;
+      if (c & kParameter) {
+        out.parameters_.push_back(parameter);
       }
+      continue;
+    }
+
+    const LSystem::Tokens& replacement = rule.replacement_;
+    out.symbols_.append(replacement.symbols_);
+    out.parameters_.insert(out.parameters_.end(),
+                           replacement.parameters_.begin(),
+                           replacement.parameters_.end());
 
-      ExpandPair rule = expand[state.turtle_[j]];
-      string replacement = rule.first;
-      state.turtle_.replace(j, 1, replacement);
-      j += replacement.size() - 1;
-
-      if (state.turtle_[j + 1] == '(') {
-        size_t pos = state.turtle_.find(')', j + 1);
-        if (pos == string::npos) {
-          stringstream ss;
-          ss << "Parse error (pos: " << (j + 1) << "): Unmatched '(' in turtle!";
-          ERROR(ss.str());
-          return NULL;
-        }
-
-        stringstream ss(state.turtle_.substr(j + 2, pos - j - 2));
-        double parameter;
-        ss >> parameter;
-
-        if (rule.second) {
-          parameter = rule.second(state, parameter);
-          state.turtle_.erase(j + 2, pos - j - 2);
-          stringstream ss;
-          ss << parameter;
-          state.turtle_.insert(j + 2, ss.str());
-        }
-        
-        j = pos - 1;
+    if (c & kParameter) {
+      if (rule.callback_) {
+        parameter = rule.callback_(state, parameter);
+      }
+
+      // A replacement ending in a symbol with its own parameter keeps that.
+      unsigned last = out.symbols_.size() - 1;
+      if (!replacement.symbols_.empty() && !(out.symbols_[last] & kParameter)) {
+        out.symbols_[last] |= kParameter;
+        out.parameters_.push_back(parameter);
       }
     }
   }
+}
 
-  Node* wrapper = new Node(state.name_ + "-wrapper");
-  GeometryNode* root = Node::CreateMeshNode(state.name_ + "-root", "data/img/tree_bark.jpg");
-  state.current_node_ = root;
-  wrapper->AddChild(root);
+bool LSystem::Expand(const ExpandRules& expand, TurtleState& state,
+                     Tokens& turtle) {
+  vector<CompiledRule> rules;
+  if (!compileRules(expand, rules) || !turtle.Parse(state.turtle_)) {
+    return false;
+  }
+
+  // The two buffers swap each generation, so after the first couple they
+  // stop reallocating.
+  Tokens next;
+  for (unsigned i = 0; i < state.iterations_; i++) {
+    rewrite(rules, state, turtle, next);
+    turtle.symbols_.swap(next.symbols_);
+    turtle.parameters_.swap(next.parameters_);
+  }
 
-  for (unsigned i = 0; i < state.turtle_.size(); i++) {
-    if (eval.find(state.turtle_[i]) == eval.end()) {
+  return true;
+}
+
+// Eval rules as a table indexed by symbol.
+static void compileEval(const LSystem::EvalRules& eval,
+                        LSystem::EvalCallback* callbacks) {
+  fill(callbacks, callbacks + LSystem::Tokens::kParameter,
+       (LSystem::EvalCallback)NULL);
+
+  LSystem::EvalRules::const_iterator it;
+  for (it = eval.begin(); it != eval.end(); ++it) {
+    unsigned char symbol = it->first;
+    if (!(symbol & LSystem::Tokens::kParameter)) {
+      callbacks[symbol] = it->second;
+    }
+  }
+}
+
+// One level of the depth-first walk: the replacement being read, and the
+// parameter its parent symbol hands on to its last symbol.
+struct DerivationLevel {
+  const LSystem::Tokens* tokens_;
+  unsigned next_;
+  unsigned parameter_;
+  unsigned depth_;
+  bool carry_;
+  double carried_;
+};
+
+bool LSystem::Derive(const ExpandRules& expand, const EvalRules& eval,
+                     TurtleState& state) {
+  const unsigned char kParameter = Tokens::kParameter;
+
+  vector<CompiledRule> rules;
+  Tokens axiom;
+  if (!compileRules(expand, rules) || !axiom.Parse(state.turtle_)) {
+    return false;
+  }
+
+  EvalCallback callbacks[Tokens::kParameter];
+  compileEval(eval, callbacks);
+
+  vector<DerivationLevel> stack;
+  stack.reserve(state.iterations_ + 1);
+  DerivationLevel root = { &axiom, 0, 0, 0, false, 0.0 };
+  stack.push_back(root);
+
+  while (!stack.empty()) {
+    DerivationLevel& level = stack.back();
+    const Tokens& tokens = *level.tokens_;
+    if (level.next_ == tokens.symbols_.size()) {
+      stack.pop_back();
       continue;
     }
 
+    unsigned char c = tokens.symbols_[level.next_++];
+    bool has_parameter = c & kParameter;
     double parameter = 0.0;
-    size_t pos = string::npos;
-    if (state.turtle_[i + 1] == '(') {
-      pos = state.turtle_.find(')', i + 1);
-      if (pos == string::npos) {
-        stringstream ss;
-        ss << "Parse error (pos: " << (i + 1) << "): Unmatched '(' in turtle!";
-        ERROR(ss.str());
-        delete root;
-        return NULL;
+    if (has_parameter) {
+      parameter = tokens.parameters_[level.parameter_++];
+    } else if (level.carry_ && level.next_ == tokens.symbols_.size()) {
+      has_parameter = true;
+      parameter = level.carried_;
+    }
+
+    unsigned char symbol = c & ~kParameter;
+    const CompiledRule& rule = rules[symbol];
+    if (level.depth_ < state.iterations_ && rule.defined_) {
+      if (has_parameter && rule.callback_) {
+        parameter = rule.callback_(state, parameter);
       }
 
-      stringstream ss(state.turtle_.substr(i + 2, pos - i - 2));
-      ss >> parameter;
+      DerivationLevel child = { &rule.replacement_, 0, 0, level.depth_ + 1,
+                           has_parameter, parameter };
+      stack.push_back(child);
+      continue;
     }
 
-    EvalCallback callback = eval[state.turtle_[i]];
+    EvalCallback callback = callbacks[symbol];
     if (callback) {
       callback(state, parameter);
     }
+  }
 
-    if (pos != string::npos) {
-      i = pos;
+  return true;
+}
+
+Node* LSystem::Generate(ExpandRules expand, EvalRules eval, TurtleState state,
+                        Derivation derivation) {
+  if (!common_eval_.size()) {
+    InitializeCommonRules();
+  }
+
+  // Insert rules into a copy of common_eval so the caller can overwrite any of
+  // the common_eval rules.
+  EvalRules temp = common_eval_;
+  temp.insert(eval.begin(), eval.end());
+  eval = temp;
+
+  if (!eval['F']) {
+    eval['F'] = drawForward;
+  }
+
+  Tokens turtle;
+  if (derivation == EXPANDED && !Expand(expand, state, turtle)) {
+    return NULL;
+  }
+
+  // Asked for first so the bark decodes while the plant grows.
+  Texture* bark = AssetCache::GetTexture("data/img/tree_bark.jpg");
+
+  // The turtle grows a node per branch; they are baked into one buffer once
+  // the plant is finished.
+  GeometryNode* branches = Node::CreateMeshNode(state.name_ + "-branches");
+  state.current_node_ = branches;
+  double trunk_width = state.width_;
+
+  if (derivation == LAZY) {
+    if (!Derive(expand, eval, state)) {
+      delete branches;
+      bark->Release();
+      return NULL;
+    }
+  } else {
+    EvalCallback callbacks[Tokens::kParameter];
+    compileEval(eval, callbacks);
+
+    unsigned p = 0;
+    for (unsigned i = 0; i < turtle.symbols_.size(); i++) {
+      unsigned char c = turtle.symbols_[i];
+      double parameter = 0.0;
+      if (c & Tokens::kParameter) {
+        parameter = turtle.parameters_[p++];
+      }
+
+      EvalCallback callback = callbacks[c & ~Tokens::kParameter];
+      if (callback) {
+        callback(state, parameter);
+      }
     }
   }
 
+  // Branches a quarter as wide as the trunk or less get fewer sides.
+  BakedMesh* baked = new BakedMesh();
+  branches->Bake(Matrix4x4(), *baked, BakedMesh::Lod(8, 3, trunk_width / 4));
+  delete branches;
+
+  Node* wrapper = new Node(state.name_ + "-wrapper");
+  wrapper->AddChild(new GeometryNode(state.name_ + "-root", baked, bark));
   return wrapper;
 }
 
-Node* LSystem::GenerateAlgae(string name) {
+// Scales value by a factor within amount of 1, picked by seed and counter.
+// Seed 0 leaves every value as designed.
+static double vary(unsigned seed, unsigned counter, double value,
+                   double amount) {
+  if (!seed) {
+    return value;
+  }
+  CounterRandom random(seed);
+  return value * (1.0 + amount * (2.0 * random.Uniform(counter) - 1.0));
+}
+
+Node* LSystem::GenerateAlgae(string name, unsigned, unsigned) {
   return NULL;
 }
 
-Node* LSystem::GenerateGrass(string name) {
+Node* LSystem::GenerateGrass(string name, unsigned iterations,
+                             unsigned seed) {
   ExpandRules expand;
   expand['F'] = ExpandPair("FF", NULL);
   expand['X'] = ExpandPair("F-[[X]+X]+F[+FX]-X", NULL);
 
   EvalRules eval;
 
-  unsigned iterations = 6;
-
-  TurtleState state("X", iterations, 25.0, 5, name);
-  return Generate(expand, eval, state);
+  TurtleState state("X", iterations, vary(seed, 0, 25.0, 0.2), 5, name);
+  return Generate(expand, eval, state, LAZY);
 }
 
-Node* LSystem::GenerateFlower(string name) {
+Node* LSystem::GenerateFlower(string name, unsigned, unsigned) {
   return NULL;
 }
 
@@ -153,7 +377,8 @@ void changeColour(LSystem::TurtleState&, double) {
   //
 }
 
-Node* LSystem::GenerateBush(string name) {
+Node* LSystem::GenerateBush(string name, unsigned iterations,
+                            unsigned seed) {
   ExpandRules expand;
   expand['A'] = ExpandPair("[&FL!A]<<<<<'[&FL!A]<<<<<<<'[&FL!A]", NULL);
   expand['F'] = ExpandPair("S<<<<<F", NULL);
@@ -164,9 +389,8 @@ Node* LSystem::GenerateBush(string name) {
   eval['f'] = drawLeaf;
   eval['\''] = changeColour;
 
-  unsigned iterations = 6;
-  TurtleState state("A", iterations, 22.5, 5, name);
-  return Generate(expand, eval, state);
+  TurtleState state("A", iterations, vary(seed, 0, 22.5, 0.2), 5, name);
+  return Generate(expand, eval, state, LAZY);
 }
 
 /**
@@ -191,11 +415,15 @@ double treeWidthCallback(LSystem::TurtleState& state, double value) {
   return data->width_rate * value;
 }
 
-Node* LSystem::GenerateTree(string name) {
+Node* LSystem::GenerateTree(string name, unsigned iterations, unsigned seed) {
   ExpandRules expand;
   
   TreeData data = {94.74, 132.63, 18.95, 1.109, 1.732};
   //TreeData data = {112.50, 157.50, 22.50, 1.790, 1.732};
+  data.diverge_angle1 = vary(seed, 0, data.diverge_angle1, 0.1);
+  data.diverge_angle2 = vary(seed, 1, data.diverge_angle2, 0.1);
+  data.branching_angle = vary(seed, 2, data.branching_angle, 0.2);
+  data.elongation_rate = vary(seed, 3, data.elongation_rate, 0.05);
 
   stringstream a_ss;
   a_ss << "!(" << data.width_rate << ")F(50)[&(" << data.branching_angle
@@ -208,12 +436,10 @@ Node* LSystem::GenerateTree(string name) {
 
   EvalRules eval;
 
-  unsigned iterations = 6;
-
   TurtleState state("!(1)F(200)<(45)A", iterations, 30.0,
                     pow(data.width_rate, iterations), name);
   state.data_ = &data;
-  return Generate(expand, eval, state);
+  return Generate(expand, eval, state, LAZY);
 }
 
 LSystem::TurtleState::TurtleState(string turtle, unsigned iterations,
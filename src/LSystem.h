@@ -5,6 +5,7 @@
 #include <stack>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include "Algebra.h"
 #include "Node.h"
@@ -43,15 +44,60 @@ class LSystem {
   typedef void (*EvalCallback)(TurtleState&, double);
   typedef std::map<char, EvalCallback> EvalRules;
 
-  static void InitializeCommonRules();
+  // A turtle compiled for rewriting: one byte per symbol, with the
+  // parameter of a symbol written "X(p)" kept as a double alongside it.
+  struct Tokens {
+    static const unsigned char kParameter = 0x80;
+
+    // Returns false, having logged why, if the text can't be parsed.
+    bool Parse(const std::string& text);
+    std::string ToString() const;
+    void Clear() { symbols_.clear(); parameters_.clear(); }
+
+    // Symbols with a parameter have kParameter set. Their parameters are in
+    // parameters_ in the same order.
+    std::string symbols_;
+    std::vector<double> parameters_;
+  };
 
-  static Node* Generate(ExpandRules, EvalRules rules, TurtleState state);
+  enum Derivation {
+    EXPANDED,  // build the final generation, then interpret it
+    LAZY       // interpret symbols as the derivation produces them
+  };
+
+  static void InitializeCommonRules();
 
-  static Node* GenerateAlgae(std::string name = "");
-  static Node* GenerateGrass(std::string name = "");
-  static Node* GenerateFlower(std::string name = "");
-  static Node* GenerateBush(std::string name = "");
-  static Node* GenerateTree(std::string name = "");
+  // Rewrites state.turtle_ state.iterations_ times. Each generation is written
+  // into a fresh buffer in one pass over the last.
+  static bool Expand(const ExpandRules& expand, TurtleState& state,
+                     Tokens& turtle);
+
+  // Walks the derivation tree depth first, handing each symbol of the final
+  // generation straight to its eval rule. Only one replacement per level is
+  // held at a time, so memory grows with state.iterations_ rather than with
+  // the length of the final string. Expand callbacks run in that walk order,
+  // interleaved with the eval callbacks.
+  static bool Derive(const ExpandRules& expand, const EvalRules& eval,
+                     TurtleState& state);
+
+  static Node* Generate(ExpandRules, EvalRules rules, TurtleState state,
+                        Derivation derivation = EXPANDED);
+
+  // The built in plants. A non-zero seed varies the angles and growth rates
+  // a little, so one set of rules can give several distinct plants.
+  typedef Node* (*Generator)(std::string name, unsigned iterations,
+                             unsigned seed);
+
+  static Node* GenerateAlgae(std::string name = "", unsigned iterations = 6,
+                             unsigned seed = 0);
+  static Node* GenerateGrass(std::string name = "", unsigned iterations = 6,
+                             unsigned seed = 0);
+  static Node* GenerateFlower(std::string name = "", unsigned iterations = 6,
+                              unsigned seed = 0);
+  static Node* GenerateBush(std::string name = "", unsigned iterations = 6,
+                            unsigned seed = 0);
+  static Node* GenerateTree(std::string name = "", unsigned iterations = 6,
+                            unsigned seed = 0);
 
  private:
   static EvalRules common_eval_;
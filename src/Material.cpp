@@ -1,12 +1,20 @@
 #include "Material.h"
 
+#define GL_GLEXT_PROTOTYPES
+
+#include <csetjmp>
 #include <cstdio>
+#include <cstring>
 #include <GL/gl.h>
 #include <GL/glu.h>
 #include <jpeglib.h>
 #include <tiffio.h>
+#include <vector>
+
+#include "TextureLoader.h"
 
 using std::string;
+using std::vector;
 
 Material::~Material() {}
 
@@ -28,91 +36,258 @@ void PhongMaterial::Render() const {
   glMaterialf(GL_FRONT, GL_SHININESS, shininess_);
 }
 
-Texture::Texture(string file_name) {
-  // Pretty shitty way of determining file type but it works for me
-  if (file_name.find(".jpg") != string::npos ||
-      file_name.find(".jpeg") != string::npos) {
-    tiff_ = false;
-    jpeg_decompress_struct jpeg_info;
-    jpeg_error_mgr jpeg_error;
-    jpeg_info.err = jpeg_std_error(&jpeg_error);
-    jpeg_create_decompress(&jpeg_info);
-
-    FILE* in_file = fopen(file_name.c_str(), "rb");
-    if (!in_file) {
-      fprintf(stderr, "Error opening jpeg file %s\n", file_name.c_str());
-      exit(-1);
-    }
-    jpeg_stdio_src(&jpeg_info, in_file);
-    jpeg_read_header(&jpeg_info, TRUE);
-    jpeg_start_decompress(&jpeg_info);
-
-    width_ = jpeg_info.output_width;
-    height_ = jpeg_info.output_height;
-    components_ = jpeg_info.output_components;
-    buffer_ = new unsigned char[components_ * width_ * height_];
-    unsigned char* line;
-
-    while (jpeg_info.output_scanline < jpeg_info.output_height) {
-      line = buffer_ + components_ * width_ * jpeg_info.output_scanline;
-      jpeg_read_scanlines(&jpeg_info, &line, 1);
-    }
+using TextureCodec::GetLevelSize;
+using TextureCodec::Level;
+using TextureCodec::LevelList;
+
+Texture::Texture(string file_name, unsigned options)
+    : file_name_(file_name)
+    , options_(options)
+    , width_(0)
+    , height_(0)
+    , components_(0)
+    , compressed_(false)
+    , source_size_(0)
+    , source_hash_(0)
+    , decoded_(false)
+    , uploaded_(false)
+    , compressing_(false)
+    , texture_object_(0) {
+  TextureLoader::GetDefault()->Decode(this);
+}
+
+Texture::~Texture() {
+  if (texture_object_) {
+    glDeleteTextures(1, &texture_object_);
+  }
+}
+
+// libjpeg reports fatal errors through error_exit, which exits by default.
+// Jump back out of the decode instead.
+struct JpegError {
+  jpeg_error_mgr manager_;
+  jmp_buf jump_;
+};
 
-    jpeg_error.output_message((j_common_ptr)&jpeg_info);
+static void jpegErrorExit(j_common_ptr info) {
+  longjmp(((JpegError*)info->err)->jump_, 1);
+}
+
+bool Texture::DecodeJpeg() {
+  FILE* in_file = fopen(file_name_.c_str(), "rb");
+  if (!in_file) {
+    return false;
+  }
 
-    jpeg_finish_decompress(&jpeg_info);
+  // Anything that must survive a longjmp lives outside this function or is
+  // declared before the setjmp.
+  vector<JSAMPROW> rows;
+  jpeg_decompress_struct jpeg_info;
+  JpegError jpeg_error;
+  jpeg_info.err = jpeg_std_error(&jpeg_error.manager_);
+  jpeg_error.manager_.error_exit = jpegErrorExit;
+  if (setjmp(jpeg_error.jump_)) {
     jpeg_destroy_decompress(&jpeg_info);
     fclose(in_file);
-  } else if (file_name.find(".tif") != string::npos ||
-             file_name.find(".tiff") != string::npos) {
-    tiff_ = true;
-    TIFF *tif = TIFFOpen(file_name.c_str(), "r");
-    TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &width_);
-    TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &height_);
-    buffer_ = (unsigned char*) _TIFFmalloc(width_ * height_ * sizeof(uint32));
-    TIFFReadRGBAImage(tif, width_, height_, (uint32*)buffer_, 0);
+    levels_.clear();
+    return false;
+  }
+
+  jpeg_create_decompress(&jpeg_info);
+  jpeg_stdio_src(&jpeg_info, in_file);
+  jpeg_read_header(&jpeg_info, TRUE);
+  jpeg_start_decompress(&jpeg_info);
+
+  width_ = jpeg_info.output_width;
+  height_ = jpeg_info.output_height;
+  components_ = jpeg_info.output_components;
+  levels_.assign(1, Level(components_ * width_ * height_));
+
+  // Hand libjpeg every remaining row at once so it can return as many as it
+  // has ready per call.
+  rows.resize(height_);
+  for (int i = 0; i < height_; i++) {
+    rows[i] = &levels_[0][components_ * width_ * i];
+  }
+  while (jpeg_info.output_scanline < jpeg_info.output_height) {
+    unsigned line = jpeg_info.output_scanline;
+    jpeg_read_scanlines(&jpeg_info, &rows[line], height_ - line);
+  }
+
+  jpeg_finish_decompress(&jpeg_info);
+  jpeg_destroy_decompress(&jpeg_info);
+  fclose(in_file);
+  return true;
+}
+
+// TIFFReadRGBAImage packs each pixel as ABGR in a uint32, which is R, G, B, A
+// in memory on little endian machines, so the result is uploaded as is.
+bool Texture::DecodeTiff() {
+  TIFF* tif = TIFFOpen(file_name_.c_str(), "r");
+  if (!tif) {
+    return false;
+  }
+
+  uint32 width = 0;
+  uint32 height = 0;
+  TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &width);
+  TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &height);
+
+  levels_.assign(1, Level(4 * width * height));
+  if (!TIFFReadRGBAImage(tif, width, height, (uint32*)&levels_[0][0], 0)) {
+    levels_.clear();
     TIFFClose(tif);
+    return false;
+  }
+  TIFFClose(tif);
+
+  width_ = width;
+  height_ = height;
+  components_ = 4;
+  return true;
+}
+
+string Texture::GetCacheName() const {
+  return file_name_ + (options_ & MIPMAPS ? ".mips" : "") + ".dxt1.cache";
+}
+
+void Texture::Decode() {
+  if (compressing_) {
+    Compress();
+    return;
+  }
 
-    for (unsigned i = 0; i < width_ * height_; i++) {
-      unsigned char r, g, b, a;
-      a = buffer_[i*4];
-      b = buffer_[i*4 + 1];
-      g = buffer_[i*4 + 2];
-      r = buffer_[i*4 + 3];
-
-      buffer_[i*4] = r;
-      buffer_[i*4 + 1] = b;
-      buffer_[i*4 + 2] = g;
-      buffer_[i*4 + 3] = a;
+  if (options_ & COMPRESS) {
+    if (!TextureCodec::HashFile(file_name_, source_hash_, source_size_)) {
+      source_size_ = 0;
+    } else if (TextureCodec::ReadCache(GetCacheName(), source_size_,
+                                       source_hash_, width_, height_,
+                                       levels_)) {
+      unsigned expected = 1;
+      if (options_ & MIPMAPS) {
+        expected = TextureCodec::GetLevelCount(width_, height_);
+      }
+      if (levels_.size() == expected) {
+        components_ = 3;
+        compressed_ = true;
+        return;
+      }
+      levels_.clear();
     }
   }
 
-  // Create OpenGL Texture
-  glGenTextures(1, &texture_object_);
+  // Pretty shitty way of determining file type but it works for me
+  bool ok = false;
+  if (file_name_.find(".jpg") != string::npos ||
+      file_name_.find(".jpeg") != string::npos) {
+    ok = DecodeJpeg();
+  } else if (file_name_.find(".tif") != string::npos ||
+             file_name_.find(".tiff") != string::npos) {
+    ok = DecodeTiff();
+  }
+
+  if (!ok) {
+    fprintf(stderr, "Error loading texture %s\n", file_name_.c_str());
+    return;
+  }
+
+  if (options_ & MIPMAPS) {
+    TextureCodec::BuildMipChain(width_, height_, components_, levels_);
+  }
+}
+
+void Texture::Compress() {
+  for (unsigned level = 0; level < levels_.size(); level++) {
+    int width = GetLevelSize(width_, level);
+    int height = GetLevelSize(height_, level);
+    Level blocks(TextureCodec::GetDxt1Size(width, height));
+    TextureCodec::CompressDxt1(&levels_[level][0], width, height,
+                               components_, &blocks[0]);
+    levels_[level].swap(blocks);
+  }
+  compressed_ = true;
+
+  if (source_size_ > 0) {
+    TextureCodec::WriteCache(GetCacheName(), source_size_, source_hash_,
+                             width_, height_, levels_);
+  }
+}
+
+// S3TC is an extension; without it compressed levels are expanded again
+// before upload, which still saves decoding and filtering them.
+static bool hasS3tc() {
+  static int supported = -1;
+  if (supported < 0) {
+    const char* extensions = (const char*)glGetString(GL_EXTENSIONS);
+    supported = extensions &&
+                strstr(extensions, "GL_EXT_texture_compression_s3tc") != NULL;
+  }
+  return supported;
+}
+
+bool Texture::Upload() {
+  uploaded_ = true;
+  if (levels_.empty()) {
+    return false;
+  }
+
+  GLenum format = GL_RGB;
+  if (components_ == 1) {
+    format = GL_LUMINANCE;
+  } else if (components_ == 4) {
+    format = GL_RGBA;
+  }
+  bool s3tc = compressed_ && hasS3tc();
+
+  if (!texture_object_) {
+    glGenTextures(1, &texture_object_);
+  }
   glBindTexture(GL_TEXTURE_2D, texture_object_);
 
-  if (tiff_) {
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width_, height_, 0, GL_RGBA,
-                 GL_UNSIGNED_BYTE, buffer_);
-  } else {
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width_, height_, 0, GL_RGB,
-                 GL_UNSIGNED_BYTE, buffer_);
+  // Rows of RGB pixels aren't padded to four bytes.
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  for (unsigned level = 0; level < levels_.size(); level++) {
+    int width = GetLevelSize(width_, level);
+    int height = GetLevelSize(height_, level);
+    if (s3tc) {
+      glCompressedTexImage2D(GL_TEXTURE_2D, level,
+                             GL_COMPRESSED_RGB_S3TC_DXT1_EXT, width, height,
+                             0, levels_[level].size(), &levels_[level][0]);
+    } else if (compressed_) {
+      Level pixels(3 * width * height);
+      TextureCodec::DecompressDxt1(&levels_[level][0], width, height,
+                                   &pixels[0]);
+      glTexImage2D(GL_TEXTURE_2D, level, GL_RGB, width, height, 0, GL_RGB,
+                   GL_UNSIGNED_BYTE, &pixels[0]);
+    } else {
+      glTexImage2D(GL_TEXTURE_2D, level, GL_RGB, width, height, 0, format,
+                   GL_UNSIGNED_BYTE, &levels_[level][0]);
+    }
   }
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levels_.size() - 1);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+                  levels_.size() > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-}
 
-Texture::~Texture() {
-  glDeleteTextures(1, &texture_object_);
-  if (tiff_) {
-    _TIFFfree(buffer_);
-  } else {
-    delete[] buffer_;
+  // Compressing takes longer than decoding, so it waits until the image is
+  // on screen.
+  compressing_ = (options_ & COMPRESS) && !compressed_;
+  if (!compressing_) {
+    LevelList().swap(levels_);
   }
+  return compressing_;
 }
 
 void Texture::Render() const {
+  if (!uploaded_) {
+    TextureLoader::GetDefault()->Wait(this);
+  } else if (compressing_) {
+    // Swaps in the compressed levels once they're ready.
+    TextureLoader::GetDefault()->Upload();
+  }
+
   glBindTexture(GL_TEXTURE_2D, texture_object_);
   glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
 }
-
@@ -4,8 +4,10 @@
 #include <string>
 
 #include "Algebra.h"
+#include "AssetCache.h"
+#include "TextureCodec.h"
 
-class Material {
+class Material : public Asset {
  public:
   virtual ~Material();
   virtual void Render() const = 0;
@@ -27,21 +29,63 @@ class PhongMaterial : public Material {
   double shininess_;
 };
 
+// An image file in GL texture memory. The file is decoded in the background
+// by the default TextureLoader; the first Render() waits for it if it isn't
+// ready yet. The pixels are freed once they are uploaded.
 class Texture : public Material {
  public:
-  Texture(std::string file_name);
+  // How the image is kept in texture memory.
+  enum Options {
+    // Filters a full mip chain on the CPU and samples it trilinearly.
+    MIPMAPS = 1,
+    // Stores DXT1 blocks, a sixth of the size of RGB but lossy. The
+    // compressed chain is cached beside the image, so later runs skip both
+    // decoding and compressing. Without a cache the image is uploaded
+    // uncompressed first, and swapped for the compressed one once a loader
+    // thread has made it.
+    COMPRESS = 2
+  };
+
+  Texture(std::string file_name, unsigned options = MIPMAPS);
   virtual ~Texture();
 
   virtual void Render() const;
 
  private:
-  bool tiff_;
+  // On a loader thread. Decodes the image, or compresses it if it is
+  // queued again after an uncompressed upload.
+  void Decode();
+  bool DecodeJpeg();
+  bool DecodeTiff();
+  void Compress();
+  // Named for the options, since they change what it holds.
+  std::string GetCacheName() const;
+  // On the GL thread, once decoded. Returns true if the levels are kept to
+  // be compressed.
+  bool Upload();
+
+  std::string file_name_;
+  unsigned options_;
   int width_;
   int height_;
   int components_;
-  unsigned char* buffer_;
+  // The full size image first, then each mip level, as pixels of
+  // components_ bytes or as DXT1 blocks if compressed_.
+  TextureCodec::LevelList levels_;
+  bool compressed_;
+  // The source file's, to key the cache, or 0 if it couldn't be read.
+  uint64_t source_size_;
+  uint64_t source_hash_;
 
+  // Set under the loader's lock once levels_ is filled in, or left empty if
+  // the file couldn't be read.
+  bool decoded_;
+  bool uploaded_;
+  // Set on the GL thread while an uncompressed upload waits to be replaced.
+  bool compressing_;
   unsigned texture_object_;
+
+  friend class TextureLoader;
 };
 
 #endif
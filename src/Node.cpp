@@ -5,16 +5,17 @@
 
 #include "Terrain.h"
 
-using std::list;
 using std::string;
 
 static int ids = 0;
 
+unsigned Node::graph_revision_ = 0;
+
 GeometryNode* Node::CreateMeshNode(const string& name, const string& texture) {
   Primitive* primitive = new Mesh();
   Material* material = NULL;
   if (texture.size() > 0) {
-    material = new Texture(texture);
+    material = AssetCache::GetTexture(texture);
   }
   GeometryNode* node = new GeometryNode(name, primitive, material);
   return node;
@@ -30,7 +31,7 @@ GeometryNode* Node::CreateSphereNode(const string& name) {
 GeometryNode* Node::CreateHeightMapNode(const string& name, HeightMap* primitive, const string& file) {
   Material* material = NULL;
   if (file.size() > 0) {
-    material = new Texture(file);
+    material = AssetCache::GetTexture(file);
   } else {
     material = new PhongMaterial(Colour(0.2, 0.5, 1.0), Colour(0.1, 0.1, 0.1), 10.0);
   }
@@ -40,19 +41,23 @@ GeometryNode* Node::CreateHeightMapNode(const string& name, HeightMap* primitive
 
 GeometryNode* Node::CreateObjectNode(const string& name, const string& obj_name,
                                      const string& tex_name) {
-  Primitive* primitive = new Object(obj_name);
-  Material* material = new Texture(tex_name);
+  Primitive* primitive = AssetCache::GetObject(obj_name);
+  Material* material = AssetCache::GetTexture(tex_name);
   GeometryNode* node = new GeometryNode(name, primitive, material);
   return node;
 }
 
 Node::Node(const string& name)
     : name_(name)
+    , transformation_kind_(RIGID)
+    , inverse_valid_(true)
+    , revision_(0)
     , parent_(NULL) {
   id_ = ids++;
 }
 
 Node::~Node() {
+  graph_revision_++;
   ChildList::const_iterator it = children_.begin();
   for (; it != children_.end(); it++) {
     delete *it;
@@ -61,7 +66,7 @@ Node::~Node() {
 
 void Node::Render() const {
   glPushMatrix();
-  glMultMatrixd(transformation_.Transpose().Begin());
+  glMultTransposeMatrixd(transformation_.Begin());
 
   ChildList::const_iterator it = children_.begin();
   for (; it != children_.end(); it++) {
@@ -71,6 +76,16 @@ void Node::Render() const {
   glPopMatrix();
 }
 
+void Node::Bake(const Matrix4x4& transform, BakedMesh& baked,
+                const BakedMesh::Lod& lod) const {
+  Matrix4x4 world = transform * transformation_;
+
+  ChildList::const_iterator it = children_.begin();
+  for (; it != children_.end(); it++) {
+    (*it)->Bake(world, baked, lod);
+  }
+}
+
 void Node::Rotate(char axis, double angle) {
   Matrix4x4 r;
   double s = sin(angle * M_PI / 180);
@@ -99,28 +114,46 @@ void Node::Rotate(char axis, double angle) {
       break;
   }
 
-  SetTransformation(transformation_ * r);
+  SetTransformation(transformation_ * r, transformation_kind_);
 }
 
 void Node::Scale(const Vector3D& amount) {
   Matrix4x4 s(Vector4D(amount[0], 0, 0, 0), Vector4D(0, amount[1], 0, 0),
               Vector4D(0, 0, amount[2], 0), Vector4D(0, 0, 0, 1));
-  SetTransformation(transformation_ * s);
+  TransformKind kind = AFFINE;
+  if (amount[0] == amount[1] && amount[1] == amount[2]) {
+    kind = UNIFORM_SCALE;
+  }
+  SetTransformation(transformation_ * s, std::max(transformation_kind_, kind));
 }
 
 void Node::Translate(const Vector3D& amount) {
   Matrix4x4 t(Vector4D(1, 0, 0, amount[0]), Vector4D(0, 1, 0, amount[1]),
               Vector4D(0, 0, 1, amount[2]), Vector4D(0, 0, 0, 1));
-  SetTransformation(transformation_ * t);
+  SetTransformation(transformation_ * t, transformation_kind_);
 }
 
 void Node::Transform(const Matrix4x4& transformation) {
   SetTransformation(transformation_ * transformation);
 }
 
-void Node::SetTransformation(const Matrix4x4& transformation) {
+void Node::SetTransformation(const Matrix4x4& transformation,
+                             TransformKind kind) {
   transformation_ = transformation;
-  transformation_inverse_ = transformation.Invert();
+  transformation_kind_ = kind;
+  inverse_valid_ = false;
+  revision_++;
+}
+
+const Matrix4x4& Node::GetInverse() const {
+  if (!inverse_valid_) {
+    if (transformation_kind_ == GENERAL) {
+      transformation_kind_ = Classify(transformation_);
+    }
+    transformation_inverse_ = transformation_.Invert(transformation_kind_);
+    inverse_valid_ = true;
+  }
+  return transformation_inverse_;
 }
 
 JointNode::JointNode(const string& name)
@@ -171,7 +204,7 @@ void JointNode::Rotate(char axis, double angle) {
 
 void JointNode::Render() const {
   glPushMatrix();
-  glMultMatrixd(transformation_.Transpose().Begin());
+  glMultTransposeMatrixd(transformation_.Begin());
 
   ChildList::const_iterator it = children_.begin();
   for (; it != children_.end(); it++) {
@@ -195,23 +228,43 @@ GeometryNode::GeometryNode(const string& name, Primitive* primitive, Material* m
     , primitive_(primitive) {}
 
 GeometryNode::~GeometryNode() {
-  delete primitive_;
-  delete material_;
+  if (primitive_) {
+    primitive_->Release();
+  }
+  if (material_) {
+    material_->Release();
+  }
 }
 
 void GeometryNode::Scale(const Vector3D& amount) {
   Matrix4x4 s(Vector4D(amount[0], 0, 0, 0), Vector4D(0, amount[1], 0, 0),
               Vector4D(0, 0, amount[2], 0), Vector4D(0, 0, 0, 1));
   scale_transformation_ = scale_transformation_ * s;
+  revision_++;
+}
+
+void GeometryNode::Bake(const Matrix4x4& transform, BakedMesh& baked,
+                        const BakedMesh::Lod& lod) const {
+  Matrix4x4 world = transform * transformation_;
+
+  const Mesh* mesh = dynamic_cast<const Mesh*>(primitive_);
+  if (mesh) {
+    mesh->Bake(world * scale_transformation_, baked, lod);
+  }
+
+  ChildList::const_iterator it = children_.begin();
+  for (; it != children_.end(); it++) {
+    (*it)->Bake(world, baked, lod);
+  }
 }
 
 void GeometryNode::Render() const {
   glPushMatrix();
   glPushName(id_);
-  glMultMatrixd(transformation_.Transpose().Begin());
+  glMultTransposeMatrixd(transformation_.Begin());
 
   glPushMatrix();
-  glMultMatrixd(scale_transformation_.Transpose().Begin());
+  glMultTransposeMatrixd(scale_transformation_.Begin());
 
   if (material_) {
     material_->Render();
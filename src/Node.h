@@ -1,11 +1,13 @@
 #ifndef __NODE_H__
 #define __NODE_H__
 
-#include <list>
+#include <algorithm>
+#include <vector>
 
 #include "Material.h"
 #include "Primitive.h"
 
+class FlatScene;
 class GeometryNode;
 class HeightMap;
 
@@ -16,8 +18,22 @@ class Node {
 
   virtual void Render() const;
 
-  void AddChild(Node* child) { children_.push_back(child); child->parent_ = this; }
-  void RemoveChild(Node* child) { children_.remove(child); child->parent_ = NULL; }
+  // Appends the cylinders of every mesh below this node to baked, placed as
+  // they would be drawn with transform as the current matrix.
+  virtual void Bake(const Matrix4x4& transform, BakedMesh& baked,
+                    const BakedMesh::Lod& lod = BakedMesh::Lod()) const;
+
+  void AddChild(Node* child) {
+    children_.push_back(child);
+    child->parent_ = this;
+    graph_revision_++;
+  }
+  void RemoveChild(Node* child) {
+    children_.erase(std::remove(children_.begin(), children_.end(), child),
+                    children_.end());
+    child->parent_ = NULL;
+    graph_revision_++;
+  }
   void Detach() { if(parent_) { parent_->RemoveChild(this); } }
   bool IsAttached() { return parent_ != NULL; }
 
@@ -26,9 +42,19 @@ class Node {
   virtual void Translate(const Vector3D& amount);
   virtual void Transform(const Matrix4x4& transform);
  
-  void SetTransformation(const Matrix4x4&);
+  // A caller that knows what kind of transformation it is passing can say so;
+  // otherwise the kind is worked out if the inverse is ever needed.
+  void SetTransformation(const Matrix4x4&, TransformKind kind = GENERAL);
+  const Matrix4x4& GetTransformation() const { return transformation_; }
+  TransformKind GetTransformKind() const { return transformation_kind_; }
+  // Computed on first use after the transformation changes, in closed form
+  // for anything short of a GENERAL one.
+  const Matrix4x4& GetInverse() const;
 
   virtual bool IsJoint() const { return false; }
+  // Whether Render() draws this node's children in some way of its own, so a
+  // FlatScene has to call it rather than lay out the children itself.
+  virtual bool RendersSubtree() const { return false; }
 
   static GeometryNode* CreateSphereNode(const std::string& name);
   static GeometryNode* CreateMeshNode(const std::string& name,
@@ -45,11 +71,23 @@ class Node {
   std::string name_;
 
   Matrix4x4 transformation_;
-  Matrix4x4 transformation_inverse_;
-
-  typedef std::list<Node*> ChildList;
+  // Kept up to date by Rotate(), Scale() and Translate(), so most nodes never
+  // need theirs classified.
+  mutable TransformKind transformation_kind_;
+  mutable Matrix4x4 transformation_inverse_;
+  mutable bool inverse_valid_;
+  // Bumped whenever what this node draws moves, so a FlatScene can tell
+  // which world transformations are stale.
+  unsigned revision_;
+
+  typedef std::vector<Node*> ChildList;
   ChildList children_;
   Node* parent_;
+
+  // Bumped whenever a node is added, removed or deleted anywhere.
+  static unsigned graph_revision_;
+
+  friend class FlatScene;
 };
 
 class JointNode : public Node {
@@ -76,11 +114,15 @@ protected:
 
 class GeometryNode : public Node {
  public:
+  // Takes over a reference to the primitive and the material, either of
+  // which may be shared with other nodes.
   GeometryNode(const std::string& name, Primitive* primitive,
                Material* material);
   virtual ~GeometryNode();
 
   virtual void Render() const;
+  virtual void Bake(const Matrix4x4& transform, BakedMesh& baked,
+                    const BakedMesh::Lod& lod = BakedMesh::Lod()) const;
   virtual void Scale(const Vector3D& amount);
 
   Material* GetMaterial() { return material_; }
@@ -90,6 +132,8 @@ class GeometryNode : public Node {
   Matrix4x4 scale_transformation_;
   Material* material_;
   Primitive* primitive_;
+
+  friend class FlatScene;
 };
 
 #endif
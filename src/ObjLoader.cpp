@@ -0,0 +1,502 @@
+#include "ObjLoader.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <sstream>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Logging.h"
+
+using std::ios_base;
+using std::ofstream;
+using std::string;
+using std::stringstream;
+using std::vector;
+
+// A .cache file is this header followed by vertex_count_ vertices and then
+// index_count_ indices, exactly as they are held in memory. It is only used
+// on the machine that wrote it, and only while the source file still has the
+// size and modification time recorded here.
+struct ObjCacheHeader {
+  char magic_[4];
+  uint32_t version_;
+  uint32_t endian_;
+  uint32_t vertex_size_;
+  uint32_t vertex_count_;
+  uint32_t index_count_;
+  uint64_t source_size_;
+  int64_t source_time_;
+};
+
+static const char kMagic[4] = {'O', 'B', 'J', 'C'};
+static const uint32_t kVersion = 1;
+static const uint32_t kEndianMarker = 0x01020304;
+
+static const double kPowersOfTen[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static bool isDigit(char c) {
+  return c >= '0' && c <= '9';
+}
+
+static const char* skipSpace(const char* p, const char* end) {
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) {
+    p++;
+  }
+  return p;
+}
+
+static const char* skipLine(const char* p, const char* end) {
+  while (p < end && *p != '\n') {
+    p++;
+  }
+  return p;
+}
+
+// A decimal number with an optional sign, fraction and exponent. The first
+// 19 significant digits are kept exactly, which is far more than a float
+// holds.
+static bool parseNumber(const char*& p, const char* end, double& value) {
+  const char* s = p;
+  bool negative = false;
+  if (s < end && (*s == '-' || *s == '+')) {
+    negative = *s == '-';
+    s++;
+  }
+
+  uint64_t mantissa = 0;
+  unsigned digits = 0;
+  int exponent = 0;
+  bool any = false;
+
+  for (; s < end && isDigit(*s); s++) {
+    if (digits < 19) {
+      mantissa = mantissa * 10 + (*s - '0');
+      digits += mantissa != 0;
+    } else {
+      exponent++;
+    }
+    any = true;
+  }
+
+  if (s < end && *s == '.') {
+    for (s++; s < end && isDigit(*s); s++) {
+      if (digits < 19) {
+        mantissa = mantissa * 10 + (*s - '0');
+        digits += mantissa != 0;
+        exponent--;
+      }
+      any = true;
+    }
+  }
+
+  if (!any) {
+    return false;
+  }
+
+  if (s < end && (*s == 'e' || *s == 'E')) {
+    const char* e = s + 1;
+    bool negative_exponent = false;
+    if (e < end && (*e == '-' || *e == '+')) {
+      negative_exponent = *e == '-';
+      e++;
+    }
+
+    if (e < end && isDigit(*e)) {
+      int power = 0;
+      for (; e < end && isDigit(*e); e++) {
+        if (power < 10000) {
+          power = power * 10 + (*e - '0');
+        }
+      }
+      exponent += negative_exponent ? -power : power;
+      s = e;
+    }
+  }
+
+  double result = (double)mantissa;
+  if (result != 0.0) {
+    for (; exponent > 22; exponent -= 22) {
+      result *= 1e22;
+    }
+    for (; exponent < -22; exponent += 22) {
+      result /= 1e22;
+    }
+    if (exponent >= 0) {
+      result *= kPowersOfTen[exponent];
+    } else {
+      result /= kPowersOfTen[-exponent];
+    }
+  }
+
+  value = negative ? -result : result;
+  p = s;
+  return true;
+}
+
+static bool parseInteger(const char*& p, const char* end, long& value) {
+  const char* s = p;
+  bool negative = false;
+  if (s < end && *s == '-') {
+    negative = true;
+    s++;
+  }
+
+  if (s >= end || !isDigit(*s)) {
+    return false;
+  }
+
+  long result = 0;
+  for (; s < end && isDigit(*s); s++) {
+    if (result < 1000000000) {
+      result = result * 10 + (*s - '0');
+    }
+  }
+
+  value = negative ? -result : result;
+  p = s;
+  return true;
+}
+
+// OBJ indices start at 1, and negative ones count back from the end. Gives
+// -1 for anything out of range.
+static long resolveIndex(long index, size_t count) {
+  if (index > 0 && (size_t)index <= count) {
+    return index - 1;
+  }
+  if (index < 0 && (size_t)-index <= count) {
+    return count + index;
+  }
+  return -1;
+}
+
+namespace ObjLoader {
+
+bool Parse(const char* begin, const char* end, VertexList& vertices,
+           IndexList& indices) {
+  vertices.clear();
+  indices.clear();
+
+  vector<float> positions;
+  vector<float> tex_coords;
+  vector<float> normals;
+
+  // For each position, the vertices made from it so far, linked through
+  // next. The texture and normal indices tell them apart.
+  vector<long> first;
+  vector<long> next;
+  vector<long> position_of;
+  vector<long> tex_coord_of;
+  vector<long> normal_of;
+
+  // Face normals summed around each position, for vertices without one.
+  vector<double> smooth;
+  bool needs_smoothing = false;
+
+  vector<unsigned> corners;
+  unsigned line = 1;
+  for (const char* p = begin; p < end; p = skipLine(p, end) + 1, line++) {
+    p = skipSpace(p, end);
+    if (p + 1 >= end) {
+      break;
+    }
+
+    const char* error = NULL;
+    if (p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+      p += 2;
+      for (unsigned k = 0; k < 3 && !error; k++) {
+        double value = 0.0;
+        p = skipSpace(p, end);
+        if (!parseNumber(p, end, value)) {
+          error = "bad position";
+        }
+        positions.push_back(value);
+      }
+      first.push_back(-1);
+      smooth.resize(smooth.size() + 3, 0.0);
+    } else if (p[0] == 'v' && p[1] == 't') {
+      p += 2;
+      double u = 0.0, v = 0.0;
+      p = skipSpace(p, end);
+      if (!parseNumber(p, end, u)) {
+        error = "bad texture coordinate";
+      }
+      p = skipSpace(p, end);
+      parseNumber(p, end, v);
+      tex_coords.push_back(u);
+      tex_coords.push_back(v);
+    } else if (p[0] == 'v' && p[1] == 'n') {
+      p += 2;
+      for (unsigned k = 0; k < 3 && !error; k++) {
+        double value = 0.0;
+        p = skipSpace(p, end);
+        if (!parseNumber(p, end, value)) {
+          error = "bad normal";
+        }
+        normals.push_back(value);
+      }
+    } else if (p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+      p += 2;
+      corners.clear();
+      while (!error) {
+        p = skipSpace(p, end);
+        if (p >= end || *p == '\n' || *p == '#') {
+          break;
+        }
+
+        long v, vt = 0, vn = 0;
+        if (!parseInteger(p, end, v)) {
+          error = "bad face";
+          break;
+        }
+        if (p < end && *p == '/') {
+          p++;
+          if (p < end && *p != '/' && !parseInteger(p, end, vt)) {
+            error = "bad face";
+            break;
+          }
+          if (p < end && *p == '/') {
+            p++;
+            if (!parseInteger(p, end, vn)) {
+              error = "bad face";
+              break;
+            }
+          }
+        }
+
+        // vt and vn are left at 0 when the corner has none.
+        bool in_range = true;
+        v = resolveIndex(v, positions.size() / 3);
+        in_range = in_range && v >= 0;
+        if (vt) {
+          vt = resolveIndex(vt, tex_coords.size() / 2);
+          in_range = in_range && vt >= 0;
+        } else {
+          vt = -1;
+        }
+        if (vn) {
+          vn = resolveIndex(vn, normals.size() / 3);
+          in_range = in_range && vn >= 0;
+        } else {
+          vn = -1;
+        }
+        if (!in_range) {
+          error = "face index out of range";
+          break;
+        }
+
+        long vertex = first[v];
+        while (vertex >= 0 &&
+               (tex_coord_of[vertex] != vt || normal_of[vertex] != vn)) {
+          vertex = next[vertex];
+        }
+
+        if (vertex < 0) {
+          vertex = vertices.size();
+          next.push_back(first[v]);
+          first[v] = vertex;
+          position_of.push_back(v);
+          tex_coord_of.push_back(vt);
+          normal_of.push_back(vn);
+
+          BakedMesh::Vertex data;
+          for (unsigned k = 0; k < 3; k++) {
+            data.position_[k] = positions[3 * v + k];
+            data.normal_[k] = vn >= 0 ? normals[3 * vn + k] : 0.0f;
+          }
+          data.tex_coord_[0] = vt >= 0 ? tex_coords[2 * vt] : 0.0f;
+          data.tex_coord_[1] = vt >= 0 ? tex_coords[2 * vt + 1] : 0.0f;
+          vertices.push_back(data);
+          needs_smoothing = needs_smoothing || vn < 0;
+        }
+        corners.push_back(vertex);
+      }
+
+      if (!error && corners.size() >= 3) {
+        for (unsigned i = 1; i + 1 < corners.size(); i++) {
+          indices.push_back(corners[0]);
+          indices.push_back(corners[i]);
+          indices.push_back(corners[i + 1]);
+        }
+
+        // Newell's method: twice the area times the unit normal, even for
+        // polygons that aren't quite flat.
+        double normal[3] = {0.0, 0.0, 0.0};
+        for (unsigned i = 0; i < corners.size(); i++) {
+          unsigned j = i + 1 < corners.size() ? i + 1 : 0;
+          const float* a = vertices[corners[i]].position_;
+          const float* b = vertices[corners[j]].position_;
+          normal[0] += (a[1] - b[1]) * (a[2] + b[2]);
+          normal[1] += (a[2] - b[2]) * (a[0] + b[0]);
+          normal[2] += (a[0] - b[0]) * (a[1] + b[1]);
+        }
+        for (unsigned i = 0; i < corners.size(); i++) {
+          long v = position_of[corners[i]];
+          for (unsigned k = 0; k < 3; k++) {
+            smooth[3 * v + k] += normal[k];
+          }
+        }
+      }
+    }
+
+    if (error) {
+      stringstream ss;
+      ss << "OBJ line " << line << ": " << error;
+      ERROR(ss.str());
+      vertices.clear();
+      indices.clear();
+      return false;
+    }
+  }
+
+  if (needs_smoothing) {
+    for (unsigned i = 0; i < vertices.size(); i++) {
+      if (normal_of[i] >= 0) {
+        continue;
+      }
+
+      const double* sum = &smooth[3 * position_of[i]];
+      double length = sqrt(sum[0] * sum[0] + sum[1] * sum[1] +
+                           sum[2] * sum[2]);
+      if (length > 0.0) {
+        for (unsigned k = 0; k < 3; k++) {
+          vertices[i].normal_[k] = sum[k] / length;
+        }
+      }
+    }
+  }
+
+  return true;
+}
+
+static bool readCache(const string& cache_name, const struct stat& source,
+                      VertexList& vertices, IndexList& indices) {
+  int fd = open(cache_name.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+
+  struct stat info;
+  ObjCacheHeader header;
+  if (fstat(fd, &info) < 0 ||
+      read(fd, &header, sizeof(header)) != sizeof(header) ||
+      memcmp(header.magic_, kMagic, sizeof(kMagic)) != 0 ||
+      header.version_ != kVersion || header.endian_ != kEndianMarker ||
+      header.vertex_size_ != sizeof(BakedMesh::Vertex) ||
+      header.source_size_ != (uint64_t)source.st_size ||
+      header.source_time_ != (int64_t)source.st_mtime ||
+      (uint64_t)info.st_size != sizeof(header) +
+          (uint64_t)header.vertex_count_ * sizeof(BakedMesh::Vertex) +
+          (uint64_t)header.index_count_ * sizeof(unsigned)) {
+    close(fd);
+    return false;
+  }
+
+  vertices.resize(header.vertex_count_);
+  indices.resize(header.index_count_);
+  ssize_t vertex_bytes = vertices.size() * sizeof(BakedMesh::Vertex);
+  ssize_t index_bytes = indices.size() * sizeof(unsigned);
+  bool ok = (!vertex_bytes ||
+             read(fd, &vertices[0], vertex_bytes) == vertex_bytes) &&
+            (!index_bytes || read(fd, &indices[0], index_bytes) == index_bytes);
+  close(fd);
+
+  for (unsigned i = 0; ok && i < indices.size(); i++) {
+    ok = indices[i] < vertices.size();
+  }
+  if (!ok) {
+    vertices.clear();
+    indices.clear();
+  }
+  return ok;
+}
+
+// Written under a temporary name and then renamed, so a reader never sees
+// half a cache.
+static bool writeCache(const string& cache_name, const struct stat& source,
+                       const VertexList& vertices, const IndexList& indices) {
+  string temporary = cache_name + ".tmp";
+  ofstream file(temporary.c_str(), ios_base::out | ios_base::binary);
+  if (!file) {
+    return false;
+  }
+
+  ObjCacheHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic_, kMagic, sizeof(kMagic));
+  header.version_ = kVersion;
+  header.endian_ = kEndianMarker;
+  header.vertex_size_ = sizeof(BakedMesh::Vertex);
+  header.vertex_count_ = vertices.size();
+  header.index_count_ = indices.size();
+  header.source_size_ = source.st_size;
+  header.source_time_ = source.st_mtime;
+  file.write((const char*)&header, sizeof(header));
+
+  if (!vertices.empty()) {
+    file.write((const char*)&vertices[0],
+               vertices.size() * sizeof(BakedMesh::Vertex));
+  }
+  if (!indices.empty()) {
+    file.write((const char*)&indices[0], indices.size() * sizeof(unsigned));
+  }
+  file.close();
+
+  if (file.fail() || rename(temporary.c_str(), cache_name.c_str()) != 0) {
+    unlink(temporary.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool Load(const string& file_name, VertexList& vertices, IndexList& indices,
+          bool use_cache) {
+  int fd = open(file_name.c_str(), O_RDONLY);
+  struct stat info;
+  if (fd < 0 || fstat(fd, &info) < 0) {
+    ERROR("Could not open " << file_name);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return false;
+  }
+
+  string cache_name = file_name + ".cache";
+  if (use_cache && readCache(cache_name, info, vertices, indices)) {
+    close(fd);
+    return true;
+  }
+
+  bool ok;
+  size_t size = info.st_size;
+  if (size == 0) {
+    ok = Parse(NULL, NULL, vertices, indices);
+  } else {
+    void* mapping = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping == MAP_FAILED) {
+      ERROR("Could not map " << file_name);
+      close(fd);
+      return false;
+    }
+
+    const char* text = (const char*)mapping;
+    ok = Parse(text, text + size, vertices, indices);
+    munmap(mapping, size);
+  }
+  close(fd);
+
+  if (ok && use_cache && !writeCache(cache_name, info, vertices, indices)) {
+    ERROR("Could not write " << cache_name);
+  }
+  return ok;
+}
+
+}
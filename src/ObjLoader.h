@@ -0,0 +1,32 @@
+#ifndef __OBJ_LOADER_H__
+#define __OBJ_LOADER_H__
+
+#include <string>
+#include <vector>
+
+#include "Primitive.h"
+
+// Reads Wavefront .obj meshes into an indexed triangle list.
+//
+// v, vt and vn lines are read, along with faces of any number of corners in
+// the v, v/vt, v//vn and v/vt/vn forms; negative indices count back from the
+// last element read. Faces are split into fans. Corners with the same
+// position, texture and normal indices share one vertex. Vertices without a
+// normal get the area weighted average of the faces around their position.
+// Everything else in the file is ignored.
+namespace ObjLoader {
+  typedef std::vector<BakedMesh::Vertex> VertexList;
+  typedef std::vector<unsigned> IndexList;
+
+  // Loads from file_name + ".cache" if it was written from the file as it is
+  // now. Otherwise the file is mapped and parsed, and the cache is written
+  // for next time. Returns false, having logged why, on failure.
+  bool Load(const std::string& file_name, VertexList& vertices,
+            IndexList& indices, bool use_cache = true);
+
+  // Parses the text between begin and end.
+  bool Parse(const char* begin, const char* end, VertexList& vertices,
+             IndexList& indices);
+};
+
+#endif
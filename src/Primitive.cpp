@@ -1,16 +1,18 @@
 #include "Primitive.h"
 
-#include <fstream>
+#define GL_GLEXT_PROTOTYPES
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
 #include <GL/gl.h>
 #include <GL/glu.h>
 #include <iostream>
 #include <tiffio.h>
 
 #include "Logging.h"
+#include "ObjLoader.h"
 
-using std::ifstream;
-using std::list;
-using std::pair;
 using std::vector;
 
 Primitive::~Primitive() {}
@@ -27,40 +29,189 @@ void Sphere::Render() const {
   gluDeleteQuadric(quadric); 
 }
 
-Mesh::~Mesh() {}
+unsigned BakedMesh::Lod::GetSegments(double radius) const {
+  if (radius_ <= 0.0 || radius >= radius_) {
+    return max_segments_;
+  }
+  unsigned segments = (unsigned)ceil(max_segments_ * radius / radius_);
+  return std::max(segments, min_segments_);
+}
+
+BakedMesh::BakedMesh()
+    : vertex_buffer_(0)
+    , index_buffer_(0)
+    , dirty_(false) {}
+
+BakedMesh::~BakedMesh() {
+  if (vertex_buffer_) {
+    glDeleteBuffers(1, &vertex_buffer_);
+    glDeleteBuffers(1, &index_buffer_);
+  }
+}
+
+void BakedMesh::AddCylinder(const Matrix4x4& transform, double radius,
+                            double end_radius, double height,
+                            unsigned segments) {
+  if (segments < 3) {
+    segments = 3;
+  }
+
+  // Normals go through the inverse transpose; see TransformNormal.
+  Matrix4x4 inverse = transform.Invert(Classify(transform));
+
+  // The slope of the side, as gluCylinder works it out.
+  double side = sqrt((radius - end_radius) * (radius - end_radius) +
+                     height * height);
+  double normal_z = side > 0.0 ? (radius - end_radius) / side : 0.0;
+  double normal_xy = side > 0.0 ? height / side : 1.0;
+
+  // A ring at each end. The first and last vertices of a ring are at the
+  // same place but at either edge of the texture.
+  unsigned base = vertices_.size();
+  for (unsigned end = 0; end < 2; end++) {
+    double r = end ? end_radius : radius;
+    double z = end ? height : 0.0;
+    for (unsigned i = 0; i <= segments; i++) {
+      double angle = 2 * M_PI * i / segments;
+      double s = sin(angle);
+      double c = cos(angle);
+
+      Point3D position = transform * Point3D(r * s, r * c, z);
+      Vector3D normal = TransformNormal(inverse,
+          Vector3D(s * normal_xy, c * normal_xy, normal_z));
+      normal.Normalize();
+
+      Vertex vertex;
+      for (unsigned k = 0; k < 3; k++) {
+        vertex.position_[k] = position[k];
+        vertex.normal_[k] = normal[k];
+      }
+      vertex.tex_coord_[0] = (double)i / segments;
+      vertex.tex_coord_[1] = end;
+      vertices_.push_back(vertex);
+    }
+  }
+
+  // Counter-clockwise seen from outside.
+  unsigned top = base + segments + 1;
+  for (unsigned i = 0; i < segments; i++) {
+    indices_.push_back(base + i);
+    indices_.push_back(top + i);
+    indices_.push_back(base + i + 1);
+
+    indices_.push_back(base + i + 1);
+    indices_.push_back(top + i);
+    indices_.push_back(top + i + 1);
+  }
+
+  dirty_ = true;
+}
+
+void BakedMesh::Swap(vector<Vertex>& vertices, vector<unsigned>& indices) {
+  vertices_.swap(vertices);
+  indices_.swap(indices);
+  dirty_ = true;
+}
+
+void BakedMesh::Clear() {
+  vertices_.clear();
+  indices_.clear();
+  dirty_ = true;
+}
+
+void BakedMesh::Render() const {
+  if (indices_.empty()) {
+    return;
+  }
+
+  if (!vertex_buffer_) {
+    glGenBuffers(1, &vertex_buffer_);
+    glGenBuffers(1, &index_buffer_);
+    dirty_ = true;
+  }
+
+  glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer_);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_buffer_);
+  if (dirty_) {
+    glBufferData(GL_ARRAY_BUFFER, vertices_.size() * sizeof(Vertex),
+                 &vertices_[0], GL_STATIC_DRAW);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices_.size() * sizeof(unsigned),
+                 &indices_[0], GL_STATIC_DRAW);
+    dirty_ = false;
+  }
+
+  glFrontFace(GL_CCW);
+
+  glEnableClientState(GL_VERTEX_ARRAY);
+  glEnableClientState(GL_NORMAL_ARRAY);
+  glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+  glVertexPointer(3, GL_FLOAT, sizeof(Vertex),
+                  (const GLvoid*)offsetof(Vertex, position_));
+  glNormalPointer(GL_FLOAT, sizeof(Vertex),
+                  (const GLvoid*)offsetof(Vertex, normal_));
+  glTexCoordPointer(2, GL_FLOAT, sizeof(Vertex),
+                    (const GLvoid*)offsetof(Vertex, tex_coord_));
+
+  glDrawElements(GL_TRIANGLES, indices_.size(), GL_UNSIGNED_INT, 0);
+
+  glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+  glDisableClientState(GL_NORMAL_ARRAY);
+  glDisableClientState(GL_VERTEX_ARRAY);
+
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+Mesh::Mesh()
+    : baked_(NULL)
+    , dirty_(false) {}
+
+Mesh::~Mesh() {
+  delete baked_;
+}
 
 void Mesh::Render() const {
   FUNC_ENTER;
-  GLUquadricObj* quadric = gluNewQuadric();
-  gluQuadricDrawStyle(quadric, GLU_FILL);
-  gluQuadricTexture(quadric, GL_TRUE);
+  if (!baked_) {
+    baked_ = new BakedMesh();
+    dirty_ = true;
+  }
 
-  CylinderList::const_iterator it;
+  if (dirty_) {
+    baked_->Clear();
+    Bake(Matrix4x4(), *baked_);
+    dirty_ = false;
+  }
+
+  baked_->Render();
+}
+
+void Mesh::Bake(const Matrix4x4& transform, BakedMesh& baked,
+                const BakedMesh::Lod& lod) const {
+  // Cylinders are constructed from z = 0 .. height
+  // First rotate along x-axis so cylinders are y = 0 .. height
+  // then rotate using the rotation_ matrix.
+  const Matrix4x4 upright(
+      Vector4D(1, 0, 0, 0),
+      Vector4D(0, 0, 1, 0),
+      Vector4D(0, -1, 0, 0),
+      Vector4D(0, 0, 0, 1));
 
+  CylinderList::const_iterator it;
   for (it = cylinders_.begin(); it != cylinders_.end(); ++it) {
-    glPushMatrix();
-
-    Point3D p = (*it).pos_;
-    glTranslated(p[0], p[1], p[2]);
-
-    // Cylinders are constructed from z = 0 .. height
-    // First rotate along x-axis so cylinders are y = 0 .. height
-    // then rotate using the rotation_ matrix.
-    Matrix4x4 transform = 
-      (*it).rotation_ * 
-      Matrix4x4(
-        Vector4D(1, 0, 0, 0),
-        Vector4D(0, 0, 1, 0),
-        Vector4D(0, -1, 0, 0),
+    const Point3D& p = (*it).pos_;
+    Matrix4x4 translation(
+        Vector4D(1, 0, 0, p[0]),
+        Vector4D(0, 1, 0, p[1]),
+        Vector4D(0, 0, 1, p[2]),
         Vector4D(0, 0, 0, 1));
-    glMultMatrixd(transform.Transpose().Begin());
-
-    gluCylinder(quadric, (*it).radius_, (*it).end_radius_, (*it).height_, 8, 1);
 
-    glPopMatrix();
+    unsigned segments =
+        lod.GetSegments(std::max((*it).radius_, (*it).end_radius_));
+    baked.AddCylinder(transform * translation * (*it).rotation_ * upright,
+                      (*it).radius_, (*it).end_radius_, (*it).height_,
+                      segments);
   }
-
-  gluDeleteQuadric(quadric); 
 }
 
 void Mesh::Extend(double length, const Matrix4x4& rotation, double radius, double end_radius) {
@@ -72,6 +223,7 @@ void Mesh::Extend(double length, const Matrix4x4& rotation, double radius, doubl
   c.pos_ = end_point_;
 
   cylinders_.push_back(c);
+  dirty_ = true;
 
   Vector3D heading = rotation * Vector3D(0.0, 1.0, 0.0);
 
@@ -80,70 +232,16 @@ void Mesh::Extend(double length, const Matrix4x4& rotation, double radius, doubl
 }
 
 Object::Object(const std::string& file_name) {
-  // Read in .obj file
-  // if you didn't pass in a .obj file, then you're using my program wrong.
-  // aka, I don't have time to write a proper parser.
-  ifstream file(file_name.c_str());
-
-  // only support files with max 256 chars per line, since I'm only using files
-  // that do that.
-  char line[256];
-  while(true) {
-    file.getline(line, 256);
-    if (file.eof()) {
-      break;
-    }
-
-    if (line[0] == 'v' && line[1] == ' ') {
-      char temp[4];
-      float x, y, z;
-      sscanf(line, "%s %f %f %f", temp, &x, &y, &z);
-      vertices_.push_back(Point3D(x, y, z));
-    } else if (line[0] == 'v' && line[1] == 't') {
-      char temp[4];
-      float u, v;
-      sscanf(line, "%s %f %f", temp, &u, &v);
-      texture_vertices_.push_back(Point2D(u, v));
-    } else if (line[0] == 'f') {
-      char temp[4];
-      unsigned v1, v2, v3;
-      int vt1, vt2, vt3;
-      int matches = sscanf(line, "%s %u/%d %u/%d %u/%d", temp, &v1, &vt1, &v2,
-                           &vt2, &v3, &vt3);
-      if (matches != 7) {
-        sscanf(line, "%s %u %u %u", temp, &v1, &v2, &v3);
-        vt1 = vt2 = vt3 = 0;
-      }
-
-      // OBJ file indexing starts at 1.
-      v1--; v2--; v3--; vt1--; vt2--; vt3--;
-
-      face_.push_back(pair<unsigned, int>(v1, vt1));
-      face_.push_back(pair<unsigned, int>(v2, vt2));
-      face_.push_back(pair<unsigned, int>(v3, vt3));
-    } else {
-      // ignore everything else
-    }
+  ObjLoader::VertexList vertices;
+  ObjLoader::IndexList indices;
+  if (ObjLoader::Load(file_name, vertices, indices)) {
+    mesh_.Swap(vertices, indices);
   }
 }
 
 Object::~Object() {}
 
 void Object::Render() const {
-  glBegin(GL_TRIANGLES);
-
-  list<pair<unsigned, int> >::const_iterator it;
-  for (it = face_.begin(); it != face_.end(); ++it) {
-    pair<unsigned, int> p = (*it);
-    if (p.second >= 0) {
-      const Point2D& vt = texture_vertices_[p.second];
-      glTexCoord2d(vt[0], vt[1]);
-    }
-
-    const Point3D& v = vertices_[p.first];
-    glVertex3d(v[0], v[1], v[2]);
-  }
-
-  glEnd();
+  mesh_.Render();
 }
 
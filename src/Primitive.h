@@ -2,12 +2,13 @@
 #define __PRIMITIVE_H__
 
 #include <list>
-#include <utility>
+#include <string>
 #include <vector>
 
 #include "Algebra.h"
+#include "AssetCache.h"
 
-class Primitive {
+class Primitive : public Asset {
  public:
   virtual ~Primitive();
   virtual void Render() const = 0;
@@ -19,13 +20,73 @@ class Sphere : public Primitive {
   virtual void Render() const;
 };
 
+// Triangles in one interleaved vertex buffer and one index buffer, drawn with
+// a single call. The buffers are uploaded on first render, and again after
+// anything is added.
+class BakedMesh : public Primitive {
+ public:
+  // How many sides a baked cylinder gets. Cylinders at least radius_ thick
+  // get max_segments_; thinner ones get proportionally fewer, down to
+  // min_segments_. A radius_ of 0 gives every cylinder max_segments_.
+  struct Lod {
+    Lod(unsigned max_segments = 8, unsigned min_segments = 3,
+        double radius = 0.0)
+        : max_segments_(max_segments), min_segments_(min_segments),
+          radius_(radius) {}
+
+    unsigned GetSegments(double radius) const;
+
+    unsigned max_segments_;
+    unsigned min_segments_;
+    double radius_;
+  };
+
+  struct Vertex {
+    float position_[3];
+    float normal_[3];
+    float tex_coord_[2];
+  };
+
+  BakedMesh();
+  virtual ~BakedMesh();
+
+  // The same surface gluCylinder draws, running along z from radius at 0 to
+  // end_radius at height, moved by transform.
+  void AddCylinder(const Matrix4x4& transform, double radius,
+                   double end_radius, double height, unsigned segments);
+  // Takes over ready made buffers, leaving the old contents in their place.
+  void Swap(std::vector<Vertex>& vertices, std::vector<unsigned>& indices);
+  void Clear();
+
+  unsigned GetVertexCount() const { return vertices_.size(); }
+  unsigned GetTriangleCount() const { return indices_.size() / 3; }
+
+  virtual void Render() const;
+
+ private:
+  BakedMesh(const BakedMesh&);
+  BakedMesh& operator=(const BakedMesh&);
+
+  std::vector<Vertex> vertices_;
+  std::vector<unsigned> indices_;
+
+  mutable unsigned vertex_buffer_;
+  mutable unsigned index_buffer_;
+  mutable bool dirty_;
+};
+
 class Mesh : public Primitive {
  public:
+  Mesh();
   virtual ~Mesh();
   virtual void Render() const;
   void Extend(double length, const Matrix4x4& rotation, double radius, double end_radius);
   const Point3D& GetEndPoint() const { return end_point_; }
 
+  // Appends every cylinder, moved by transform, to baked.
+  void Bake(const Matrix4x4& transform, BakedMesh& baked,
+            const BakedMesh::Lod& lod = BakedMesh::Lod()) const;
+
  private:
   struct Cylinder {
     Matrix4x4 rotation_;
@@ -35,11 +96,19 @@ class Mesh : public Primitive {
     double end_radius_;
   };
 
+  Mesh(const Mesh&);
+  Mesh& operator=(const Mesh&);
+
   Point3D end_point_;
   typedef std::list<Cylinder> CylinderList;
   CylinderList cylinders_;
+
+  // Baked from cylinders_ the first time the mesh is drawn after a change.
+  mutable BakedMesh* baked_;
+  mutable bool dirty_;
 };
 
+// A mesh read from a Wavefront .obj file; see ObjLoader.
 class Object : public Primitive {
  public:
   Object(const std::string& file_name);
@@ -48,9 +117,7 @@ class Object : public Primitive {
   virtual void Render() const;
 
  private:
-  std::vector<Point3D> vertices_;
-  std::vector<Point2D> texture_vertices_;
-  std::list<std::pair<unsigned, int> > face_;
+  BakedMesh mesh_;
 };
 
 #endif
@@ -0,0 +1,469 @@
+#include "Profiler.h"
+
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <map>
+#include <pthread.h>
+#include <sstream>
+#include <vector>
+
+#define GL_GLEXT_PROTOTYPES
+#include <GL/gl.h>
+#include <GL/glext.h>
+
+using std::map;
+using std::ofstream;
+using std::string;
+using std::stringstream;
+using std::vector;
+
+namespace Profiler {
+
+struct Event {
+  const char* name_;
+  uint64_t start_;
+  uint64_t end_;
+};
+
+// Only the owning thread writes, but the drawing thread reads every buffer
+// when it totals a frame or writes a trace, so each has its own lock.
+struct ThreadBuffer {
+  string name_;
+  unsigned id_;
+  pthread_mutex_t mutex_;
+  vector<Event> events_;
+  // Events ever recorded; the latest is at (written_ - 1) % kCapacity.
+  uint64_t written_;
+  // Events before this have been counted in a frame's totals.
+  uint64_t totaled_;
+};
+
+static const unsigned kCapacity = 1 << 14;
+
+static volatile bool enabled = true;
+
+static pthread_mutex_t buffers_mutex = PTHREAD_MUTEX_INITIALIZER;
+static vector<ThreadBuffer*> buffers;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t buffer_key;
+
+// Buffers live as long as the program, so a trace can still show threads
+// that have finished.
+static ThreadBuffer* newBuffer(const string& name) {
+  ThreadBuffer* buffer = new ThreadBuffer;
+  pthread_mutex_init(&buffer->mutex_, NULL);
+  buffer->events_.resize(kCapacity);
+  buffer->written_ = 0;
+  buffer->totaled_ = 0;
+
+  pthread_mutex_lock(&buffers_mutex);
+  buffer->id_ = buffers.size();
+  buffer->name_ = name;
+  if (name.empty()) {
+    stringstream ss;
+    ss << "Thread " << buffer->id_;
+    buffer->name_ = ss.str();
+  }
+  buffers.push_back(buffer);
+  pthread_mutex_unlock(&buffers_mutex);
+  return buffer;
+}
+
+static void createKey() {
+  pthread_key_create(&buffer_key, NULL);
+}
+
+static ThreadBuffer* getBuffer() {
+  pthread_once(&key_once, createKey);
+  ThreadBuffer* buffer = (ThreadBuffer*)pthread_getspecific(buffer_key);
+  if (!buffer) {
+    buffer = newBuffer("");
+    pthread_setspecific(buffer_key, buffer);
+  }
+  return buffer;
+}
+
+static void push(ThreadBuffer* buffer, const char* name, uint64_t start,
+                 uint64_t end) {
+  pthread_mutex_lock(&buffer->mutex_);
+  Event& event = buffer->events_[buffer->written_ % kCapacity];
+  event.name_ = name;
+  event.start_ = start;
+  event.end_ = end;
+  buffer->written_++;
+  pthread_mutex_unlock(&buffer->mutex_);
+}
+
+void SetEnabled(bool enable) {
+  enabled = enable;
+}
+
+bool IsEnabled() {
+  return enabled;
+}
+
+uint64_t Now() {
+  timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t)t.tv_sec * 1000000000u + t.tv_nsec;
+}
+
+void SetThreadName(const string& name) {
+  ThreadBuffer* buffer = getBuffer();
+  pthread_mutex_lock(&buffers_mutex);
+  buffer->name_ = name;
+  pthread_mutex_unlock(&buffers_mutex);
+}
+
+void Record(const char* name, uint64_t start, uint64_t end) {
+  if (enabled) {
+    push(getBuffer(), name, start, end);
+  }
+}
+
+// GPU zones are timed with a pair of timestamp queries each. A frame's
+// queries are only read back kGpuFrames frames later, by when they have
+// nearly always finished, so reading them never stalls the pipeline.
+struct GpuQuery {
+  const char* name_;
+  GLuint begin_;
+  GLuint end_;
+};
+
+struct GpuFrame {
+  vector<GpuQuery> queries_;
+  unsigned used_;
+};
+
+static const unsigned kGpuFrames = 4;
+static GpuFrame gpu_frames[kGpuFrames];
+static unsigned gpu_frame = 0;
+static ThreadBuffer* gpu_buffer = NULL;
+// CPU time minus GPU time, in nanoseconds.
+static int64_t gpu_offset = 0;
+
+static bool hasTimerQuery() {
+  static int supported = -1;
+  if (supported < 0) {
+    const char* extensions = (const char*)glGetString(GL_EXTENSIONS);
+    supported = extensions &&
+                strstr(extensions, "GL_ARB_timer_query") != NULL;
+  }
+  return supported;
+}
+
+GpuZone::GpuZone(const char* name)
+    : frame_(gpu_frame % kGpuFrames)
+    , query_(-1) {
+  if (!enabled || !hasTimerQuery()) {
+    return;
+  }
+
+  GpuFrame& frame = gpu_frames[frame_];
+  if (frame.used_ == frame.queries_.size()) {
+    GpuQuery query;
+    glGenQueries(1, &query.begin_);
+    glGenQueries(1, &query.end_);
+    frame.queries_.push_back(query);
+  }
+  query_ = frame.used_++;
+  GpuQuery& query = frame.queries_[query_];
+  query.name_ = name;
+  glQueryCounter(query.begin_, GL_TIMESTAMP);
+}
+
+GpuZone::~GpuZone() {
+  if (query_ >= 0) {
+    glQueryCounter(gpu_frames[frame_].queries_[query_].end_, GL_TIMESTAMP);
+  }
+}
+
+// Reads back the queries of the frame whose slot is about to be reused.
+// Any that still haven't finished are dropped.
+static void collectGpuFrame(GpuFrame& frame) {
+  if (!gpu_buffer) {
+    gpu_buffer = newBuffer("GPU");
+  }
+
+  for (unsigned i = 0; i < frame.used_; i++) {
+    const GpuQuery& query = frame.queries_[i];
+    GLint available = 0;
+    glGetQueryObjectiv(query.end_, GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!available) {
+      continue;
+    }
+    GLuint64 begin = 0;
+    GLuint64 end = 0;
+    glGetQueryObjectui64v(query.begin_, GL_QUERY_RESULT, &begin);
+    glGetQueryObjectui64v(query.end_, GL_QUERY_RESULT, &end);
+    push(gpu_buffer, query.name_, begin + gpu_offset, end + gpu_offset);
+  }
+  frame.used_ = 0;
+}
+
+struct ZoneTotal {
+  string name_;
+  double ms_;
+
+  bool operator<(const ZoneTotal& other) const { return ms_ > other.ms_; }
+};
+
+static const unsigned kFrameHistory = 240;
+
+static uint64_t last_frame_end = 0;
+static vector<ZoneTotal> frame_totals;
+static double frame_ms = 0.0;
+static vector<float> frame_history;
+static unsigned frames = 0;
+
+void EndFrame() {
+  uint64_t now = Now();
+  if (last_frame_end) {
+    frame_ms = (now - last_frame_end) * 1e-6;
+    Record("Frame", last_frame_end, now);
+    frame_history.resize(kFrameHistory);
+    frame_history[frames % kFrameHistory] = frame_ms;
+    frames++;
+  }
+  last_frame_end = now;
+
+  if (enabled && hasTimerQuery()) {
+    GLint64 gpu_now = 0;
+    glGetInteger64v(GL_TIMESTAMP, &gpu_now);
+    gpu_offset = (int64_t)Now() - gpu_now;
+
+    gpu_frame++;
+    collectGpuFrame(gpu_frames[gpu_frame % kGpuFrames]);
+  }
+
+  // Everything recorded since the last frame counts towards this one, even
+  // if it was the tail of something that started earlier.
+  map<string, double> totals;
+  pthread_mutex_lock(&buffers_mutex);
+  vector<ThreadBuffer*> all = buffers;
+  pthread_mutex_unlock(&buffers_mutex);
+  for (unsigned b = 0; b < all.size(); b++) {
+    ThreadBuffer* buffer = all[b];
+    string suffix = buffer == gpu_buffer ? " (GPU)" : "";
+    pthread_mutex_lock(&buffer->mutex_);
+    uint64_t first = buffer->totaled_;
+    if (buffer->written_ - first > kCapacity) {
+      first = buffer->written_ - kCapacity;
+    }
+    for (uint64_t i = first; i < buffer->written_; i++) {
+      const Event& event = buffer->events_[i % kCapacity];
+      if (strcmp(event.name_, "Frame") != 0) {
+        totals[event.name_ + suffix] += (event.end_ - event.start_) * 1e-6;
+      }
+    }
+    buffer->totaled_ = buffer->written_;
+    pthread_mutex_unlock(&buffer->mutex_);
+  }
+
+  frame_totals.clear();
+  map<string, double>::const_iterator it = totals.begin();
+  for (; it != totals.end(); it++) {
+    ZoneTotal total;
+    total.name_ = it->first;
+    total.ms_ = it->second;
+    frame_totals.push_back(total);
+  }
+  std::stable_sort(frame_totals.begin(), frame_totals.end());
+}
+
+static const int kLineHeight = 14;
+static const int kTextWidth = 200;
+static const int kBarWidth = 120;
+static const unsigned kHistogramBins = 50;
+static const int kBinWidth = 6;
+static const int kHistogramHeight = 60;
+
+static void drawText(int x, int y, const string& text, unsigned font_lists) {
+  if (!font_lists) {
+    return;
+  }
+  glRasterPos2i(x, y);
+  glListBase(font_lists);
+  glCallLists(text.size(), GL_UNSIGNED_BYTE, text.c_str());
+}
+
+static void drawRect(int x, int y, int width, int height) {
+  glBegin(GL_QUADS);
+  glVertex2i(x, y);
+  glVertex2i(x, y + height);
+  glVertex2i(x + width, y + height);
+  glVertex2i(x + width, y);
+  glEnd();
+}
+
+void DrawOverlay(unsigned width, unsigned height, unsigned font_lists) {
+  if (frames == 0) {
+    return;
+  }
+
+  unsigned history = std::min(frames, kFrameHistory);
+  double total = 0.0;
+  double longest = 0.0;
+  vector<unsigned> bins(kHistogramBins);
+  for (unsigned i = 0; i < history; i++) {
+    double ms = frame_history[i];
+    total += ms;
+    longest = std::max(longest, ms);
+    bins[std::min((unsigned)ms, kHistogramBins - 1)]++;
+  }
+  unsigned tallest = *std::max_element(bins.begin(), bins.end());
+
+  glPushAttrib(GL_ENABLE_BIT | GL_CURRENT_BIT | GL_COLOR_BUFFER_BIT |
+               GL_LIST_BIT | GL_TRANSFORM_BIT);
+  glDisable(GL_LIGHTING);
+  glDisable(GL_TEXTURE_2D);
+  glDisable(GL_DEPTH_TEST);
+  glDisable(GL_CULL_FACE);
+  glEnable(GL_BLEND);
+  glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+  // Pixel coordinates from the top left.
+  glMatrixMode(GL_PROJECTION);
+  glPushMatrix();
+  glLoadIdentity();
+  glOrtho(0, width, height, 0, -1, 1);
+  glMatrixMode(GL_MODELVIEW);
+  glPushMatrix();
+  glLoadIdentity();
+
+  int x = 8;
+  int y = 8;
+  int panel_width = kTextWidth + kBarWidth + 8;
+  int panel_height = (frame_totals.size() + 3) * kLineHeight +
+                     kHistogramHeight + 16;
+  glColor4f(0.0, 0.0, 0.0, 0.6);
+  drawRect(x - 4, y - 4, panel_width, panel_height);
+
+  stringstream ss;
+  ss.setf(std::ios::fixed);
+  ss.precision(2);
+  ss << "Frame " << frame_ms << " ms, " << 1000.0 / frame_ms << " fps";
+  glColor4f(1.0, 1.0, 1.0, 1.0);
+  y += kLineHeight;
+  drawText(x, y - 3, ss.str(), font_lists);
+
+  // Each zone's share of the frame.
+  for (unsigned i = 0; i < frame_totals.size(); i++) {
+    const ZoneTotal& zone = frame_totals[i];
+    double share = frame_ms > 0.0 ? std::min(zone.ms_ / frame_ms, 1.0) : 0.0;
+    bool gpu = zone.name_.find(" (GPU)") != string::npos;
+    if (gpu) {
+      glColor4f(1.0, 0.6, 0.2, 0.8);
+    } else {
+      glColor4f(0.3, 0.8, 0.3, 0.8);
+    }
+    drawRect(x + kTextWidth, y + 3, (int)(share * kBarWidth) + 1,
+             kLineHeight - 4);
+
+    ss.str("");
+    ss << zone.name_ << " " << zone.ms_ << " ms";
+    glColor4f(1.0, 1.0, 1.0, 1.0);
+    y += kLineHeight;
+    drawText(x, y - 3, ss.str(), font_lists);
+  }
+
+  ss.str("");
+  ss << "Last " << history << " frames: mean " << total / history
+     << " ms, max " << longest << " ms";
+  y += kLineHeight;
+  drawText(x, y - 3, ss.str(), font_lists);
+
+  // One bar per millisecond, the last taking everything longer.
+  y += 4;
+  glColor4f(0.3, 0.3, 0.3, 0.8);
+  drawRect(x, y, kHistogramBins * kBinWidth, kHistogramHeight);
+  glColor4f(0.4, 0.7, 1.0, 0.9);
+  for (unsigned i = 0; i < kHistogramBins; i++) {
+    int bar = bins[i] * kHistogramHeight / tallest;
+    drawRect(x + i * kBinWidth, y + kHistogramHeight - bar, kBinWidth - 1,
+             bar);
+  }
+  y += kHistogramHeight + kLineHeight;
+  glColor4f(1.0, 1.0, 1.0, 1.0);
+  ss.str("");
+  ss << "0";
+  drawText(x, y - 3, ss.str(), font_lists);
+  ss.str("");
+  ss << kHistogramBins << "+ ms";
+  drawText(x + (kHistogramBins - 5) * kBinWidth, y - 3, ss.str(), font_lists);
+
+  glMatrixMode(GL_PROJECTION);
+  glPopMatrix();
+  glMatrixMode(GL_MODELVIEW);
+  glPopMatrix();
+  glPopAttrib();
+}
+
+static string escape(const string& text) {
+  string out;
+  for (unsigned i = 0; i < text.size(); i++) {
+    if (text[i] == '"' || text[i] == '\\') {
+      out += '\\';
+    }
+    out += text[i];
+  }
+  return out;
+}
+
+bool WriteTrace(const string& file_name) {
+  ofstream out(file_name.c_str());
+  if (!out) {
+    return false;
+  }
+
+  pthread_mutex_lock(&buffers_mutex);
+  vector<ThreadBuffer*> all = buffers;
+  vector<string> names;
+  for (unsigned b = 0; b < all.size(); b++) {
+    names.push_back(all[b]->name_);
+  }
+  pthread_mutex_unlock(&buffers_mutex);
+
+  vector<vector<Event> > events(all.size());
+  uint64_t origin = ~(uint64_t)0;
+  for (unsigned b = 0; b < all.size(); b++) {
+    ThreadBuffer* buffer = all[b];
+    pthread_mutex_lock(&buffer->mutex_);
+    uint64_t first = 0;
+    if (buffer->written_ > kCapacity) {
+      first = buffer->written_ - kCapacity;
+    }
+    for (uint64_t i = first; i < buffer->written_; i++) {
+      events[b].push_back(buffer->events_[i % kCapacity]);
+      origin = std::min(origin, events[b].back().start_);
+    }
+    pthread_mutex_unlock(&buffer->mutex_);
+  }
+
+  // Times are in microseconds from the first event.
+  out.setf(std::ios::fixed);
+  out.precision(3);
+  out << "{\"traceEvents\":[" << std::endl;
+  bool first = true;
+  for (unsigned b = 0; b < all.size(); b++) {
+    out << (first ? "" : ",\n")
+        << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << b
+        << ",\"args\":{\"name\":\"" << escape(names[b]) << "\"}}";
+    first = false;
+
+    for (unsigned i = 0; i < events[b].size(); i++) {
+      const Event& event = events[b][i];
+      out << ",\n{\"name\":\"" << escape(event.name_)
+          << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << b
+          << ",\"ts\":" << (event.start_ - origin) * 1e-3
+          << ",\"dur\":" << (event.end_ - event.start_) * 1e-3 << "}";
+    }
+  }
+  out << "\n],\"displayTimeUnit\":\"ms\"}" << std::endl;
+
+  return out.good();
+}
+
+}
@@ -0,0 +1,90 @@
+#ifndef __PROFILER_H__
+#define __PROFILER_H__
+
+#include <stdint.h>
+#include <string>
+
+// Scoped timing of named zones, on any thread, for finding out where frames
+// go. Each thread records into a ring buffer of its own, so only the latest
+// events are kept and recording only waits while EndFrame() or WriteTrace()
+// is reading that thread's buffer.
+//
+//   void Water::Animate() {
+//     PROFILE_ZONE("water");
+//     ...
+//   }
+//
+// Zone names must be string literals, or at least outlive the profiler.
+// Every frame's events are summed by name in EndFrame() for the overlay, and
+// everything still in the buffers can be written out as a Chrome trace
+// (chrome://tracing or ui.perfetto.dev).
+namespace Profiler {
+  // Recording is on from the start.
+  void SetEnabled(bool enabled);
+  bool IsEnabled();
+
+  // Nanoseconds on the monotonic clock.
+  uint64_t Now();
+
+  // Names the calling thread in traces. Unnamed threads are numbered.
+  void SetThreadName(const std::string& name);
+
+  // Does nothing while recording is off.
+  void Record(const char* name, uint64_t start, uint64_t end);
+
+  // Times a zone from construction to destruction.
+  class Zone {
+   public:
+    Zone(const char* name)
+        : name_(name)
+        , start_(IsEnabled() ? Now() : 0) {}
+    ~Zone() {
+      if (start_) {
+        Record(name_, start_, Now());
+      }
+    }
+
+   private:
+    const char* name_;
+    uint64_t start_;
+  };
+
+  // Times the GL commands issued from construction to destruction with timer
+  // queries, where GL_ARB_timer_query is available; otherwise does nothing.
+  // Only for the thread with the GL context. Results arrive a few frames
+  // later, once the GPU has caught up, on a "GPU" track of their own.
+  class GpuZone {
+   public:
+    GpuZone(const char* name);
+    ~GpuZone();
+
+   private:
+    unsigned frame_;
+    // Index into the frame's queries, or -1 when not timing.
+    int query_;
+  };
+
+  // Called once a frame after the last draw, on the thread drawing, with the
+  // GL context current. A frame is the time since the last call. Collects
+  // finished GPU zones and totals each zone over the frame for the overlay.
+  void EndFrame();
+
+  // Draws the last frame's zone totals and a histogram of recent frame times
+  // over the top left of a width x height viewport. Labels need display
+  // lists for the ASCII characters starting at font_lists; without them,
+  // 0, only the bars are drawn.
+  void DrawOverlay(unsigned width, unsigned height, unsigned font_lists = 0);
+
+  // Writes the events in every thread's buffer in Chrome's trace event
+  // format.
+  bool WriteTrace(const std::string& file_name);
+};
+
+#define PROFILE_JOIN_(a, b) a##b
+#define PROFILE_JOIN(a, b) PROFILE_JOIN_(a, b)
+#define PROFILE_ZONE(name) \
+  Profiler::Zone PROFILE_JOIN(profile_zone_, __LINE__)(name)
+#define PROFILE_GPU_ZONE(name) \
+  Profiler::GpuZone PROFILE_JOIN(profile_gpu_zone_, __LINE__)(name)
+
+#endif
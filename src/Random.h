@@ -0,0 +1,33 @@
+#ifndef __RANDOM_H__
+#define __RANDOM_H__
+
+#include <stdint.h>
+
+// Counter based random numbers: the number for a counter is a hash of the
+// counter and the key, so a stream can be read in any order from any thread.
+// This is splitmix64 with its state worked out from the counter.
+class CounterRandom {
+ public:
+  CounterRandom(uint64_t seed, uint64_t stream = 0)
+      : key_(Mix(Mix(seed) ^ stream)) {}
+
+  uint64_t Get(uint64_t counter) const {
+    return Mix(key_ + (counter + 1) * 0x9e3779b97f4a7c15ull);
+  }
+
+  // Uniform in [0, 1).
+  double Uniform(uint64_t counter) const {
+    return (Get(counter) >> 11) * (1.0 / 9007199254740992.0);
+  }
+
+ private:
+  static uint64_t Mix(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+  }
+
+  uint64_t key_;
+};
+
+#endif
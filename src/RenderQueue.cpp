@@ -0,0 +1,137 @@
+#include "RenderQueue.h"
+
+#include <algorithm>
+#include <cstring>
+#include <GL/gl.h>
+
+#include "Material.h"
+#include "Node.h"
+#include "Primitive.h"
+#include "Profiler.h"
+
+using std::sort;
+using std::vector;
+
+RenderQueue::RenderQueue()
+    : last_source_(NULL)
+    , last_group_(0)
+    , material_changes_(0) {}
+
+void RenderQueue::Clear() {
+  items_.clear();
+  groups_.clear();
+  last_source_ = NULL;
+}
+
+// Consecutive draws mostly share a material, so the last one is checked
+// before the map.
+unsigned RenderQueue::GetGroup(const void* source) {
+  if (source != last_source_ || items_.empty()) {
+    GroupMap::iterator it = groups_.find(source);
+    if (it == groups_.end()) {
+      it = groups_.insert(GroupMap::value_type(source, groups_.size())).first;
+    }
+    last_source_ = source;
+    last_group_ = it->second;
+  }
+  return last_group_;
+}
+
+void RenderQueue::Add(const Material* material, const Primitive* primitive,
+                      const Matrix4x4& transform) {
+  Item item;
+  item.material_ = material;
+  item.primitive_ = primitive;
+  item.node_ = NULL;
+  item.transform_ = &transform;
+  item.group_ = GetGroup(material);
+  items_.push_back(item);
+}
+
+void RenderQueue::Add(const Node* node, const Matrix4x4& transform) {
+  Item item;
+  item.material_ = NULL;
+  item.primitive_ = NULL;
+  item.node_ = node;
+  item.transform_ = &transform;
+  item.group_ = GetGroup(node);
+  items_.push_back(item);
+}
+
+// Sorts keys in place, giving up once budget elements have been moved.
+template <typename Key>
+static bool insertionSort(vector<Key>& keys, size_t budget) {
+  for (unsigned i = 1; i < keys.size(); i++) {
+    Key key = keys[i];
+    unsigned j = i;
+    for (; j > 0 && key < keys[j - 1]; j--) {
+      if (budget-- == 0) {
+        return false;
+      }
+      keys[j] = keys[j - 1];
+    }
+    keys[j] = key;
+  }
+  return true;
+}
+
+void RenderQueue::Submit(const double view[16]) {
+  // Draws mostly come in the same order from frame to frame and barely move,
+  // so last frame's order is kept while the number of draws is the same and
+  // put right with an insertion sort. A full sort takes over if that would
+  // move too much.
+  uint64_t sort_start = Profiler::Now();
+  bool reuse = keys_.size() == items_.size();
+  if (!reuse) {
+    keys_.resize(items_.size());
+    for (unsigned i = 0; i < keys_.size(); i++) {
+      keys_[i].item_ = i;
+    }
+  }
+
+  // Depth is the distance in front of the eye of each draw's origin, whose
+  // float bits sort in the same order as the values while they are positive.
+  for (unsigned i = 0; i < keys_.size(); i++) {
+    const Item& item = items_[keys_[i].item_];
+    const double* m = item.transform_->Begin();
+    float depth = -(view[2] * m[3] + view[6] * m[7] + view[10] * m[11] +
+                    view[14]);
+    uint32_t depth_bits = 0;
+    if (depth > 0) {
+      memcpy(&depth_bits, &depth, sizeof(depth_bits));
+    }
+    keys_[i].key_ = ((uint64_t)item.group_ << 32) | depth_bits;
+  }
+
+  if (!reuse || !insertionSort(keys_, 4 * keys_.size())) {
+    sort(keys_.begin(), keys_.end());
+  }
+  Profiler::Record("Render queue sort", sort_start, Profiler::Now());
+
+  material_changes_ = 0;
+  const Material* current = NULL;
+  glPushMatrix();
+
+  for (unsigned i = 0; i < keys_.size(); i++) {
+    const Item& item = items_[keys_[i].item_];
+    glLoadMatrixd(view);
+    glMultTransposeMatrixd(item.transform_->Begin());
+
+    if (item.node_) {
+      item.node_->Render();
+      current = NULL;
+      continue;
+    }
+
+    if (item.material_ && item.material_ != current) {
+      item.material_->Render();
+      current = item.material_;
+      material_changes_++;
+    }
+    if (item.primitive_) {
+      item.primitive_->Render();
+    }
+  }
+
+  glPopMatrix();
+}
@@ -0,0 +1,76 @@
+#ifndef __RENDER_QUEUE_H__
+#define __RENDER_QUEUE_H__
+
+#include <map>
+#include <stdint.h>
+#include <vector>
+
+#include "Algebra.h"
+
+class Material;
+class Node;
+class Primitive;
+
+// Draws collected this frame, submitted grouped by material and front to back
+// within each group, so that a material shared by many nodes is set up once
+// rather than once per node.
+//
+// Groups keep the order in which their materials were first added, which
+// keeps the order between unrelated materials the same as a plain traversal.
+// Everything is assumed to be opaque.
+class RenderQueue {
+ public:
+  RenderQueue();
+
+  void Clear();
+
+  // Transformations are row major and must outlive Submit().
+  void Add(const Material* material, const Primitive* primitive,
+           const Matrix4x4& transform);
+  // A node that is drawn with its own Render(), which may leave any material
+  // set up.
+  void Add(const Node* node, const Matrix4x4& transform);
+
+  // Sorts and draws everything added, with view (column major, as GL keeps
+  // it) in front of each transformation.
+  void Submit(const double view[16]);
+
+  unsigned GetSize() const { return items_.size(); }
+  // How many times the last Submit() set up a material.
+  unsigned GetMaterialChanges() const { return material_changes_; }
+
+ private:
+  struct Item {
+    const Material* material_;
+    const Primitive* primitive_;
+    const Node* node_;
+    const Matrix4x4* transform_;
+    unsigned group_;
+  };
+
+  // The order draws are submitted in.
+  struct SortKey {
+    // The group in the high half and the depth's float bits in the low.
+    uint64_t key_;
+    unsigned item_;
+
+    bool operator<(const SortKey& other) const {
+      return key_ < other.key_ ||
+             (key_ == other.key_ && item_ < other.item_);
+    }
+  };
+
+  unsigned GetGroup(const void* source);
+
+  std::vector<Item> items_;
+  std::vector<SortKey> keys_;
+
+  typedef std::map<const void*, unsigned> GroupMap;
+  GroupMap groups_;
+  const void* last_source_;
+  unsigned last_group_;
+
+  unsigned material_changes_;
+};
+
+#endif
@@ -0,0 +1,216 @@
+#include "Scheduler.h"
+
+#include <algorithm>
+#include <time.h>
+
+#include "Profiler.h"
+
+using std::max;
+using std::min;
+using std::vector;
+
+// Falling further behind than this many ticks isn't made up for. A slow step
+// then slows the simulation down for a moment rather than leaving it racing
+// through a backlog of ticks afterwards.
+static const unsigned kMaxLag = 4;
+
+Scheduler::Scheduler(double tick)
+    : tick_((uint64_t)(tick * 1e9))
+    , running_(false)
+    , quit_(false)
+    , published_(0)
+    , dropped_(0) {
+  if (tick_ == 0) {
+    tick_ = 1;
+  }
+
+  // Deadlines come from Profiler::Now(), which is the monotonic clock.
+  pthread_condattr_t attributes;
+  pthread_condattr_init(&attributes);
+  pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+  pthread_mutex_init(&mutex_, NULL);
+  pthread_cond_init(&wake_, &attributes);
+  pthread_condattr_destroy(&attributes);
+}
+
+Scheduler::~Scheduler() {
+  Stop();
+
+  vector<Simulation::Snapshot*> garbage;
+  for (unsigned i = 0; i < slots_.size(); i++) {
+    Release(slots_[i].previous_, garbage);
+    Release(slots_[i].current_, garbage);
+  }
+  for (unsigned i = 0; i < garbage.size(); i++) {
+    delete garbage[i];
+  }
+
+  pthread_cond_destroy(&wake_);
+  pthread_mutex_destroy(&mutex_);
+}
+
+void Scheduler::Add(Simulation* simulation) {
+  Slot slot;
+  slot.simulation_ = simulation;
+  slot.previous_ = NULL;
+  slot.current_ = simulation->TakeSnapshot();
+  slot.current_->references_ = 1;
+
+  pthread_mutex_lock(&mutex_);
+  slots_.push_back(slot);
+  published_ = Profiler::Now();
+  pthread_mutex_unlock(&mutex_);
+}
+
+void Scheduler::Start() {
+  if (running_) {
+    return;
+  }
+
+  quit_ = false;
+  running_ = true;
+  pthread_create(&thread_, NULL, ThreadMain, this);
+}
+
+void Scheduler::Stop() {
+  if (!running_) {
+    return;
+  }
+
+  pthread_mutex_lock(&mutex_);
+  quit_ = true;
+  pthread_cond_signal(&wake_);
+  pthread_mutex_unlock(&mutex_);
+  pthread_join(thread_, NULL);
+  running_ = false;
+}
+
+void Scheduler::Tick() {
+  // Slots are only added before stepping starts and only this thread changes
+  // their snapshots, so they can be read unlocked here.
+  vector<Simulation::Snapshot*> snapshots(slots_.size());
+  {
+    PROFILE_ZONE("Simulation step");
+    for (unsigned i = 0; i < slots_.size(); i++) {
+      slots_[i].simulation_->Step();
+      snapshots[i] = slots_[i].simulation_->TakeSnapshot();
+    }
+  }
+  Publish(snapshots);
+}
+
+void Scheduler::Publish(const vector<Simulation::Snapshot*>& snapshots) {
+  vector<Simulation::Snapshot*> garbage;
+
+  pthread_mutex_lock(&mutex_);
+  for (unsigned i = 0; i < slots_.size(); i++) {
+    Slot& slot = slots_[i];
+    Release(slot.previous_, garbage);
+    slot.previous_ = slot.current_;
+    slot.current_ = snapshots[i];
+    slot.current_->references_ = 1;
+  }
+  published_ = Profiler::Now();
+  pthread_mutex_unlock(&mutex_);
+
+  // Snapshots can be big, so they're freed outside the lock.
+  for (unsigned i = 0; i < garbage.size(); i++) {
+    delete garbage[i];
+  }
+}
+
+void Scheduler::Present() {
+  vector<Slot> slots;
+
+  pthread_mutex_lock(&mutex_);
+  slots = slots_;
+  for (unsigned i = 0; i < slots.size(); i++) {
+    if (slots[i].previous_) {
+      slots[i].previous_->references_++;
+    }
+    slots[i].current_->references_++;
+  }
+  uint64_t published = published_;
+  pthread_mutex_unlock(&mutex_);
+
+  // The newest snapshot is shown a tick after it was published, by when the
+  // next one should have arrived to carry on from it.
+  double alpha = 1.0;
+  if (running_) {
+    uint64_t now = Profiler::Now();
+    alpha = now > published ? (double)(now - published) / tick_ : 0.0;
+    alpha = max(0.0, min(alpha, 1.0));
+  }
+
+  {
+    PROFILE_ZONE("Simulation present");
+    for (unsigned i = 0; i < slots.size(); i++) {
+      const Simulation::Snapshot* current = slots[i].current_;
+      const Simulation::Snapshot* previous = slots[i].previous_;
+      slots[i].simulation_->Present(previous ? *previous : *current, *current,
+                                    alpha);
+    }
+  }
+
+  vector<Simulation::Snapshot*> garbage;
+  pthread_mutex_lock(&mutex_);
+  for (unsigned i = 0; i < slots.size(); i++) {
+    Release(slots[i].previous_, garbage);
+    Release(slots[i].current_, garbage);
+  }
+  pthread_mutex_unlock(&mutex_);
+
+  for (unsigned i = 0; i < garbage.size(); i++) {
+    delete garbage[i];
+  }
+}
+
+unsigned Scheduler::GetDropped() {
+  pthread_mutex_lock(&mutex_);
+  unsigned dropped = dropped_;
+  pthread_mutex_unlock(&mutex_);
+  return dropped;
+}
+
+void Scheduler::Release(Simulation::Snapshot* snapshot,
+                        vector<Simulation::Snapshot*>& garbage) {
+  if (snapshot && --snapshot->references_ == 0) {
+    garbage.push_back(snapshot);
+  }
+}
+
+void* Scheduler::ThreadMain(void* arg) {
+  Scheduler* scheduler = (Scheduler*)arg;
+  Profiler::SetThreadName("Simulation");
+
+  uint64_t next = Profiler::Now();
+  pthread_mutex_lock(&scheduler->mutex_);
+  while (!scheduler->quit_) {
+    uint64_t now = Profiler::Now();
+    if (now < next) {
+      timespec deadline;
+      deadline.tv_sec = next / 1000000000u;
+      deadline.tv_nsec = next % 1000000000u;
+      pthread_cond_timedwait(&scheduler->wake_, &scheduler->mutex_,
+                             &deadline);
+      continue;
+    }
+    pthread_mutex_unlock(&scheduler->mutex_);
+
+    scheduler->Tick();
+
+    next += scheduler->tick_;
+    now = Profiler::Now();
+    unsigned dropped = 0;
+    if (now > next + kMaxLag * scheduler->tick_) {
+      dropped = (now - next) / scheduler->tick_;
+      next = now;
+    }
+
+    pthread_mutex_lock(&scheduler->mutex_);
+    scheduler->dropped_ += dropped;
+  }
+  pthread_mutex_unlock(&scheduler->mutex_);
+
+  return NULL;
+}
@@ -0,0 +1,75 @@
+#ifndef __SCHEDULER_H__
+#define __SCHEDULER_H__
+
+#include <pthread.h>
+#include <stdint.h>
+#include <vector>
+
+#include "Simulation.h"
+
+// Steps simulations at a fixed tick, so they move at the same speed whatever
+// the frame rate, and hands the renderer the last two snapshots of each.
+//
+// Once started the steps run on a thread of its own and Present() shows the
+// simulations one tick behind the newest snapshot, interpolated between the
+// last two, so a slow step costs the renderer nothing and a smooth frame rate
+// stays smooth even when it isn't a multiple of the tick. Unstarted, Tick()
+// steps on the calling thread and Present() shows the newest snapshot, which
+// is the same on every run.
+class Scheduler {
+ public:
+  Scheduler(double tick = 1.0 / 60);
+  // Stops the thread. The simulations aren't deleted.
+  ~Scheduler();
+
+  // Adds a simulation before Start() or the first Tick(). Its first snapshot
+  // is taken straight away, so there's always something to present.
+  void Add(Simulation* simulation);
+
+  void Start();
+  // Waits for the step in progress, if any.
+  void Stop();
+  bool IsRunning() const { return running_; }
+
+  // Steps every simulation once and publishes their snapshots. Only for when
+  // the scheduler isn't running.
+  void Tick();
+
+  // Shows every simulation as of now. Call on the thread that draws.
+  void Present();
+
+  // Ticks given up on because the simulation fell too far behind.
+  unsigned GetDropped();
+
+ private:
+  Scheduler(const Scheduler&);
+  Scheduler& operator=(const Scheduler&);
+
+  struct Slot {
+    Simulation* simulation_;
+    Simulation::Snapshot* previous_;
+    Simulation::Snapshot* current_;
+  };
+
+  static void* ThreadMain(void* scheduler);
+  void Publish(const std::vector<Simulation::Snapshot*>& snapshots);
+  // Drops a reference, adding the snapshot to garbage if it was the last.
+  // Needs mutex_ held.
+  static void Release(Simulation::Snapshot* snapshot,
+                      std::vector<Simulation::Snapshot*>& garbage);
+
+  uint64_t tick_;
+  bool running_;
+
+  pthread_t thread_;
+  pthread_mutex_t mutex_;
+  pthread_cond_t wake_;
+  bool quit_;
+
+  // Guarded by mutex_.
+  std::vector<Slot> slots_;
+  uint64_t published_;
+  unsigned dropped_;
+};
+
+#endif
@@ -0,0 +1,167 @@
+#include "SimdAlgebra.h"
+
+Mat4f::Mat4f(const Matrix4x4& m) {
+  const double* v = m.Begin();
+  for (unsigned j = 0; j < 4; j++) {
+    columns_[j] = Vec4f(v[j], v[4 + j], v[8 + j], v[12 + j]);
+  }
+}
+
+Matrix4x4 Mat4f::ToMatrix4x4() const {
+  const float* c = Begin();
+  double v[16];
+  for (unsigned i = 0; i < 4; i++) {
+    for (unsigned j = 0; j < 4; j++) {
+      v[4 * i + j] = c[4 * j + i];
+    }
+  }
+  return Matrix4x4(v);
+}
+
+#if defined(__AVX__) || defined(__SSE2__)
+
+// u x v in the first three lanes, with 0 in the fourth if both had 0 there.
+static inline __m128 cross(__m128 u, __m128 v) {
+  __m128 u_yzx = _mm_shuffle_ps(u, u, _MM_SHUFFLE(3, 0, 2, 1));
+  __m128 v_yzx = _mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 0, 2, 1));
+  __m128 r = _mm_sub_ps(_mm_mul_ps(u, v_yzx), _mm_mul_ps(u_yzx, v));
+  return _mm_shuffle_ps(r, r, _MM_SHUFFLE(3, 0, 2, 1));
+}
+
+Mat4f Mat4f::Transpose() const {
+  __m128 c0 = columns_[0].v_;
+  __m128 c1 = columns_[1].v_;
+  __m128 c2 = columns_[2].v_;
+  __m128 c3 = columns_[3].v_;
+  _MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+  return Mat4f(Vec4f(c0), Vec4f(c1), Vec4f(c2), Vec4f(c3));
+}
+
+// With a, b and c the first three columns, the rows of the inverse of the
+// upper 3x3 are b x c, c x a and a x b over the determinant a . (b x c). The
+// translation t goes to -(inverse * t).
+Mat4f Mat4f::AffineInverse() const {
+  __m128 w_mask = _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1));
+  __m128 a = _mm_and_ps(columns_[0].v_, w_mask);
+  __m128 b = _mm_and_ps(columns_[1].v_, w_mask);
+  __m128 c = _mm_and_ps(columns_[2].v_, w_mask);
+  __m128 t = columns_[3].v_;
+
+  __m128 r0 = cross(b, c);
+  __m128 r1 = cross(c, a);
+  __m128 r2 = cross(a, b);
+
+  __m128 d = _mm_mul_ps(a, r0);
+  d = _mm_add_ps(d, _mm_movehl_ps(d, d));
+  d = _mm_add_ss(d, _mm_shuffle_ps(d, d, 1));
+  __m128 scale = _mm_div_ps(_mm_set1_ps(1.0f), _mm_shuffle_ps(d, d, 0));
+  r0 = _mm_mul_ps(r0, scale);
+  r1 = _mm_mul_ps(r1, scale);
+  r2 = _mm_mul_ps(r2, scale);
+
+  __m128 r3 = _mm_setzero_ps();
+  _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+
+  __m128 u = _mm_mul_ps(r0, _mm_shuffle_ps(t, t, 0x00));
+  u = _mm_add_ps(u, _mm_mul_ps(r1, _mm_shuffle_ps(t, t, 0x55)));
+  u = _mm_add_ps(u, _mm_mul_ps(r2, _mm_shuffle_ps(t, t, 0xaa)));
+  u = _mm_sub_ps(_mm_set_ps(1.0f, 0.0f, 0.0f, 0.0f), u);
+
+  return Mat4f(Vec4f(r0), Vec4f(r1), Vec4f(r2), Vec4f(u));
+}
+
+// Stores x, y and z without touching the float after them.
+static inline void store3(float* p, __m128 v) {
+  _mm_storel_pi((__m64*)p, v);
+  _mm_store_ss(p + 2, _mm_movehl_ps(v, v));
+}
+
+void TransformPoints(const Mat4f& m, const float* in, float* out,
+                     unsigned count, unsigned stride) {
+  unsigned i = 0;
+
+#if defined(__AVX__)
+  // Two points at a time, one in each half.
+  __m256 c0 = _mm256_broadcast_ps(&m.columns_[0].v_);
+  __m256 c1 = _mm256_broadcast_ps(&m.columns_[1].v_);
+  __m256 c2 = _mm256_broadcast_ps(&m.columns_[2].v_);
+  __m256 c3 = _mm256_broadcast_ps(&m.columns_[3].v_);
+  for (; i + 2 <= count; i += 2) {
+    const float* p = in + i * stride;
+    const float* q = p + stride;
+    __m256 x = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_load1_ps(p)),
+                                    _mm_load1_ps(q), 1);
+    __m256 y = _mm256_insertf128_ps(
+        _mm256_castps128_ps256(_mm_load1_ps(p + 1)), _mm_load1_ps(q + 1), 1);
+    __m256 z = _mm256_insertf128_ps(
+        _mm256_castps128_ps256(_mm_load1_ps(p + 2)), _mm_load1_ps(q + 2), 1);
+    __m256 r = _mm256_add_ps(c3, _mm256_mul_ps(c0, x));
+    r = _mm256_add_ps(r, _mm256_mul_ps(c1, y));
+    r = _mm256_add_ps(r, _mm256_mul_ps(c2, z));
+    store3(out + i * stride, _mm256_castps256_ps128(r));
+    store3(out + (i + 1) * stride, _mm256_extractf128_ps(r, 1));
+  }
+#endif
+
+  __m128 c0_4 = m.columns_[0].v_;
+  __m128 c1_4 = m.columns_[1].v_;
+  __m128 c2_4 = m.columns_[2].v_;
+  __m128 c3_4 = m.columns_[3].v_;
+  for (; i < count; i++) {
+    const float* p = in + i * stride;
+    __m128 r = _mm_add_ps(c3_4, _mm_mul_ps(c0_4, _mm_load1_ps(p)));
+    r = _mm_add_ps(r, _mm_mul_ps(c1_4, _mm_load1_ps(p + 1)));
+    r = _mm_add_ps(r, _mm_mul_ps(c2_4, _mm_load1_ps(p + 2)));
+    store3(out + i * stride, r);
+  }
+}
+
+#else
+
+static inline Vec4f cross(const Vec4f& u, const Vec4f& v) {
+  return Vec4f(u[1] * v[2] - u[2] * v[1], u[2] * v[0] - u[0] * v[2],
+               u[0] * v[1] - u[1] * v[0], 0.0f);
+}
+
+Mat4f Mat4f::Transpose() const {
+  const float* c = Begin();
+  return Mat4f(Vec4f(c[0], c[4], c[8], c[12]), Vec4f(c[1], c[5], c[9], c[13]),
+               Vec4f(c[2], c[6], c[10], c[14]),
+               Vec4f(c[3], c[7], c[11], c[15]));
+}
+
+Mat4f Mat4f::AffineInverse() const {
+  const Vec4f& a = columns_[0];
+  const Vec4f& b = columns_[1];
+  const Vec4f& c = columns_[2];
+  const Vec4f& t = columns_[3];
+
+  Vec4f r0 = cross(b, c);
+  Vec4f r1 = cross(c, a);
+  Vec4f r2 = cross(a, b);
+  float scale = 1.0f / (a[0] * r0[0] + a[1] * r0[1] + a[2] * r0[2]);
+  r0 = r0 * scale;
+  r1 = r1 * scale;
+  r2 = r2 * scale;
+
+  Vec4f u(-(r0[0] * t[0] + r0[1] * t[1] + r0[2] * t[2]),
+          -(r1[0] * t[0] + r1[1] * t[1] + r1[2] * t[2]),
+          -(r2[0] * t[0] + r2[1] * t[1] + r2[2] * t[2]), 1.0f);
+  return Mat4f(Vec4f(r0[0], r1[0], r2[0], 0.0f),
+               Vec4f(r0[1], r1[1], r2[1], 0.0f),
+               Vec4f(r0[2], r1[2], r2[2], 0.0f), u);
+}
+
+void TransformPoints(const Mat4f& m, const float* in, float* out,
+                     unsigned count, unsigned stride) {
+  for (unsigned i = 0; i < count; i++) {
+    const float* p = in + i * stride;
+    Vec4f r = m * Vec4f(p[0], p[1], p[2], 1.0f);
+    float* q = out + i * stride;
+    q[0] = r[0];
+    q[1] = r[1];
+    q[2] = r[2];
+  }
+}
+
+#endif
@@ -0,0 +1,254 @@
+#ifndef __SIMD_ALGEBRA_H__
+#define __SIMD_ALGEBRA_H__
+
+#include "Algebra.h"
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Single precision counterparts of Vector4D and Matrix4x4 for code that is
+// happy with float: a vector is one SSE register and a matrix is four of
+// them, so a product is a handful of instructions instead of the loops and
+// temporaries of the double precision types. Matrices are column major,
+// which is what GL takes and what makes M * v a sum of scaled columns.
+//
+// Nothing converts implicitly to or from the Algebra.h types.
+class Mat4f;
+
+class Vec4f {
+ public:
+  Vec4f();
+  Vec4f(float x, float y, float z, float w);
+  // Points get w = 1 and vectors w = 0.
+  explicit Vec4f(const Point3D& p);
+  explicit Vec4f(const Vector3D& v);
+  explicit Vec4f(const Vector4D& v);
+
+  float operator[](unsigned i) const;
+
+  Point3D ToPoint3D() const { return Point3D((*this)[0], (*this)[1], (*this)[2]); }
+  Vector3D ToVector3D() const { return Vector3D((*this)[0], (*this)[1], (*this)[2]); }
+  Vector4D ToVector4D() const {
+    return Vector4D((*this)[0], (*this)[1], (*this)[2], (*this)[3]); }
+
+  Vec4f operator+(const Vec4f& other) const;
+  Vec4f operator-(const Vec4f& other) const;
+  // Component by component.
+  Vec4f operator*(const Vec4f& other) const;
+  Vec4f operator*(float s) const;
+  // Over all four components.
+  float Dot(const Vec4f& other) const;
+
+ private:
+#if defined(__AVX__) || defined(__SSE2__)
+  explicit Vec4f(__m128 v) : v_(v) {}
+  __m128 v_;
+#else
+  float v_[4];
+#endif
+
+  friend class Mat4f;
+  friend Mat4f operator*(const Mat4f& a, const Mat4f& b);
+  friend Vec4f operator*(const Mat4f& m, const Vec4f& v);
+  friend void TransformPoints(const Mat4f& m, const float* in, float* out,
+                              unsigned count, unsigned stride);
+};
+
+class Mat4f {
+ public:
+  // The identity.
+  Mat4f();
+  Mat4f(const Vec4f& c0, const Vec4f& c1, const Vec4f& c2, const Vec4f& c3);
+  explicit Mat4f(const Matrix4x4& m);
+
+  Matrix4x4 ToMatrix4x4() const;
+
+  const Vec4f& GetColumn(unsigned i) const { return columns_[i]; }
+  // Sixteen floats in column major order, for glLoadMatrixf and friends.
+  const float* Begin() const { return (const float*)columns_; }
+
+  Mat4f Transpose() const;
+  // The inverse of a matrix whose bottom row is 0 0 0 1, which is anything
+  // built from rotations, scales and translations, from the cofactors of
+  // its upper 3x3 rather than by elimination. A singular matrix gives
+  // infinities.
+  Mat4f AffineInverse() const;
+
+ private:
+  Vec4f columns_[4];
+
+  friend Mat4f operator*(const Mat4f& a, const Mat4f& b);
+  friend Vec4f operator*(const Mat4f& m, const Vec4f& v);
+  friend void TransformPoints(const Mat4f& m, const float* in, float* out,
+                              unsigned count, unsigned stride);
+};
+
+Mat4f operator*(const Mat4f& a, const Mat4f& b);
+Vec4f operator*(const Mat4f& m, const Vec4f& v);
+
+// Transforms count points of three floats each, taking w as 1, from in to
+// out, which may be the same. Consecutive points start stride floats apart,
+// so this works straight on arrays of vertex structs.
+void TransformPoints(const Mat4f& m, const float* in, float* out,
+                     unsigned count, unsigned stride = 3);
+
+#if defined(__AVX__) || defined(__SSE2__)
+
+inline Vec4f::Vec4f() : v_(_mm_setzero_ps()) {}
+inline Vec4f::Vec4f(float x, float y, float z, float w)
+    : v_(_mm_set_ps(w, z, y, x)) {}
+inline Vec4f::Vec4f(const Point3D& p)
+    : v_(_mm_set_ps(1.0f, p[2], p[1], p[0])) {}
+inline Vec4f::Vec4f(const Vector3D& v)
+    : v_(_mm_set_ps(0.0f, v[2], v[1], v[0])) {}
+inline Vec4f::Vec4f(const Vector4D& v)
+    : v_(_mm_set_ps(v[3], v[2], v[1], v[0])) {}
+
+inline float Vec4f::operator[](unsigned i) const {
+  float out[4];
+  _mm_storeu_ps(out, v_);
+  return out[i];
+}
+
+inline Vec4f Vec4f::operator+(const Vec4f& other) const {
+  return Vec4f(_mm_add_ps(v_, other.v_));
+}
+inline Vec4f Vec4f::operator-(const Vec4f& other) const {
+  return Vec4f(_mm_sub_ps(v_, other.v_));
+}
+inline Vec4f Vec4f::operator*(const Vec4f& other) const {
+  return Vec4f(_mm_mul_ps(v_, other.v_));
+}
+inline Vec4f Vec4f::operator*(float s) const {
+  return Vec4f(_mm_mul_ps(v_, _mm_set1_ps(s)));
+}
+
+inline float Vec4f::Dot(const Vec4f& other) const {
+  __m128 p = _mm_mul_ps(v_, other.v_);
+  __m128 q = _mm_add_ps(p, _mm_movehl_ps(p, p));
+  return _mm_cvtss_f32(_mm_add_ss(q, _mm_shuffle_ps(q, q, 1)));
+}
+
+// Each column of the product is a's columns scaled by the elements of one
+// column of b. With AVX two columns of the product are worked out at once.
+inline Mat4f operator*(const Mat4f& a, const Mat4f& b) {
+  Mat4f out;
+#if defined(__AVX__)
+  __m256 a0 = _mm256_broadcast_ps(&a.columns_[0].v_);
+  __m256 a1 = _mm256_broadcast_ps(&a.columns_[1].v_);
+  __m256 a2 = _mm256_broadcast_ps(&a.columns_[2].v_);
+  __m256 a3 = _mm256_broadcast_ps(&a.columns_[3].v_);
+  for (unsigned j = 0; j < 4; j += 2) {
+    __m256 c = _mm256_loadu_ps((const float*)&b.columns_[j]);
+    __m256 r = _mm256_mul_ps(a0, _mm256_shuffle_ps(c, c, 0x00));
+    r = _mm256_add_ps(r, _mm256_mul_ps(a1, _mm256_shuffle_ps(c, c, 0x55)));
+    r = _mm256_add_ps(r, _mm256_mul_ps(a2, _mm256_shuffle_ps(c, c, 0xaa)));
+    r = _mm256_add_ps(r, _mm256_mul_ps(a3, _mm256_shuffle_ps(c, c, 0xff)));
+    _mm256_storeu_ps((float*)&out.columns_[j], r);
+  }
+#else
+  for (unsigned j = 0; j < 4; j++) {
+    __m128 c = b.columns_[j].v_;
+    __m128 r = _mm_mul_ps(a.columns_[0].v_, _mm_shuffle_ps(c, c, 0x00));
+    r = _mm_add_ps(r, _mm_mul_ps(a.columns_[1].v_, _mm_shuffle_ps(c, c, 0x55)));
+    r = _mm_add_ps(r, _mm_mul_ps(a.columns_[2].v_, _mm_shuffle_ps(c, c, 0xaa)));
+    r = _mm_add_ps(r, _mm_mul_ps(a.columns_[3].v_, _mm_shuffle_ps(c, c, 0xff)));
+    out.columns_[j].v_ = r;
+  }
+#endif
+  return out;
+}
+
+inline Vec4f operator*(const Mat4f& m, const Vec4f& v) {
+  __m128 c = v.v_;
+  __m128 r = _mm_mul_ps(m.columns_[0].v_, _mm_shuffle_ps(c, c, 0x00));
+  r = _mm_add_ps(r, _mm_mul_ps(m.columns_[1].v_, _mm_shuffle_ps(c, c, 0x55)));
+  r = _mm_add_ps(r, _mm_mul_ps(m.columns_[2].v_, _mm_shuffle_ps(c, c, 0xaa)));
+  r = _mm_add_ps(r, _mm_mul_ps(m.columns_[3].v_, _mm_shuffle_ps(c, c, 0xff)));
+  return Vec4f(r);
+}
+
+#else
+
+inline Vec4f::Vec4f() {
+  v_[0] = v_[1] = v_[2] = v_[3] = 0.0f;
+}
+inline Vec4f::Vec4f(float x, float y, float z, float w) {
+  v_[0] = x;
+  v_[1] = y;
+  v_[2] = z;
+  v_[3] = w;
+}
+inline Vec4f::Vec4f(const Point3D& p) {
+  v_[0] = p[0];
+  v_[1] = p[1];
+  v_[2] = p[2];
+  v_[3] = 1.0f;
+}
+inline Vec4f::Vec4f(const Vector3D& v) {
+  v_[0] = v[0];
+  v_[1] = v[1];
+  v_[2] = v[2];
+  v_[3] = 0.0f;
+}
+inline Vec4f::Vec4f(const Vector4D& v) {
+  v_[0] = v[0];
+  v_[1] = v[1];
+  v_[2] = v[2];
+  v_[3] = v[3];
+}
+
+inline float Vec4f::operator[](unsigned i) const { return v_[i]; }
+
+inline Vec4f Vec4f::operator+(const Vec4f& o) const {
+  return Vec4f(v_[0] + o.v_[0], v_[1] + o.v_[1], v_[2] + o.v_[2],
+               v_[3] + o.v_[3]);
+}
+inline Vec4f Vec4f::operator-(const Vec4f& o) const {
+  return Vec4f(v_[0] - o.v_[0], v_[1] - o.v_[1], v_[2] - o.v_[2],
+               v_[3] - o.v_[3]);
+}
+inline Vec4f Vec4f::operator*(const Vec4f& o) const {
+  return Vec4f(v_[0] * o.v_[0], v_[1] * o.v_[1], v_[2] * o.v_[2],
+               v_[3] * o.v_[3]);
+}
+inline Vec4f Vec4f::operator*(float s) const {
+  return Vec4f(v_[0] * s, v_[1] * s, v_[2] * s, v_[3] * s);
+}
+
+inline float Vec4f::Dot(const Vec4f& o) const {
+  return v_[0] * o.v_[0] + v_[1] * o.v_[1] + v_[2] * o.v_[2] +
+         v_[3] * o.v_[3];
+}
+
+inline Vec4f operator*(const Mat4f& m, const Vec4f& v) {
+  return m.columns_[0] * v.v_[0] + m.columns_[1] * v.v_[1] +
+         m.columns_[2] * v.v_[2] + m.columns_[3] * v.v_[3];
+}
+
+inline Mat4f operator*(const Mat4f& a, const Mat4f& b) {
+  return Mat4f(a * b.columns_[0], a * b.columns_[1], a * b.columns_[2],
+               a * b.columns_[3]);
+}
+
+#endif
+
+inline Mat4f::Mat4f() {
+  columns_[0] = Vec4f(1.0f, 0.0f, 0.0f, 0.0f);
+  columns_[1] = Vec4f(0.0f, 1.0f, 0.0f, 0.0f);
+  columns_[2] = Vec4f(0.0f, 0.0f, 1.0f, 0.0f);
+  columns_[3] = Vec4f(0.0f, 0.0f, 0.0f, 1.0f);
+}
+
+inline Mat4f::Mat4f(const Vec4f& c0, const Vec4f& c1, const Vec4f& c2,
+                    const Vec4f& c3) {
+  columns_[0] = c0;
+  columns_[1] = c1;
+  columns_[2] = c2;
+  columns_[3] = c3;
+}
+
+#endif
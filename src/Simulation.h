@@ -0,0 +1,41 @@
+#ifndef __SIMULATION_H__
+#define __SIMULATION_H__
+
+// Something in the scene that changes over time, stepped at a fixed rate by a
+// Scheduler, usually on a thread of its own.
+//
+// Step() and TakeSnapshot() run on the scheduler's thread and may only touch
+// the simulation's own state. Present() runs on the thread that draws and is
+// the only place the scene's nodes and primitives are changed, so the two
+// never have to share anything but snapshots.
+class Simulation {
+ public:
+  // What the renderer needs of the state after one step. Never changed once
+  // taken, so the renderer can read it while the next step runs.
+  class Snapshot {
+   public:
+    Snapshot() : references_(0) {}
+    virtual ~Snapshot() {}
+
+   private:
+    Snapshot(const Snapshot&);
+    Snapshot& operator=(const Snapshot&);
+
+    // Guarded by the scheduler that published it.
+    unsigned references_;
+    friend class Scheduler;
+  };
+
+  virtual ~Simulation() {}
+
+  // Advances one tick.
+  virtual void Step() = 0;
+  virtual Snapshot* TakeSnapshot() const = 0;
+
+  // Shows the state alpha of the way from previous to current, two snapshots
+  // this simulation took one tick apart. They may be the same one.
+  virtual void Present(const Snapshot& previous, const Snapshot& current,
+                       double alpha) = 0;
+};
+
+#endif
@@ -0,0 +1,115 @@
+#include "SpatialGrid.h"
+
+#include <algorithm>
+#include <cmath>
+
+using std::make_pair;
+using std::pair;
+using std::max;
+using std::vector;
+
+SpatialGrid::SpatialGrid()
+    : scale_(1.0)
+    , mask_(0) {}
+
+int SpatialGrid::Cell(double x) const {
+  return (int)floor(x * scale_);
+}
+
+unsigned SpatialGrid::Bucket(int x, int y, int z) const {
+  // Cells next to each other along x go in consecutive buckets, so a query
+  // reads whole rows of cells at once.
+  return (((unsigned)y * 73856093u ^ (unsigned)z * 19349663u) + (unsigned)x) &
+         mask_;
+}
+
+void SpatialGrid::Build(const double* x, const double* y, const double* z,
+                        unsigned count, double cell_size) {
+  scale_ = cell_size > 0.0 ? 1.0 / cell_size : 1.0;
+
+  // Around two buckets per point keeps collisions rare.
+  unsigned buckets = 1;
+  while (buckets < 4 * count) {
+    buckets *= 2;
+  }
+  mask_ = buckets - 1;
+
+  starts_.assign(buckets + 1, 0);
+  buckets_.resize(count);
+  for (unsigned k = 0; k < count; k++) {
+    buckets_[k] = Bucket(Cell(x[k]), Cell(y[k]), Cell(z[k]));
+    starts_[buckets_[k] + 1]++;
+  }
+
+  for (unsigned b = 0; b < buckets; b++) {
+    starts_[b + 1] += starts_[b];
+  }
+
+  // Filling in index order leaves every bucket sorted.
+  items_.resize(count);
+  vector<unsigned> fill(starts_.begin(), starts_.end() - 1);
+  for (unsigned k = 0; k < count; k++) {
+    items_[fill[buckets_[k]]++] = k;
+  }
+}
+
+void SpatialGrid::Query(double x, double y, double z, double radius,
+                        vector<pair<unsigned, unsigned> >& ranges) const {
+  ranges.clear();
+  if (items_.empty()) {
+    return;
+  }
+
+  int x0 = Cell(x - radius);
+  int x1 = Cell(x + radius);
+  int y0 = Cell(y - radius);
+  int y1 = Cell(y + radius);
+  int z0 = Cell(z - radius);
+  int z1 = Cell(z + radius);
+
+  unsigned buckets = mask_ + 1;
+  unsigned row = x1 - x0 + 1;
+  if (row >= buckets) {
+    ranges.push_back(make_pair(0u, (unsigned)items_.size()));
+    return;
+  }
+
+  for (int j = y0; j <= y1; j++) {
+    for (int k = z0; k <= z1; k++) {
+      unsigned begin = Bucket(x0, j, k);
+      unsigned end = begin + row;
+      if (end > buckets) {
+        ranges.push_back(make_pair(starts_[begin], starts_[buckets]));
+        begin = 0;
+        end -= buckets;
+      }
+      if (starts_[begin] != starts_[end]) {
+        ranges.push_back(make_pair(starts_[begin], starts_[end]));
+      }
+    }
+  }
+
+  if (ranges.empty()) {
+    return;
+  }
+
+  // Several cells can hash to the same bucket, and neighbouring buckets
+  // make one longer run. There are only a handful of ranges to sort.
+  for (unsigned r = 1; r < ranges.size(); r++) {
+    pair<unsigned, unsigned> range = ranges[r];
+    unsigned k = r;
+    for (; k > 0 && range < ranges[k - 1]; k--) {
+      ranges[k] = ranges[k - 1];
+    }
+    ranges[k] = range;
+  }
+  unsigned merged = 0;
+  for (unsigned r = 1; r < ranges.size(); r++) {
+    if (ranges[r].first <= ranges[merged].second) {
+      ranges[merged].second = max(ranges[merged].second, ranges[r].second);
+    } else {
+      ranges[++merged] = ranges[r];
+    }
+  }
+  ranges.resize(merged + 1);
+}
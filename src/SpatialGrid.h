@@ -0,0 +1,41 @@
+#ifndef __SPATIAL_GRID_H__
+#define __SPATIAL_GRID_H__
+
+#include <utility>
+#include <vector>
+
+// Uniform grid over a set of points, hashed into a fixed number of buckets
+// so it works however far apart the points are. Build() is a counting sort,
+// cheap enough to redo every step.
+class SpatialGrid {
+ public:
+  SpatialGrid();
+
+  // Points are given as separate coordinate arrays. cell_size should be
+  // about the largest radius that will be queried.
+  void Build(const double* x, const double* y, const double* z,
+             unsigned count, double cell_size);
+
+  // The point indices sorted by bucket. Points in the same bucket are
+  // contiguous and in index order.
+  const std::vector<unsigned>& GetOrder() const { return items_; }
+
+  // Fills ranges with [begin, end) spans of GetOrder() that together hold
+  // every point within radius of (x, y, z). They may also hold points that
+  // are further away, so callers still test the exact distance.
+  void Query(double x, double y, double z, double radius,
+             std::vector<std::pair<unsigned, unsigned> >& ranges) const;
+
+ private:
+  int Cell(double x) const;
+  unsigned Bucket(int x, int y, int z) const;
+
+  double scale_;  // cells per unit
+  unsigned mask_;
+  // Points in bucket b are items_[starts_[b] .. starts_[b + 1]).
+  std::vector<unsigned> starts_;
+  std::vector<unsigned> items_;
+  std::vector<unsigned> buckets_;
+};
+
+#endif
@@ -1,22 +1,56 @@
 #include "Terrain.h"
 
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
 #include <fstream>
 #include <GL/gl.h>
 #include <GL/glu.h>
-#include <limits>
-#include <utility>
-#include <vector>
-
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "ChunkedTerrain.h"
 #include "Node.h"
+#include "Weathering.h"
 
 using std::ifstream;
 using std::ios_base;
 using std::istream;
-using std::numeric_limits;
+using std::max;
+using std::min;
 using std::ofstream;
-using std::pair;
 using std::string;
-using std::vector;
+
+// v2 .hm files start with this header, followed by padding up to
+// data_offset_ and then width * length samples in sample_format_.
+struct HeightMapHeader {
+  char magic_[4];
+  uint32_t version_;
+  // Written as kEndianMarker in the writer's byte order.
+  uint32_t endian_;
+  uint32_t sample_format_;
+  uint32_t width_;
+  uint32_t length_;
+  double talus_;
+  uint64_t data_offset_;
+};
+
+static const char kMagic[4] = {'H', 'M', 'A', 'P'};
+static const uint32_t kVersion = 2;
+static const uint32_t kEndianMarker = 0x01020304;
+static const uint32_t kSwappedEndianMarker = 0x04030201;
+// Samples start on a page boundary so they can be mapped in place.
+static const uint64_t kDataAlignment = 4096;
 
 namespace Terrain {
 
@@ -60,88 +94,27 @@ void CreateMountain(string file_name) {
 }
 
 HeightMap* GenerateTerrain(string name, bool weather) {
-  ifstream map_stream(name.c_str());
-
   HeightMap* height_map = new HeightMap();
-  map_stream >> *height_map;
-
-  if (weather) {
-    ThermalWeathering(height_map, 500);
+  if (!height_map->Load(name, HeightMap::COPY_ON_WRITE)) {
+    std::cerr << "Error loading height map " << name << std::endl;
+    exit(-1);
   }
 
+  // The texture decodes in the background while the map weathers.
   Node* node = new Node(name);
   node->AddChild(Node::CreateHeightMapNode(name, height_map, "data/img/terrain.jpg"));
   height_map->SetNode(node);
+
+  if (weather) {
+    ThermalWeathering(height_map, 500);
+  }
   return height_map;
 }
 
 void ThermalWeathering(HeightMap* height_map, unsigned iterations) {
-  HeightMap h1;
-  HeightMap h2;
-
-  static int neighbours[][2] = {
-    {-1, -1},
-    {-1, 0},
-    {-1, 1},
-    {0, -1},
-    {0, 1},
-    {1, -1},
-    {1, 0},
-    {1, 1}
-  };
-
-  h2 = *height_map;
-
-  for (unsigned t = 0; t < iterations; t++) {
-    h1 = h2;
-    double total = 0.0;
-    for (int i = 0; (unsigned)i < h1.GetWidth(); i++) {
-      for (int j = 0; (unsigned)j < h1.GetLength(); j++) {
-        double total_diff = 0.0;
-        double min_diff = numeric_limits<double>::infinity();
-        vector<pair<unsigned, double> > neighbour_list;
-
-        for (unsigned n = 0; n < 8; n++) {
-          int ni = i + neighbours[n][0];
-          int nj = j + neighbours[n][1];
-          if (ni < 0 || (unsigned)ni >= h1.GetWidth() || nj < 0 ||
-              (unsigned)nj >= h1.GetLength()) {
-            continue;
-          }
-
-          double diff = h1[i][j] - h1[ni][nj];
-
-          if (diff > h1.GetTalus()) {
-            neighbour_list.push_back(pair<unsigned, double>(n, diff));
-            total_diff += diff;
-            if (diff < min_diff) {
-              min_diff = diff;
-            }
-          }
-        }
-        
-        unsigned count = neighbour_list.size();
-        double redistribute;
-        if (count > 0) {
-          redistribute = ((double)count / (count + 1)) * min_diff;
-          total += redistribute;
-          h2[i][j] -= redistribute;
-        }
-
-        for (unsigned k = 0; k < count; k++) {
-          unsigned n = neighbour_list[k].first;
-          double diff = neighbour_list[k].second;
-
-          int ni = i + neighbours[n][0];
-          int nj = j + neighbours[n][1];
-          h2[ni][nj] += (diff / total_diff) * redistribute;
-        }
-      }
-    }
-  }
-
-  *height_map = h2;
-  height_map->ComputeNormals();
+  WeatheringEngine engine(*height_map);
+  engine.Step(iterations);
+  engine.CopyTo(*height_map);
 }
 
 }
@@ -152,53 +125,93 @@ HeightMap::HeightMap()
     , width_(0)
     , length_(0)
     , map_(0)
-    , normals_(0)
-    , talus_(0) {}
+    , talus_(0)
+    , mapping_(0)
+    , mapping_size_(0)
+    , read_only_(false)
+    , chunks_(0) {}
 
 HeightMap::HeightMap(unsigned width, unsigned length, double height, bool texture)
     : node_(0)
     , texture_(texture)
     , width_(width)
     , length_(length)
-    , talus_(0) {
+    , talus_(0)
+    , mapping_(0)
+    , mapping_size_(0)
+    , read_only_(false)
+    , chunks_(0) {
   map_ = new double[width_ * length_];
-  normals_ = new Vector3D[width_ * length_];
 
   for (unsigned i = 0; i < width_ * length_; i++) {
     map_[i] = height;
   }
 
-  ComputeNormals();
+  ResetNormals();
 }
 
 HeightMap::~HeightMap() {
-  delete[] map_;
-  delete[] normals_;
+  Release();
 }
 
-HeightMap::HeightMap(const HeightMap& other) {
-  if (this == &other) {
-    return;
+void HeightMap::Release() {
+  if (mapping_) {
+    munmap(mapping_, mapping_size_);
+    mapping_ = 0;
+    mapping_size_ = 0;
+  } else {
+    delete[] map_;
   }
+  for (unsigned i = 0; i < normals_.size(); i++) {
+    delete[] normals_[i];
+  }
+  normals_.clear();
+  delete chunks_;
 
-  node_ = other.node_;
+  map_ = 0;
+  read_only_ = false;
+  chunks_ = 0;
+}
 
-  width_ = other.width_;
-  length_ = other.length_;
-  talus_ = other.talus_;
-  texture_ = other.texture_;
+void HeightMap::ResetNormals() {
+  for (unsigned i = 0; i < normals_.size(); i++) {
+    delete[] normals_[i];
+  }
+  normals_.assign((width_ + kNormalRows - 1) / kNormalRows, (Vector3D*)0);
+}
 
-  delete[] map_;
-  delete[] normals_;
+void HeightMap::MakeWritable() {
+  // A private mapping can be made writable even though the file was opened
+  // read only. Failing that, fall back to a copy on the heap.
+  if (mprotect(mapping_, mapping_size_, PROT_READ | PROT_WRITE) < 0) {
+    size_t cells = (size_t)width_ * length_;
+    double* map = new double[cells];
+    memcpy(map, map_, cells * sizeof(double));
+    munmap(mapping_, mapping_size_);
+    mapping_ = 0;
+    mapping_size_ = 0;
+    map_ = map;
+  }
+  read_only_ = false;
+}
+
+HeightMap::HeightMap(const HeightMap& other)
+    : node_(other.node_)
+    , texture_(other.texture_)
+    , width_(other.width_)
+    , length_(other.length_)
+    , talus_(other.talus_)
+    , mapping_(0)
+    , mapping_size_(0)
+    , read_only_(false)
+    , chunks_(0) {
   map_ = new double[width_ * length_];
-  normals_ = new Vector3D[width_ * length_];
 
   for (unsigned i = 0; i < width_ * length_; i++) {
     map_[i] = other.map_[i];
-    normals_[i] = other.normals_[i];
   }
 
-  return;
+  ResetNormals();
 }
 
 HeightMap& HeightMap::operator=(const HeightMap& other) {
@@ -213,117 +226,435 @@ HeightMap& HeightMap::operator=(const HeightMap& other) {
   talus_ = other.talus_;
   texture_ = other.texture_;
 
-  delete[] map_;
-  delete[] normals_;
+  Release();
   map_ = new double[width_ * length_];
-  normals_ = new Vector3D[width_ * length_];
 
   for (unsigned i = 0; i < width_ * length_; i++) {
     map_[i] = other.map_[i];
-    normals_[i] = other.normals_[i];
   }
 
+  ResetNormals();
+
   return *this;
 }
 
-Colour getColour(double height) {
-  // 0..100
-  double c = height / 100.0 + 0.5;
-  return Colour(c, c, c);
+void HeightMap::Render() const {
+  if (width_ < 2 || length_ < 2) {
+    return;
+  }
+
+  if (!chunks_) {
+    chunks_ = new ChunkedTerrain(*this);
+  }
+  chunks_->Render();
 }
 
-void HeightMap::Render() const {
-  glFrontFace(GL_CW);
-  glBegin(GL_QUADS);
-  Colour c(0.0);
-  double value;
-  for (unsigned i = 0; i < width_ - 1; i++) {
-    for (unsigned j = 0; j < length_ - 1; j++) {
-      value = (*this)[i][j];
-      if (texture_) {
-        c = getColour(value);
-        glColorMaterial(GL_FRONT_AND_BACK, GL_DIFFUSE);
-        glColor3d(c.R(), c.G(), c.B());
-        glTexCoord2f(0.0, 0.0);
-      }
-      Vector3D normal = GetNormal(i, j);
-      glNormal3d(normal[0], normal[1], normal[2]);
-      glVertex3d(i, value, j);
-
-      value = (*this)[i + 1][j];
-      if (texture_) {
-        c = getColour(value);
-        glColorMaterial(GL_FRONT_AND_BACK, GL_DIFFUSE);
-        glColor3d(c.R(), c.G(), c.B());
-        glTexCoord2f(1.0, 0.0);
-      }
-      normal = GetNormal(i, j);
-      glNormal3d(normal[0], normal[1], normal[2]);
-      glVertex3d(i + 1, value, j);
-
-      value = (*this)[i + 1][j + 1];
-      if (texture_) {
-        c = getColour(value);
-        glColorMaterial(GL_FRONT_AND_BACK, GL_DIFFUSE);
-        glColor3d(c.R(), c.G(), c.B());
-        glTexCoord2f(0.0, 1.0);
-      }
-      normal = GetNormal(i, j);
-      glNormal3d(normal[0], normal[1], normal[2]);
-      glVertex3d(i + 1, value, j + 1);
-
-      value = (*this)[i][j + 1];
-      if (texture_) {
-        c = getColour(value);
-        glColorMaterial(GL_FRONT_AND_BACK, GL_DIFFUSE);
-        glColor3d(c.R(), c.G(), c.B());
-        glTexCoord2f(1.0, 1.0);
+// Normals of cells j0..j1 of a row from central differences, with cells off
+// the edge of the map counting as height 0. up and down are the neighbouring
+// rows, or NULL on the first and last rows.
+static void normalRow(const double* up, const double* row, const double* down,
+                      unsigned length, double ny, unsigned j0, unsigned j1,
+                      Vector3D* normals) {
+  unsigned j = j0;
+
+#if defined(__AVX__) || defined(__SSE2__)
+  if (up && down) {
+    // Whole vectors of interior cells at once, leaving the first and last
+    // columns to the scalar loop.
+    unsigned begin = j0 > 0 ? j0 : 1;
+    unsigned end = j1 + 1 < length ? j1 + 1 : length - 1;
+
+    for (; j < begin && j <= j1; j++) {
+      double nx = down[j] - up[j];
+      double nz = (j + 1 < length ? row[j + 1] : 0.0) - (j > 0 ? row[j - 1] : 0.0);
+      double scale = 1.0 / sqrt(nx * nx + ny * ny + nz * nz);
+      normals[j] = Vector3D(nx * scale, ny * scale, nz * scale);
+    }
+
+#if defined(__AVX__)
+    const unsigned kLanes = 4;
+    __m256d y = _mm256_set1_pd(ny);
+    __m256d y2 = _mm256_mul_pd(y, y);
+    __m256d one = _mm256_set1_pd(1.0);
+    double x_out[kLanes] __attribute__((aligned(32)));
+    double y_out[kLanes] __attribute__((aligned(32)));
+    double z_out[kLanes] __attribute__((aligned(32)));
+
+    for (; j + kLanes <= end; j += kLanes) {
+      __m256d x = _mm256_sub_pd(_mm256_loadu_pd(down + j),
+                                _mm256_loadu_pd(up + j));
+      __m256d z = _mm256_sub_pd(_mm256_loadu_pd(row + j + 1),
+                                _mm256_loadu_pd(row + j - 1));
+      __m256d length2 = _mm256_add_pd(
+          _mm256_add_pd(_mm256_mul_pd(x, x), _mm256_mul_pd(z, z)), y2);
+      __m256d scale = _mm256_div_pd(one, _mm256_sqrt_pd(length2));
+      _mm256_store_pd(x_out, _mm256_mul_pd(x, scale));
+      _mm256_store_pd(y_out, _mm256_mul_pd(y, scale));
+      _mm256_store_pd(z_out, _mm256_mul_pd(z, scale));
+#else
+    const unsigned kLanes = 2;
+    __m128d y = _mm_set1_pd(ny);
+    __m128d y2 = _mm_mul_pd(y, y);
+    __m128d one = _mm_set1_pd(1.0);
+    double x_out[kLanes] __attribute__((aligned(16)));
+    double y_out[kLanes] __attribute__((aligned(16)));
+    double z_out[kLanes] __attribute__((aligned(16)));
+
+    for (; j + kLanes <= end; j += kLanes) {
+      __m128d x = _mm_sub_pd(_mm_loadu_pd(down + j), _mm_loadu_pd(up + j));
+      __m128d z = _mm_sub_pd(_mm_loadu_pd(row + j + 1),
+                             _mm_loadu_pd(row + j - 1));
+      __m128d length2 = _mm_add_pd(
+          _mm_add_pd(_mm_mul_pd(x, x), _mm_mul_pd(z, z)), y2);
+      __m128d scale = _mm_div_pd(one, _mm_sqrt_pd(length2));
+      _mm_store_pd(x_out, _mm_mul_pd(x, scale));
+      _mm_store_pd(y_out, _mm_mul_pd(y, scale));
+      _mm_store_pd(z_out, _mm_mul_pd(z, scale));
+#endif
+
+      for (unsigned k = 0; k < kLanes; k++) {
+        normals[j + k] = Vector3D(x_out[k], y_out[k], z_out[k]);
       }
-      normal = GetNormal(i, j);
-      glNormal3d(normal[0], normal[1], normal[2]);
-      glVertex3d(i, value, j + 1);
     }
   }
-  glEnd();
+#endif
+
+  for (; j <= j1; j++) {
+    double a = up ? up[j] : 0.0;
+    double c = down ? down[j] : 0.0;
+    double d = j > 0 ? row[j - 1] : 0.0;
+    double b = j + 1 < length ? row[j + 1] : 0.0;
+
+    double nx = c - a;
+    double nz = b - d;
+    double scale = 1.0 / sqrt(nx * nx + ny * ny + nz * nz);
+    normals[j] = Vector3D(nx * scale, ny * scale, nz * scale);
+  }
+}
+
+void HeightMap::ComputeNormals() {
+  for (unsigned band = 0; band < normals_.size(); band++) {
+    if (!normals_[band]) {
+      ComputeNormalBand(band);
+    } else {
+      unsigned i0 = band * kNormalRows;
+      unsigned i1 = min(i0 + kNormalRows, width_) - 1;
+      ComputeNormalRows(i0, 0, i1, length_ - 1);
+    }
+  }
 }
 
-Vector3D& HeightMap::GetNormal(unsigned i, unsigned j) const {
-  return (normals_ + i * width_)[j];
+void HeightMap::ComputeNormals(unsigned i0, unsigned j0, unsigned i1,
+                               unsigned j1) {
+  if (width_ == 0 || length_ == 0) {
+    return;
+  }
+
+  i0 = i0 > 0 ? i0 - 1 : 0;
+  j0 = j0 > 0 ? j0 - 1 : 0;
+  i1 = i1 + 1 < width_ ? i1 + 1 : width_ - 1;
+  j1 = j1 + 1 < length_ ? j1 + 1 : length_ - 1;
+  ComputeNormalRows(i0, j0, i1, j1);
 }
 
-void HeightMap::ComputeNormals() {
+const Vector3D* HeightMap::ComputeNormalBand(unsigned band) const {
+  normals_[band] = new Vector3D[kNormalRows * length_];
+
+  unsigned i0 = band * kNormalRows;
+  unsigned i1 = min(i0 + kNormalRows, width_) - 1;
+  ComputeNormalRows(i0, 0, i1, length_ - 1);
+  return normals_[band];
+}
+
+void HeightMap::ComputeNormalRows(unsigned i0, unsigned j0, unsigned i1,
+                                  unsigned j1) const {
+  // The y component is constant, so it never degenerates to a zero vector.
+  double ny = -200.0 * (1.0 / width_ + 1.0 / length_);
+  for (unsigned i = i0; i <= i1; i++) {
+    Vector3D* band = normals_[i / kNormalRows];
+    if (!band) {
+      continue;
+    }
+
+    const double* up = i > 0 ? (*this)[i - 1] : NULL;
+    const double* down = i + 1 < width_ ? (*this)[i + 1] : NULL;
+    normalRow(up, (*this)[i], down, length_, ny, j0, j1,
+              band + (i % kNormalRows) * length_);
+  }
+}
+
+void HeightMap::Invalidate() {
+  if (chunks_) {
+    chunks_->Invalidate();
+  }
+}
+
+void HeightMap::Invalidate(unsigned i0, unsigned j0, unsigned i1,
+                           unsigned j1) {
+  if (chunks_) {
+    chunks_->Invalidate(i0, j0, i1, j1);
+  }
+}
+
+void HeightMap::SetHeights(const double* heights) {
+  unsigned i0 = width_;
+  unsigned j0 = length_;
+  unsigned i1 = 0;
+  unsigned j1 = 0;
   for (unsigned i = 0; i < width_; i++) {
+    double* row = map_ + i * length_;
+    const double* source = heights + i * length_;
     for (unsigned j = 0; j < length_; j++) {
-      double a = 0;
-      double b = 0;
-      double c = 0;
-      double d = 0;
-
-      if (i > 0) {
-        a = (*this)[i - 1][j];
+      if (row[j] != source[j]) {
+        // A READ_ONLY map stays so until something actually changes.
+        if (read_only_) {
+          MakeWritable();
+          row = map_ + i * length_;
+        }
+        row[j] = source[j];
+        i0 = min(i0, i);
+        i1 = max(i1, i);
+        j0 = min(j0, j);
+        j1 = max(j1, j);
       }
+    }
+  }
 
-      if (i < width_ - 1) {
-        c = (*this)[i + 1][j];
-      }
+  if (i0 <= i1) {
+    ComputeNormals(i0, j0, i1, j1);
+    Invalidate(i0, j0, i1, j1);
+  }
+}
 
-      if (j > 0) {
-        d = (*this)[i][j - 1];
+static float halfToFloat(uint16_t half) {
+  uint32_t sign = (uint32_t)(half & 0x8000) << 16;
+  uint32_t exponent = (half >> 10) & 0x1f;
+  uint32_t mantissa = half & 0x3ff;
+  uint32_t bits;
+
+  if (exponent == 0) {
+    if (mantissa == 0) {
+      bits = sign;
+    } else {
+      // Subnormal, renormalize it for float.
+      exponent = 127 - 15 + 1;
+      while (!(mantissa & 0x400)) {
+        mantissa <<= 1;
+        exponent--;
       }
+      bits = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+    }
+  } else if (exponent == 31) {
+    bits = sign | 0x7f800000 | (mantissa << 13);
+  } else {
+    bits = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+  }
+
+  float value;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+static uint16_t floatToHalf(float value) {
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+
+  uint16_t sign = (bits >> 16) & 0x8000;
+  int exponent = (int)((bits >> 23) & 0xff) - 127 + 15;
+  uint32_t mantissa = bits & 0x7fffff;
+
+  if (((bits >> 23) & 0xff) == 0xff) {
+    return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+  }
+
+  if (exponent >= 31) {
+    return sign | 0x7c00;
+  }
+
+  if (exponent <= 0) {
+    if (exponent < -10) {
+      return sign;
+    }
+
+    mantissa |= 0x800000;
+    unsigned shift = 14 - exponent;
+    uint16_t half = mantissa >> shift;
+    if ((mantissa >> (shift - 1)) & 1) {
+      half++;
+    }
+    return sign | half;
+  }
+
+  // Rounding may carry into the exponent, which is still the right answer.
+  uint16_t half = sign | (exponent << 10) | (mantissa >> 13);
+  if (mantissa & 0x1000) {
+    half++;
+  }
+  return half;
+}
+
+static uint32_t swap32(uint32_t value) {
+  return (value >> 24) | ((value >> 8) & 0xff00) | ((value << 8) & 0xff0000) |
+      (value << 24);
+}
+
+static uint64_t swap64(uint64_t value) {
+  return ((uint64_t)swap32(value) << 32) | swap32(value >> 32);
+}
+
+static size_t sampleSize(uint32_t format) {
+  switch (format) {
+    case HeightMap::FLOAT16:
+      return 2;
+    case HeightMap::FLOAT32:
+      return 4;
+    case HeightMap::FLOAT64:
+      return 8;
+    default:
+      return 0;
+  }
+}
+
+bool HeightMap::Load(const string& file_name, MapMode mode) {
+  int fd = open(file_name.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+
+  struct stat info;
+  HeightMapHeader header;
+  if (fstat(fd, &info) < 0 || (size_t)info.st_size < sizeof(header) ||
+      pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+      memcmp(header.magic_, kMagic, sizeof(kMagic)) != 0) {
+    // Not a v2 file, so it must be the original format.
+    close(fd);
+    ifstream stream(file_name.c_str(), ios_base::in | ios_base::binary);
+    stream >> *this;
+    return !stream.fail();
+  }
+
+  bool swapped = header.endian_ == kSwappedEndianMarker;
+  if (swapped) {
+    header.version_ = swap32(header.version_);
+    header.sample_format_ = swap32(header.sample_format_);
+    header.width_ = swap32(header.width_);
+    header.length_ = swap32(header.length_);
+    header.data_offset_ = swap64(header.data_offset_);
+
+    uint64_t talus;
+    memcpy(&talus, &header.talus_, sizeof(talus));
+    talus = swap64(talus);
+    memcpy(&header.talus_, &talus, sizeof(talus));
+  }
+
+  size_t size = info.st_size;
+  size_t cells = (size_t)header.width_ * header.length_;
+  size_t sample_size = sampleSize(header.sample_format_);
+  if ((!swapped && header.endian_ != kEndianMarker) ||
+      header.version_ != kVersion || sample_size == 0 ||
+      header.data_offset_ > size ||
+      cells > (size - header.data_offset_) / sample_size) {
+    close(fd);
+    return false;
+  }
+
+  int protection = PROT_READ;
+  if (mode == COPY_ON_WRITE) {
+    protection |= PROT_WRITE;
+  }
 
-      if (j < length_ - 1) {
-        b = (*this)[i][j + 1];
+  void* mapping = mmap(0, size, protection, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    return false;
+  }
+
+  Release();
+  width_ = header.width_;
+  length_ = header.length_;
+  talus_ = header.talus_;
+
+  const char* data = (const char*)mapping + header.data_offset_;
+  if (header.sample_format_ == FLOAT64 && !swapped &&
+      header.data_offset_ % sizeof(double) == 0) {
+    // Same layout as in memory, so use the pages directly.
+    mapping_ = mapping;
+    mapping_size_ = size;
+    map_ = (double*)data;
+    read_only_ = mode == READ_ONLY;
+  } else {
+    map_ = new double[cells];
+    for (size_t i = 0; i < cells; i++) {
+      if (header.sample_format_ == FLOAT16) {
+        uint16_t half;
+        memcpy(&half, data + i * 2, sizeof(half));
+        if (swapped) {
+          half = (half >> 8) | (half << 8);
+        }
+        map_[i] = halfToFloat(half);
+      } else if (header.sample_format_ == FLOAT32) {
+        uint32_t bits;
+        memcpy(&bits, data + i * 4, sizeof(bits));
+        if (swapped) {
+          bits = swap32(bits);
+        }
+        float value;
+        memcpy(&value, &bits, sizeof(value));
+        map_[i] = value;
+      } else {
+        uint64_t bits;
+        memcpy(&bits, data + i * 8, sizeof(bits));
+        if (swapped) {
+          bits = swap64(bits);
+        }
+        memcpy(&map_[i], &bits, sizeof(double));
       }
-      
-      Vector3D& N = GetNormal(i, j);
-      N[0] = c - a;
-      N[2] = b - d;
-      N[1] = -200.0 * (1.0 / width_ + 1.0 / length_);
+    }
+    munmap(mapping, size);
+  }
+
+  ResetNormals();
 
-      N.Normalize();
+  return true;
+}
+
+bool HeightMap::Save(const string& file_name, SampleFormat format) const {
+  ofstream file(file_name.c_str(), ios_base::out | ios_base::binary);
+  if (!file) {
+    return false;
+  }
+
+  HeightMapHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic_, kMagic, sizeof(kMagic));
+  header.version_ = kVersion;
+  header.endian_ = kEndianMarker;
+  header.sample_format_ = format;
+  header.width_ = width_;
+  header.length_ = length_;
+  header.talus_ = talus_;
+  header.data_offset_ = kDataAlignment;
+  file.write((const char*)&header, sizeof(header));
+
+  char padding[kDataAlignment - sizeof(HeightMapHeader)];
+  memset(padding, 0, sizeof(padding));
+  file.write(padding, sizeof(padding));
+
+  size_t cells = (size_t)width_ * length_;
+  for (size_t i = 0; i < cells; i++) {
+    if (format == FLOAT16) {
+      uint16_t half = floatToHalf(map_[i]);
+      file.write((const char*)&half, sizeof(half));
+    } else if (format == FLOAT32) {
+      float value = map_[i];
+      file.write((const char*)&value, sizeof(value));
+    } else {
+      file.write((const char*)&map_[i], sizeof(double));
     }
   }
-};
+
+  return file.good();
+}
 
 istream& operator>>(istream& stream, HeightMap& height_map) {
   // File format:
@@ -335,15 +666,13 @@ istream& operator>>(istream& stream, HeightMap& height_map) {
   stream.read((char*)&(height_map.length_), sizeof(unsigned));
   stream.read((char*)&(height_map.talus_), sizeof(double));
 
-  delete[] height_map.map_;
-  delete[] height_map.normals_;
+  height_map.Release();
   height_map.map_ = new double[height_map.width_ * height_map.length_];
-  height_map.normals_ = new Vector3D[height_map.width_ * height_map.length_];
 
   stream.read((char*)height_map.map_,
               (height_map.width_ * height_map.length_) * sizeof(double));
 
-  height_map.ComputeNormals();
+  height_map.ResetNormals();
 
   return stream;
 }
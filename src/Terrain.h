@@ -1,11 +1,14 @@
 #ifndef __TERRAIN_H__
 #define __TERRAIN_H__
 
+#include <cstddef>
 #include <iostream>
 #include <string>
+#include <vector>
 
 #include "Primitive.h"
 
+class ChunkedTerrain;
 class HeightMap;
 class Node;
 
@@ -17,6 +20,23 @@ namespace Terrain {
 
 class HeightMap : public Primitive {
  public:
+  // Sample precision used by the v2 .hm file format. FLOAT64 files match the
+  // in-memory layout and are mapped directly instead of being decoded, so
+  // Save() writes them unless asked for something smaller.
+  enum SampleFormat {
+    FLOAT16,
+    FLOAT32,
+    FLOAT64
+  };
+
+  // Both map the file privately, so writes never reach it. READ_ONLY pages
+  // are only made writable on the first write through operator[] or
+  // SetHeights(), which is what COPY_ON_WRITE does up front.
+  enum MapMode {
+    READ_ONLY,
+    COPY_ON_WRITE
+  };
+
   HeightMap();
   HeightMap(unsigned width, unsigned length, double height, bool texture = true);
   HeightMap(const HeightMap&);
@@ -30,14 +50,58 @@ class HeightMap : public Primitive {
   double GetTalus() const { return talus_; }
 
   HeightMap& operator=(const HeightMap& other);
-  double* operator[](unsigned i) { return map_ + i * width_; }
-  const double* operator[](unsigned i) const { return map_ + i * width_; }
-
+  // Rows run along the length, one per unit of width.
+  double* operator[](unsigned i) {
+    if (read_only_) {
+      MakeWritable();
+    }
+    return map_ + i * length_;
+  }
+  const double* operator[](unsigned i) const { return map_ + i * length_; }
+
+  // Loads either a v2 file or the original headerless format.
+  bool Load(const std::string& file_name, MapMode mode = COPY_ON_WRITE);
+  bool Save(const std::string& file_name, SampleFormat format = FLOAT64) const;
+  bool IsMapped() const { return mapping_ != 0; }
+
+  // Tell the renderer which cells were written through operator[] so it can
+  // refresh just those. The rectangle is inclusive.
+  void Invalidate();
+  void Invalidate(unsigned i0, unsigned j0, unsigned i1, unsigned j1);
+
+  // Copies in a whole grid of heights laid out as operator[] lays them out,
+  // then refreshes normals and render data for just the cells that changed.
+  void SetHeights(const double* heights);
+
+  // Normals are kept in bands of rows, each computed the first time one of
+  // its normals is asked for, so a map nobody looks at closely costs none.
+  const Vector3D& GetNormal(unsigned i, unsigned j) const {
+    const Vector3D* band = normals_[i / kNormalRows];
+    if (!band) {
+      band = ComputeNormalBand(i / kNormalRows);
+    }
+    return band[(i % kNormalRows) * length_ + j];
+  }
+
+  // Computes every normal now.
   void ComputeNormals();
+  // Recomputes the normals of an inclusive rectangle of changed cells and
+  // their neighbours, in the bands that have been computed already.
+  void ComputeNormals(unsigned i0, unsigned j0, unsigned i1, unsigned j1);
   virtual void Render() const;
 
  private:
-  Vector3D& GetNormal(unsigned i, unsigned j) const;
+  static const unsigned kNormalRows = 16;
+
+  void Release();
+  // Drops any normals and makes room for the bands of the current size.
+  void ResetNormals();
+  const Vector3D* ComputeNormalBand(unsigned band) const;
+  // Normals of rows i0..i1, cells j0..j1, skipping bands not yet computed.
+  void ComputeNormalRows(unsigned i0, unsigned j0, unsigned i1,
+                         unsigned j1) const;
+  // Lets a READ_ONLY map be written, without the writes reaching the file.
+  void MakeWritable();
 
   Node* node_;
 
@@ -46,9 +110,18 @@ class HeightMap : public Primitive {
   unsigned width_;
   unsigned length_;
   double* map_;
-  Vector3D* normals_;
+  mutable std::vector<Vector3D*> normals_;
   double talus_;
 
+  void* mapping_;
+  size_t mapping_size_;
+  bool read_only_;
+
+  // Built on first render.
+  mutable ChunkedTerrain* chunks_;
+
+  friend class ChunkedTerrain;
+
   friend std::istream& operator>>(std::istream&, HeightMap&);
 };
 
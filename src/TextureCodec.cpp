@@ -0,0 +1,481 @@
+#include "TextureCodec.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Logging.h"
+
+using std::string;
+
+// A .cache file is this header followed by the DXT1 blocks of each level in
+// turn, largest first.
+struct TextureCacheHeader {
+  char magic_[4];
+  uint32_t version_;
+  uint32_t endian_;
+  uint32_t width_;
+  uint32_t height_;
+  uint32_t level_count_;
+  uint64_t source_size_;
+  uint64_t source_hash_;
+};
+
+static const char kMagic[4] = {'T', 'E', 'X', 'C'};
+static const uint32_t kVersion = 1;
+static const uint32_t kEndianMarker = 0x01020304;
+
+static const uint64_t kFnvOffset = 14695981039346656037ULL;
+static const uint64_t kFnvPrime = 1099511628211ULL;
+
+static int clampByte(float value) {
+  if (value <= 0) {
+    return 0;
+  }
+  if (value >= 255) {
+    return 255;
+  }
+  return (int)(value + 0.5f);
+}
+
+static unsigned short packColour(const float colour[3]) {
+  int r = clampByte(colour[0]) * 31 + 127;
+  int g = clampByte(colour[1]) * 63 + 127;
+  int b = clampByte(colour[2]) * 31 + 127;
+  return ((r / 255) << 11) | ((g / 255) << 5) | (b / 255);
+}
+
+static void unpackColour(unsigned short colour, int rgb[3]) {
+  int r = (colour >> 11) & 31;
+  int g = (colour >> 5) & 63;
+  int b = colour & 31;
+  rgb[0] = (r << 3) | (r >> 2);
+  rgb[1] = (g << 2) | (g >> 4);
+  rgb[2] = (b << 3) | (b >> 2);
+}
+
+// The four colours a block can use. c0 > c1 selects these, the only mode the
+// encoder writes; otherwise the third colour is the average and the fourth
+// is black.
+static void makePalette(unsigned short c0, unsigned short c1,
+                        int palette[4][3]) {
+  unpackColour(c0, palette[0]);
+  unpackColour(c1, palette[1]);
+  for (unsigned k = 0; k < 3; k++) {
+    if (c0 > c1) {
+      palette[2][k] = (2 * palette[0][k] + palette[1][k]) / 3;
+      palette[3][k] = (palette[0][k] + 2 * palette[1][k]) / 3;
+    } else {
+      palette[2][k] = (palette[0][k] + palette[1][k]) / 2;
+      palette[3][k] = 0;
+    }
+  }
+}
+
+// Encodes the block with endpoints near e0 and e1, picking the nearest
+// palette colour for each pixel. Returns the summed squared error.
+static unsigned encodeEndpoints(const int block[16][3], const float e0[3],
+                                const float e1[3], unsigned short& c0,
+                                unsigned short& c1, uint32_t& indices) {
+  c0 = packColour(e0);
+  c1 = packColour(e1);
+  if (c0 < c1) {
+    unsigned short swap = c0;
+    c0 = c1;
+    c1 = swap;
+  }
+
+  // Equal endpoints can only be written in the three colour mode, where
+  // index 0 is still the colour itself.
+  unsigned choices = c0 == c1 ? 1 : 4;
+  int palette[4][3];
+  makePalette(c0, c1, palette);
+
+  unsigned error = 0;
+  indices = 0;
+  for (unsigned i = 0; i < 16; i++) {
+    unsigned best = 0;
+    unsigned best_distance = ~0u;
+    for (unsigned j = 0; j < choices; j++) {
+      unsigned distance = 0;
+      for (unsigned k = 0; k < 3; k++) {
+        int d = block[i][k] - palette[j][k];
+        distance += d * d;
+      }
+      if (distance < best_distance) {
+        best = j;
+        best_distance = distance;
+      }
+    }
+    indices |= best << (2 * i);
+    error += best_distance;
+  }
+  return error;
+}
+
+// The endpoints that best fit the block, in the least squares sense, given
+// which palette entry each pixel uses. Returns false if the indices don't
+// pin them down.
+static bool refineEndpoints(const int block[16][3], uint32_t indices,
+                            float e0[3], float e1[3]) {
+  static const float kWeights[4] = {1.0f, 0.0f, 2.0f / 3.0f, 1.0f / 3.0f};
+
+  float aa = 0, ab = 0, bb = 0;
+  float ax[3] = {0, 0, 0};
+  float bx[3] = {0, 0, 0};
+  for (unsigned i = 0; i < 16; i++) {
+    float a = kWeights[(indices >> (2 * i)) & 3];
+    float b = 1.0f - a;
+    aa += a * a;
+    ab += a * b;
+    bb += b * b;
+    for (unsigned k = 0; k < 3; k++) {
+      ax[k] += a * block[i][k];
+      bx[k] += b * block[i][k];
+    }
+  }
+
+  float determinant = aa * bb - ab * ab;
+  if (determinant < 1e-3f) {
+    return false;
+  }
+  for (unsigned k = 0; k < 3; k++) {
+    e0[k] = (bb * ax[k] - ab * bx[k]) / determinant;
+    e1[k] = (aa * bx[k] - ab * ax[k]) / determinant;
+  }
+  return true;
+}
+
+static void writeBlock(unsigned short c0, unsigned short c1,
+                       uint32_t indices, unsigned char* out) {
+  out[0] = c0 & 0xff;
+  out[1] = c0 >> 8;
+  out[2] = c1 & 0xff;
+  out[3] = c1 >> 8;
+  for (unsigned i = 0; i < 4; i++) {
+    out[4 + i] = (indices >> (8 * i)) & 0xff;
+  }
+}
+
+// Starts from the pixels furthest apart along the block's principal axis,
+// then moves the endpoints to the least squares fit of the colours they were
+// given and keeps whichever encoding is closer.
+static void compressBlock(const int block[16][3], unsigned char* out) {
+  float mean[3] = {0, 0, 0};
+  int low[3] = {255, 255, 255};
+  int high[3] = {0, 0, 0};
+  for (unsigned i = 0; i < 16; i++) {
+    for (unsigned k = 0; k < 3; k++) {
+      mean[k] += block[i][k];
+      low[k] = block[i][k] < low[k] ? block[i][k] : low[k];
+      high[k] = block[i][k] > high[k] ? block[i][k] : high[k];
+    }
+  }
+  for (unsigned k = 0; k < 3; k++) {
+    mean[k] /= 16;
+  }
+
+  // Upper triangle of the covariance matrix: rr, rg, rb, gg, gb, bb.
+  float covariance[6] = {0, 0, 0, 0, 0, 0};
+  for (unsigned i = 0; i < 16; i++) {
+    float r = block[i][0] - mean[0];
+    float g = block[i][1] - mean[1];
+    float b = block[i][2] - mean[2];
+    covariance[0] += r * r;
+    covariance[1] += r * g;
+    covariance[2] += r * b;
+    covariance[3] += g * g;
+    covariance[4] += g * b;
+    covariance[5] += b * b;
+  }
+
+  // Power iteration from the bounding box diagonal.
+  float axis[3];
+  for (unsigned k = 0; k < 3; k++) {
+    axis[k] = high[k] - low[k];
+  }
+  for (unsigned iteration = 0; iteration < 4; iteration++) {
+    float next[3];
+    next[0] = covariance[0] * axis[0] + covariance[1] * axis[1] +
+              covariance[2] * axis[2];
+    next[1] = covariance[1] * axis[0] + covariance[3] * axis[1] +
+              covariance[4] * axis[2];
+    next[2] = covariance[2] * axis[0] + covariance[4] * axis[1] +
+              covariance[5] * axis[2];
+
+    float length = 0;
+    for (unsigned k = 0; k < 3; k++) {
+      float magnitude = next[k] < 0 ? -next[k] : next[k];
+      length = magnitude > length ? magnitude : length;
+    }
+    if (length < 1e-6f) {
+      break;
+    }
+    for (unsigned k = 0; k < 3; k++) {
+      axis[k] = next[k] / length;
+    }
+  }
+
+  unsigned lowest = 0;
+  unsigned highest = 0;
+  float lowest_projection = 0;
+  float highest_projection = 0;
+  for (unsigned i = 0; i < 16; i++) {
+    float projection = block[i][0] * axis[0] + block[i][1] * axis[1] +
+                       block[i][2] * axis[2];
+    if (i == 0 || projection < lowest_projection) {
+      lowest = i;
+      lowest_projection = projection;
+    }
+    if (i == 0 || projection > highest_projection) {
+      highest = i;
+      highest_projection = projection;
+    }
+  }
+
+  float e0[3];
+  float e1[3];
+  for (unsigned k = 0; k < 3; k++) {
+    e0[k] = block[highest][k];
+    e1[k] = block[lowest][k];
+  }
+
+  unsigned short c0, c1;
+  uint32_t indices;
+  unsigned error = encodeEndpoints(block, e0, e1, c0, c1, indices);
+
+  if (error > 0 && c0 != c1 && refineEndpoints(block, indices, e0, e1)) {
+    unsigned short refined_c0, refined_c1;
+    uint32_t refined_indices;
+    unsigned refined_error = encodeEndpoints(block, e0, e1, refined_c0,
+                                             refined_c1, refined_indices);
+    if (refined_error < error) {
+      c0 = refined_c0;
+      c1 = refined_c1;
+      indices = refined_indices;
+    }
+  }
+
+  writeBlock(c0, c1, indices, out);
+}
+
+namespace TextureCodec {
+
+unsigned GetLevelCount(int width, int height) {
+  unsigned count = 1;
+  while (width > 1 || height > 1) {
+    width = GetLevelSize(width, 1);
+    height = GetLevelSize(height, 1);
+    count++;
+  }
+  return count;
+}
+
+void Downsample(const unsigned char* source, int width, int height,
+                int components, unsigned char* target) {
+  int target_width = GetLevelSize(width, 1);
+  int target_height = GetLevelSize(height, 1);
+  int stride = width * components;
+  // A side that is already 1 is averaged with itself.
+  int row_step = height > 1 ? stride : 0;
+  int column_step = width > 1 ? components : 0;
+
+  for (int y = 0; y < target_height; y++) {
+    const unsigned char* row = source + 2 * y * stride;
+    for (int x = 0; x < target_width; x++) {
+      const unsigned char* pixel = row + 2 * x * components;
+      for (int k = 0; k < components; k++) {
+        *target++ = (pixel[k] + pixel[k + column_step] + pixel[k + row_step] +
+                     pixel[k + row_step + column_step] + 2) >> 2;
+      }
+    }
+  }
+}
+
+void BuildMipChain(int width, int height, int components,
+                   LevelList& levels) {
+  unsigned count = GetLevelCount(width, height);
+  levels.reserve(count);
+  for (unsigned level = 1; level < count; level++) {
+    int level_width = GetLevelSize(width, level);
+    int level_height = GetLevelSize(height, level);
+    levels.push_back(Level(level_width * level_height * components));
+    Downsample(&levels[level - 1][0], GetLevelSize(width, level - 1),
+               GetLevelSize(height, level - 1), components, &levels[level][0]);
+  }
+}
+
+unsigned GetDxt1Size(int width, int height) {
+  return 8 * ((width + 3) / 4) * ((height + 3) / 4);
+}
+
+void CompressDxt1(const unsigned char* pixels, int width, int height,
+                  int components, unsigned char* blocks) {
+  for (int by = 0; by < height; by += 4) {
+    for (int bx = 0; bx < width; bx += 4) {
+      // Partial blocks repeat the last row and column of the image.
+      int block[16][3];
+      for (int y = 0; y < 4; y++) {
+        int row = by + y < height ? by + y : height - 1;
+        for (int x = 0; x < 4; x++) {
+          int column = bx + x < width ? bx + x : width - 1;
+          const unsigned char* pixel =
+              pixels + components * (row * width + column);
+          for (int k = 0; k < 3; k++) {
+            block[4 * y + x][k] = pixel[components < 3 ? 0 : k];
+          }
+        }
+      }
+
+      compressBlock(block, blocks);
+      blocks += 8;
+    }
+  }
+}
+
+void DecompressDxt1(const unsigned char* blocks, int width, int height,
+                    unsigned char* pixels) {
+  for (int by = 0; by < height; by += 4) {
+    for (int bx = 0; bx < width; bx += 4) {
+      unsigned short c0 = blocks[0] | (blocks[1] << 8);
+      unsigned short c1 = blocks[2] | (blocks[3] << 8);
+      int palette[4][3];
+      makePalette(c0, c1, palette);
+
+      for (int y = 0; y < 4 && by + y < height; y++) {
+        unsigned row = blocks[4 + y];
+        for (int x = 0; x < 4 && bx + x < width; x++) {
+          const int* colour = palette[(row >> (2 * x)) & 3];
+          unsigned char* pixel = pixels + 3 * ((by + y) * width + bx + x);
+          for (int k = 0; k < 3; k++) {
+            pixel[k] = colour[k];
+          }
+        }
+      }
+      blocks += 8;
+    }
+  }
+}
+
+bool HashFile(const string& file_name, uint64_t& hash, uint64_t& size) {
+  FILE* file = fopen(file_name.c_str(), "rb");
+  if (!file) {
+    return false;
+  }
+
+  hash = kFnvOffset;
+  size = 0;
+  unsigned char buffer[65536];
+  size_t count;
+  while ((count = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    for (size_t i = 0; i < count; i++) {
+      hash = (hash ^ buffer[i]) * kFnvPrime;
+    }
+    size += count;
+  }
+
+  bool ok = !ferror(file);
+  fclose(file);
+  return ok;
+}
+
+bool ReadCache(const string& cache_name, uint64_t source_size,
+               uint64_t source_hash, int& width, int& height,
+               LevelList& levels) {
+  FILE* file = fopen(cache_name.c_str(), "rb");
+  if (!file) {
+    return false;
+  }
+
+  struct stat info;
+  TextureCacheHeader header;
+  if (fstat(fileno(file), &info) < 0 ||
+      fread(&header, sizeof(header), 1, file) != 1 ||
+      memcmp(header.magic_, kMagic, sizeof(kMagic)) != 0 ||
+      header.version_ != kVersion || header.endian_ != kEndianMarker ||
+      header.source_size_ != source_size ||
+      header.source_hash_ != source_hash ||
+      header.width_ == 0 || header.height_ == 0 ||
+      header.level_count_ == 0 ||
+      header.level_count_ > GetLevelCount(header.width_, header.height_)) {
+    fclose(file);
+    return false;
+  }
+
+  uint64_t expected = sizeof(header);
+  for (unsigned level = 0; level < header.level_count_; level++) {
+    expected += GetDxt1Size(GetLevelSize(header.width_, level),
+                            GetLevelSize(header.height_, level));
+  }
+  if ((uint64_t)info.st_size != expected) {
+    fclose(file);
+    return false;
+  }
+
+  levels.resize(header.level_count_);
+  bool ok = true;
+  for (unsigned level = 0; ok && level < levels.size(); level++) {
+    levels[level].resize(GetDxt1Size(GetLevelSize(header.width_, level),
+                                     GetLevelSize(header.height_, level)));
+    ok = fread(&levels[level][0], levels[level].size(), 1, file) == 1;
+  }
+  fclose(file);
+
+  if (!ok) {
+    levels.clear();
+    return false;
+  }
+  width = header.width_;
+  height = header.height_;
+  return true;
+}
+
+// Written under a unique temporary name and then renamed, so a reader never
+// sees half a cache, and two writers never share a file.
+bool WriteCache(const string& cache_name, uint64_t source_size,
+                uint64_t source_hash, int width, int height,
+                const LevelList& levels) {
+  string temporary = cache_name + ".XXXXXX";
+  int fd = mkstemp(&temporary[0]);
+  if (fd < 0) {
+    ERROR("Could not write " << cache_name);
+    return false;
+  }
+  // mkstemp only lets the owner read the file.
+  fchmod(fd, 0644);
+  FILE* file = fdopen(fd, "wb");
+  if (!file) {
+    close(fd);
+    unlink(temporary.c_str());
+    ERROR("Could not write " << cache_name);
+    return false;
+  }
+
+  TextureCacheHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic_, kMagic, sizeof(kMagic));
+  header.version_ = kVersion;
+  header.endian_ = kEndianMarker;
+  header.width_ = width;
+  header.height_ = height;
+  header.level_count_ = levels.size();
+  header.source_size_ = source_size;
+  header.source_hash_ = source_hash;
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+
+  for (unsigned level = 0; ok && level < levels.size(); level++) {
+    ok = fwrite(&levels[level][0], levels[level].size(), 1, file) == 1;
+  }
+  ok = fclose(file) == 0 && ok;
+
+  if (!ok || rename(temporary.c_str(), cache_name.c_str()) != 0) {
+    unlink(temporary.c_str());
+    ERROR("Could not write " << cache_name);
+    return false;
+  }
+  return true;
+}
+
+}
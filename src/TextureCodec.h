@@ -0,0 +1,58 @@
+#ifndef __TEXTURE_CODEC_H__
+#define __TEXTURE_CODEC_H__
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// CPU side texture processing: mip chains, DXT1 (S3TC) block compression and
+// the on-disk cache of compressed chains.
+//
+// Images are rows of pixels from the top, each pixel `components` bytes of
+// grey, RGB or RGBA. Compressed images keep only the colour; alpha is
+// dropped, as it always was by the RGB textures this serves.
+namespace TextureCodec {
+  typedef std::vector<unsigned char> Level;
+  typedef std::vector<Level> LevelList;
+
+  // Dimension of the given mip level, never less than 1.
+  inline int GetLevelSize(int size, unsigned level) {
+    size >>= level;
+    return size > 0 ? size : 1;
+  }
+  // Levels from the full size image down to 1x1.
+  unsigned GetLevelCount(int width, int height);
+
+  // Fills target with the next level of source, each pixel the average of
+  // the 2x2 pixels above it. An odd last row or column is left out.
+  void Downsample(const unsigned char* source, int width, int height,
+                  int components, unsigned char* target);
+  // Appends levels to a list holding just the full size image.
+  void BuildMipChain(int width, int height, int components,
+                     LevelList& levels);
+
+  // Bytes of DXT1 blocks needed for an image: eight per 4x4 pixels, with
+  // partial blocks at the edges rounded up.
+  unsigned GetDxt1Size(int width, int height);
+  void CompressDxt1(const unsigned char* pixels, int width, int height,
+                    int components, unsigned char* blocks);
+  // Decodes blocks back into RGB pixels, for GL drivers without S3TC.
+  void DecompressDxt1(const unsigned char* blocks, int width, int height,
+                      unsigned char* pixels);
+
+  // A 64-bit FNV-1a hash of a file's contents.
+  bool HashFile(const std::string& file_name, uint64_t& hash,
+                uint64_t& size);
+
+  // A cache holds a DXT1 mip chain, and is only read back for a source file
+  // with the size and hash it was written for. Levels are checked to be the
+  // size their dimensions call for.
+  bool ReadCache(const std::string& cache_name, uint64_t source_size,
+                 uint64_t source_hash, int& width, int& height,
+                 LevelList& levels);
+  bool WriteCache(const std::string& cache_name, uint64_t source_size,
+                  uint64_t source_hash, int width, int height,
+                  const LevelList& levels);
+};
+
+#endif
@@ -0,0 +1,130 @@
+#include "TextureLoader.h"
+
+#include "Material.h"
+#include "Profiler.h"
+#include "ThreadPool.h"
+
+using std::vector;
+
+TextureLoader::TextureLoader(unsigned threads)
+    : threads_(threads ? threads : ThreadPool::GetCoreCount())
+    , quit_(false)
+    , decoding_(0) {
+  pthread_mutex_init(&mutex_, NULL);
+  pthread_cond_init(&queued_, NULL);
+  pthread_cond_init(&decoded_, NULL);
+
+  for (unsigned i = 0; i < threads_.size(); i++) {
+    pthread_create(&threads_[i], NULL, WorkerMain, this);
+  }
+}
+
+// Textures still waiting are abandoned, so this should only happen at exit.
+TextureLoader::~TextureLoader() {
+  pthread_mutex_lock(&mutex_);
+  quit_ = true;
+  pthread_cond_broadcast(&queued_);
+  pthread_mutex_unlock(&mutex_);
+
+  for (unsigned i = 0; i < threads_.size(); i++) {
+    pthread_join(threads_[i], NULL);
+  }
+
+  pthread_cond_destroy(&decoded_);
+  pthread_cond_destroy(&queued_);
+  pthread_mutex_destroy(&mutex_);
+}
+
+TextureLoader* TextureLoader::GetDefault() {
+  static TextureLoader loader;
+  return &loader;
+}
+
+void TextureLoader::Decode(Texture* texture) {
+  texture->Reference();
+
+  pthread_mutex_lock(&mutex_);
+  queue_.push_back(texture);
+  pthread_cond_signal(&queued_);
+  pthread_mutex_unlock(&mutex_);
+}
+
+void TextureLoader::Upload() {
+  vector<Texture*> finished;
+  pthread_mutex_lock(&mutex_);
+  finished.swap(finished_);
+  pthread_mutex_unlock(&mutex_);
+
+  for (unsigned i = 0; i < finished.size(); i++) {
+    if (finished[i]->Upload()) {
+      // Still referenced, until it is uploaded compressed.
+      pthread_mutex_lock(&mutex_);
+      queue_.push_back(finished[i]);
+      pthread_cond_signal(&queued_);
+      pthread_mutex_unlock(&mutex_);
+    } else {
+      finished[i]->Release();
+    }
+  }
+}
+
+void TextureLoader::Wait(const Texture* texture) {
+  pthread_mutex_lock(&mutex_);
+  while (!texture->decoded_) {
+    pthread_cond_wait(&decoded_, &mutex_);
+  }
+  pthread_mutex_unlock(&mutex_);
+
+  Upload();
+}
+
+void TextureLoader::Finish() {
+  // Uploading may queue textures again to be compressed, so keep going until
+  // there's nothing left.
+  pthread_mutex_lock(&mutex_);
+  while (!queue_.empty() || decoding_ > 0 || !finished_.empty()) {
+    if (finished_.empty()) {
+      pthread_cond_wait(&decoded_, &mutex_);
+      continue;
+    }
+
+    pthread_mutex_unlock(&mutex_);
+    Upload();
+    pthread_mutex_lock(&mutex_);
+  }
+  pthread_mutex_unlock(&mutex_);
+}
+
+void* TextureLoader::WorkerMain(void* arg) {
+  TextureLoader* loader = (TextureLoader*)arg;
+  Profiler::SetThreadName("Texture loader");
+
+  while (true) {
+    pthread_mutex_lock(&loader->mutex_);
+    while (!loader->quit_ && loader->queue_.empty()) {
+      pthread_cond_wait(&loader->queued_, &loader->mutex_);
+    }
+
+    if (loader->quit_) {
+      pthread_mutex_unlock(&loader->mutex_);
+      return NULL;
+    }
+
+    Texture* texture = loader->queue_.front();
+    loader->queue_.pop_front();
+    loader->decoding_++;
+    pthread_mutex_unlock(&loader->mutex_);
+
+    {
+      PROFILE_ZONE("Texture decode");
+      texture->Decode();
+    }
+
+    pthread_mutex_lock(&loader->mutex_);
+    texture->decoded_ = true;
+    loader->decoding_--;
+    loader->finished_.push_back(texture);
+    pthread_cond_broadcast(&loader->decoded_);
+    pthread_mutex_unlock(&loader->mutex_);
+  }
+}
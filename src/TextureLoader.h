@@ -0,0 +1,57 @@
+#ifndef __TEXTURE_LOADER_H__
+#define __TEXTURE_LOADER_H__
+
+#include <deque>
+#include <pthread.h>
+#include <vector>
+
+class Texture;
+
+// Decodes texture images on worker threads so loading overlaps whatever the
+// GL thread does next. A decoded image waits in a queue until the GL thread
+// calls Upload() or Wait(), which copy it into a GL texture and free the
+// pixels. A texture to be compressed is queued again after its first upload,
+// and uploaded a second time once a worker has compressed it.
+//
+// Only the GL thread may call Decode(), Upload() and Wait(). The loader
+// holds a reference to each texture from Decode() until its upload.
+class TextureLoader {
+ public:
+  // threads == 0 uses one thread per online core.
+  TextureLoader(unsigned threads = 0);
+  ~TextureLoader();
+
+  void Decode(Texture* texture);
+
+  // Uploads every texture decoded so far, without waiting for the rest.
+  void Upload();
+  // Waits for the texture to be decoded, then uploads it along with any
+  // other finished ones.
+  void Wait(const Texture* texture);
+  // Waits for every texture decoding, compressing or queued, then uploads
+  // them all. For before compiling a display list, which would otherwise
+  // record any upload Wait() or Render() did to repeat it on every call.
+  void Finish();
+
+  static TextureLoader* GetDefault();
+
+ private:
+  TextureLoader(const TextureLoader&);
+  TextureLoader& operator=(const TextureLoader&);
+
+  static void* WorkerMain(void* loader);
+
+  std::vector<pthread_t> threads_;
+
+  pthread_mutex_t mutex_;
+  pthread_cond_t queued_;
+  pthread_cond_t decoded_;
+  bool quit_;
+
+  std::deque<Texture*> queue_;
+  // Textures taken off the queue and not yet decoded or compressed.
+  unsigned decoding_;
+  std::vector<Texture*> finished_;
+};
+
+#endif
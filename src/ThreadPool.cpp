@@ -0,0 +1,130 @@
+#include "ThreadPool.h"
+
+#include <sstream>
+#include <unistd.h>
+
+#include "Profiler.h"
+
+ThreadPool::ThreadPool(unsigned threads)
+    : threads_(threads ? threads : GetCoreCount())
+    , generation_(0)
+    , pending_(0)
+    , quit_(false)
+    , task_(NULL)
+    , data_(NULL)
+    , count_(0) {
+  pthread_mutex_init(&run_mutex_, NULL);
+  pthread_mutex_init(&mutex_, NULL);
+  pthread_cond_init(&start_, NULL);
+  pthread_cond_init(&done_, NULL);
+
+  // Worker 0 is the thread calling Run(), so only spawn the others. The vector
+  // is sized up front since the threads keep pointers into it.
+  workers_.resize(threads_ - 1);
+  for (unsigned i = 0; i < workers_.size(); i++) {
+    workers_[i].pool_ = this;
+    workers_[i].index_ = i + 1;
+    pthread_create(&workers_[i].thread_, NULL, WorkerMain, &workers_[i]);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  pthread_mutex_lock(&mutex_);
+  quit_ = true;
+  pthread_cond_broadcast(&start_);
+  pthread_mutex_unlock(&mutex_);
+
+  for (unsigned i = 0; i < workers_.size(); i++) {
+    pthread_join(workers_[i].thread_, NULL);
+  }
+
+  pthread_cond_destroy(&done_);
+  pthread_cond_destroy(&start_);
+  pthread_mutex_destroy(&mutex_);
+  pthread_mutex_destroy(&run_mutex_);
+}
+
+unsigned ThreadPool::GetCoreCount() {
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  return cores > 0 ? cores : 1;
+}
+
+ThreadPool* ThreadPool::GetDefault() {
+  static ThreadPool pool;
+  return &pool;
+}
+
+void ThreadPool::Run(Task task, void* data, unsigned count) {
+  if (count == 0) {
+    return;
+  }
+
+  if (threads_ == 1) {
+    task(data, 0, count);
+    return;
+  }
+
+  // Only one job can be in flight at a time.
+  pthread_mutex_lock(&run_mutex_);
+
+  pthread_mutex_lock(&mutex_);
+  task_ = task;
+  data_ = data;
+  count_ = count;
+  pending_ = workers_.size();
+  generation_++;
+  pthread_cond_broadcast(&start_);
+  pthread_mutex_unlock(&mutex_);
+
+  RunBlock(0);
+
+  pthread_mutex_lock(&mutex_);
+  while (pending_ > 0) {
+    pthread_cond_wait(&done_, &mutex_);
+  }
+  pthread_mutex_unlock(&mutex_);
+
+  pthread_mutex_unlock(&run_mutex_);
+}
+
+void ThreadPool::RunBlock(unsigned index) {
+  unsigned begin = (unsigned long long)count_ * index / threads_;
+  unsigned end = (unsigned long long)count_ * (index + 1) / threads_;
+  if (begin < end) {
+    PROFILE_ZONE("Thread pool block");
+    task_(data_, begin, end);
+  }
+}
+
+void* ThreadPool::WorkerMain(void* arg) {
+  Worker* worker = (Worker*)arg;
+  ThreadPool* pool = worker->pool_;
+  unsigned seen = 0;
+
+  std::stringstream ss;
+  ss << "Pool worker " << worker->index_;
+  Profiler::SetThreadName(ss.str());
+
+  while (true) {
+    pthread_mutex_lock(&pool->mutex_);
+    while (!pool->quit_ && pool->generation_ == seen) {
+      pthread_cond_wait(&pool->start_, &pool->mutex_);
+    }
+
+    if (pool->quit_) {
+      pthread_mutex_unlock(&pool->mutex_);
+      return NULL;
+    }
+
+    seen = pool->generation_;
+    pthread_mutex_unlock(&pool->mutex_);
+
+    pool->RunBlock(worker->index_);
+
+    pthread_mutex_lock(&pool->mutex_);
+    if (--pool->pending_ == 0) {
+      pthread_cond_signal(&pool->done_);
+    }
+    pthread_mutex_unlock(&pool->mutex_);
+  }
+}
@@ -0,0 +1,52 @@
+#ifndef __THREAD_POOL_H__
+#define __THREAD_POOL_H__
+
+#include <pthread.h>
+#include <vector>
+
+// Fork-join pool of worker threads. Run() splits a range of work items into
+// one contiguous block per thread (the calling thread takes the first block)
+// and returns once every block is finished, so consecutive calls act as a
+// barrier between phases of an algorithm.
+class ThreadPool {
+ public:
+  typedef void (*Task)(void* data, unsigned begin, unsigned end);
+
+  // threads == 0 uses one thread per online core.
+  ThreadPool(unsigned threads = 0);
+  ~ThreadPool();
+
+  unsigned GetThreadCount() const { return threads_; }
+
+  void Run(Task task, void* data, unsigned count);
+
+  static unsigned GetCoreCount();
+  static ThreadPool* GetDefault();
+
+ private:
+  struct Worker {
+    ThreadPool* pool_;
+    unsigned index_;
+    pthread_t thread_;
+  };
+
+  static void* WorkerMain(void* worker);
+  void RunBlock(unsigned index);
+
+  unsigned threads_;
+  std::vector<Worker> workers_;
+
+  pthread_mutex_t run_mutex_;
+  pthread_mutex_t mutex_;
+  pthread_cond_t start_;
+  pthread_cond_t done_;
+  unsigned generation_;
+  unsigned pending_;
+  bool quit_;
+
+  Task task_;
+  void* data_;
+  unsigned count_;
+};
+
+#endif
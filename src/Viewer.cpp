@@ -2,18 +2,56 @@
 
 #include <algorithm>
 #include <cstdlib>
+#include <cstring>
 #include <GL/gl.h>
 #include <GL/glu.h>
+#include <GL/glx.h>
 
 #include "Logging.h"
-#include "LSystem.h"
-#include "Terrain.h"
+#include "Node.h"
+#include "Profiler.h"
 #include "Trackball.h"
-#include "Water.h"
 
 using std::min;
 
-Viewer::Viewer(char mode) {
+// Milliseconds between frames when swaps can't wait for the vertical blank.
+static const unsigned kFrameInterval = 16;
+
+// Has swaps wait for the display's vertical blank, so the display paces
+// frames rather than drawing as many as possible and showing few of them.
+// Needs the context current.
+static bool enableSwapControl() {
+  Display* display = glXGetCurrentDisplay();
+  if (!display) {
+    return false;
+  }
+  const char* extensions = glXQueryExtensionsString(display,
+                                                    DefaultScreen(display));
+  if (!extensions) {
+    return false;
+  }
+
+  if (strstr(extensions, "GLX_MESA_swap_control")) {
+    PFNGLXSWAPINTERVALMESAPROC swap_interval =
+        (PFNGLXSWAPINTERVALMESAPROC)glXGetProcAddressARB(
+            (const GLubyte*)"glXSwapIntervalMESA");
+    if (swap_interval && swap_interval(1) == 0) {
+      return true;
+    }
+  }
+  if (strstr(extensions, "GLX_SGI_swap_control")) {
+    PFNGLXSWAPINTERVALSGIPROC swap_interval =
+        (PFNGLXSWAPINTERVALSGIPROC)glXGetProcAddressARB(
+            (const GLubyte*)"glXSwapIntervalSGI");
+    if (swap_interval && swap_interval(1) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+Viewer::Viewer(char mode)
+    : scene_(mode) {
   Glib::RefPtr<Gdk::GL::Config> gl_config;
   gl_config = Gdk::GL::Config::create(Gdk::GL::MODE_RGB | Gdk::GL::MODE_DEPTH |
                                       Gdk::GL::MODE_DOUBLE);
@@ -34,21 +72,15 @@ Viewer::Viewer(char mode) {
   mouse_prev_[0] = mouse_prev_[1] = 0;
   button_down_ = false;
 
-  mode_ = mode;
-}
-
-Viewer::~Viewer() {
-  if (mode_ == 't') {
-    delete water_;
-  }
-
-  if (mode_ == 'f') {
-    delete flock_;
-  }
+  font_lists_ = 0;
+  show_profile_ = false;
+  vsync_ = false;
 
-  delete root_;
+  Profiler::SetThreadName("Main");
 }
 
+Viewer::~Viewer() {}
+
 void Viewer::Invalidate() {
   Gtk::Allocation allocation = get_allocation();
   get_window()->invalidate_rect(allocation, false);
@@ -63,120 +95,67 @@ void Viewer::on_realize() {
     return;
   }
 
-  glClearColor(0.0, 0.0, 0.0, 0);
-  glShadeModel(GL_SMOOTH);
-  glEnable(GL_DEPTH_TEST);
-  glEnable(GL_COLOR_MATERIAL);
-
-  glEnable(GL_CULL_FACE);
-  glCullFace(GL_BACK);
-
-  glEnable(GL_TEXTURE_2D);
-
-  glEnable(GL_LIGHTING);
-  glEnable(GL_LIGHT0);
-
-  float pos[] = {0.0, 0.0, -1.0, 0.0};
-  glLightfv(GL_LIGHT0, GL_POSITION, pos);
-
-  float ambient[] = {0.3, 0.3, 0.3, 1.0};
-  float diffuse[] = {0.8, 0.8, 0.8, 1.0};
-  float specular[] = {0.5, 0.5, 0.5, 1.0};
-
-  glLightModelfv(GL_LIGHT_MODEL_AMBIENT, ambient);
-  glLightfv(GL_LIGHT0, GL_DIFFUSE, diffuse);
-  glLightfv(GL_LIGHT0, GL_SPECULAR, specular);
-
-  Node* bush;
-  Node* tree;
-  if (mode_ == 'l') {
-    bush = LSystem::GenerateBush("Bush");
-    bush->Translate(Vector3D(3, -5, -15));
-    bush->Scale(Vector3D(0.005, 0.005, 0.005));
-
-    tree = LSystem::GenerateTree("Tree");
-    tree->Translate(Vector3D(-3, -5, -15));
-    tree->Scale(Vector3D(0.01, 0.01, 0.01));
-  }
-  
-  if (mode_ == 't' || mode_ == 'w') {
-    terrain_ = Terrain::GenerateTerrain("test.hm", mode_ == 't');
-    Node* terrain_node = terrain_->GetNode();
-
-    if (mode_ != 'w') {
-      terrain_node->Translate(Vector3D(50, -8, -100));
-      terrain_node->Rotate('y', -90);
-
-      water_ = new Water(*terrain_, 5.0);
-      terrain_node->AddChild(water_->GetNode());
-    } else {
-      terrain_node->Translate(Vector3D(20, -20, -200));
-      terrain_node->Rotate('y', -45);
-    }
-  }
-
-
-  if (mode_ == 'f') {
-    flock_ = new Flock();
-    Node* flock_node = flock_->GetNode();
-    flock_node->Translate(Vector3D(0, 0, -50));
-    flock_node->Scale(Vector3D(0.2, 0.2, 0.2));
+  // ASCII glyphs for the profile overlay's labels.
+  font_lists_ = glGenLists(128);
+  Pango::FontDescription font_description("Monospace 9");
+  if (!Gdk::GL::Font::use_pango_font(font_description, 0, 128, font_lists_)) {
+    ERROR("Unable to load the overlay font");
+    glDeleteLists(font_lists_, 128);
+    font_lists_ = 0;
   }
 
-  root_ = new Node("root");
+  scene_.Realize();
+  scene_.StartSimulation();
 
-  if (mode_ == 't' || mode_ == 'w') {
-    root_->AddChild(terrain_->GetNode());
-  } else if (mode_ == 'l') {
-    root_->AddChild(bush);
-    root_->AddChild(tree);
-  } else if (mode_ == 'f') {
-    root_->AddChild(flock_->GetNode());
+  vsync_ = enableSwapControl();
+  if (!vsync_) {
+    ERROR("No swap control, pacing frames with a timer");
+    Glib::signal_timeout().connect(
+        sigc::mem_fun(*this, &Viewer::OnFrameTimer), kFrameInterval);
   }
 
   gl_drawable->gl_end();
 }
 
+bool Viewer::OnFrameTimer() {
+  Invalidate();
+  return true;
+}
+
 bool Viewer::on_expose_event(GdkEventExpose*) {
   Glib::RefPtr<Gdk::GL::Drawable> gl_drawable = get_gl_drawable();
   if (!gl_drawable || !gl_drawable->gl_begin(get_gl_context())) {
     return false;
   }
 
-  glMatrixMode(GL_PROJECTION);
-  glLoadIdentity();
-  glViewport(0, 0, get_width(), get_height());
-  gluPerspective(40.0, (GLfloat)get_width() / get_height(), 0.1, 1000.0);
-
-  glMatrixMode(GL_MODELVIEW);
-  glLoadIdentity();
-
-  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
+  scene_.Draw(get_width(), get_height());
 
-  if (mode_ == 'f') {
-    flock_->Move();
-    if (flock_->AtDestination()) {
-      flock_->SetDestination(Point3D(-(rand() % 100), (rand() % 200) - 100, 0));
-    }
+  if (show_profile_) {
+    Profiler::DrawOverlay(get_width(), get_height(), font_lists_);
   }
 
-  if (mode_ == 'w') {
-    Terrain::ThermalWeathering(terrain_, 1);
+  {
+    PROFILE_ZONE("Swap");
+    gl_drawable->swap_buffers();
   }
+  Profiler::EndFrame();
+  gl_drawable->gl_end();
 
-  if (mode_ == 't') {
-    water_->Animate(false);
+  // The next swap waits for the vertical blank, so asking for another frame
+  // straight away draws one per refresh.
+  if (vsync_) {
+    Invalidate();
   }
 
-  root_->Render();
-
-  gl_drawable->swap_buffers();
-  gl_drawable->gl_end();
+  return true;
+}
 
-  Invalidate();
+void Viewer::SetProfileShown(bool shown) {
+  show_profile_ = shown;
+}
 
-  return true;
+bool Viewer::SaveProfile(const std::string& file_name) {
+  return Profiler::WriteTrace(file_name);
 }
 
 bool Viewer::on_configure_event(GdkEventConfigure* event) {
@@ -244,13 +223,13 @@ bool Viewer::on_motion_notify_event(GdkEventMotion* event) {
   mouse_diff[1] = (double)(event->y - mouse_prev_[1]);
 
   if (button[0]) {
-    root_->Translate(Vector3D(mouse_diff[0] / 10.0, -mouse_diff[1] / 10.0, 0.0));
+    scene_.GetRoot()->Translate(Vector3D(mouse_diff[0] / 10.0, -mouse_diff[1] / 10.0, 0.0));
   } else if (button[1]) {
-    root_->Rotate('x', mouse_diff[1] * M_PI / 90);
-    root_->Rotate('z', mouse_diff[0] * M_PI / 90);
+    scene_.GetRoot()->Rotate('x', mouse_diff[1] * M_PI / 90);
+    scene_.GetRoot()->Rotate('z', mouse_diff[0] * M_PI / 90);
   } else if (button[2]) {
-    root_->Translate(Vector3D(0.0, 0.0, -mouse_diff[1] / 10.0));
-    root_->Rotate('y', mouse_diff[0] * M_PI / 90);
+    scene_.GetRoot()->Translate(Vector3D(0.0, 0.0, -mouse_diff[1] / 10.0));
+    scene_.GetRoot()->Rotate('y', mouse_diff[0] * M_PI / 90);
   }
 
   mouse_prev_[0] = event->x;
@@ -4,11 +4,7 @@
 #include <gtkglmm.h>
 #include <gtkmm.h>
 
-#include "Flock.h"
-#include "Node.h"
-
-class HeightMap;
-class Water;
+#include "DemoScene.h"
 
 class Viewer : public Gtk::GL::DrawingArea {
  public:
@@ -17,6 +13,12 @@ class Viewer : public Gtk::GL::DrawingArea {
 
   void Invalidate();
 
+  // Whether the profiler's overlay is drawn over the scene.
+  void SetProfileShown(bool shown);
+  bool IsProfileShown() const { return show_profile_; }
+  // Writes a Chrome trace of the latest frames.
+  bool SaveProfile(const std::string& file_name);
+
  protected:
   virtual void on_realize();
   virtual bool on_expose_event(GdkEventExpose* event);
@@ -26,16 +28,21 @@ class Viewer : public Gtk::GL::DrawingArea {
   virtual bool on_motion_notify_event(GdkEventMotion* event);
 
  private:
-  Node* root_;
-
-  HeightMap* terrain_;
-  Water* water_;
-  Flock* flock_;
+  // Redraws when there's no vertical blank to wait for.
+  bool OnFrameTimer();
 
-  char mode_;
+  DemoScene scene_;
 
   bool button_down_;
   int mouse_prev_[2];
+
+  // Display lists for the overlay's font, or 0 if it couldn't be loaded.
+  unsigned font_lists_;
+  bool show_profile_;
+
+  // Whether swaps wait for the vertical blank. Otherwise OnFrameTimer()
+  // paces frames.
+  bool vsync_;
 };
 
 #endif
@@ -8,6 +8,7 @@
 
 #include "Node.h"
 #include "Terrain.h"
+#include "ThreadPool.h"
 
 using std::ifstream;
 using std::list;
@@ -15,12 +16,16 @@ using std::max;
 using std::min;
 using std::string;
 using std::stringstream;
+using std::vector;
 
 string Water::vertex_shader_;
 GLenum Water::water_program_;
 GLenum Water::water_shader_;
 
-Water::Water(const HeightMap& height_map, double height) {
+Water::Water(const HeightMap& height_map, double height, Backend backend)
+    : backend_(backend)
+    , profile_bytes_(0)
+    , current_(0) {
   // Construct water map "filling in" height_map beneath height.
   height_ = height;
   int min_width = height_map.GetWidth();
@@ -50,6 +55,23 @@ Water::Water(const HeightMap& height_map, double height) {
                               height, false);
   node_ = Node::CreateHeightMapNode("Water-wrapper", height_map_, "data/img/water.jpg");
   node_->Translate(Vector3D(min_width, 0, min_length));
+  surface_.assign(height_map_->GetWidth() * height_map_->GetLength(), height);
+
+  if (backend_ == WAVE_EQUATION) {
+    unsigned width = height_map_->GetWidth();
+    unsigned length = height_map_->GetLength();
+    stride_ = length + 2;
+    waves_[0].assign((width + 2) * stride_, 0.0);
+    waves_[1].assign((width + 2) * stride_, 0.0);
+    mask_.assign((width + 2) * stride_, 0.0);
+    for (unsigned i = 0; i < width; i++) {
+      for (unsigned j = 0; j < length; j++) {
+        if (height_map[i + min_width][j + min_length] < height) {
+          mask_[(i + 1) * stride_ + j + 1] = 1.0;
+        }
+      }
+    }
+  }
 
   if (vertex_shader_.size() == 0) {
     ifstream file("data/water.vert");
@@ -75,16 +97,119 @@ Water::~Water() {
 
 double gaussian(double mean, double std_dev) {
   return (1 / (std_dev * sqrt(2 * M_PI))) *
-      exp(-(1 / 2) * (mean / std_dev) * (mean / std_dev));
+      exp(-0.5 * (mean / std_dev) * (mean / std_dev));
+}
+
+// Ripples are cut off four deviations out, where both gaussians have fallen
+// to e^-8, about a three thousandth of their peak.
+static const double kCutoff = 4.0;
+
+// Profiles for every spread and phase a ripple can have come to 16 MB. A
+// quarter of that holds the live ripples' and the most recent ones'.
+static const size_t kProfileBytes = 4 << 20;
+
+bool Water::ProfileKey::operator<(const ProfileKey& other) const {
+  if (gaussian_one_ != other.gaussian_one_) {
+    return gaussian_one_ < other.gaussian_one_;
+  }
+  if (gaussian_two_ != other.gaussian_two_) {
+    return gaussian_two_ < other.gaussian_two_;
+  }
+  return phase_ < other.phase_;
+}
+
+const Water::Profile& Water::GetProfile(const Ripple& r) {
+  ProfileKey key;
+  key.gaussian_one_ = r.gaussian_one_;
+  key.gaussian_two_ = r.gaussian_two_;
+  key.phase_ = r.phase_;
+
+  ProfileCache::iterator it = profiles_.find(key);
+  if (it != profiles_.end()) {
+    profile_uses_.splice(profile_uses_.begin(), profile_uses_,
+                         it->second.use_);
+    return it->second;
+  }
+
+  double radius = min(kCutoff * r.gaussian_two_,
+                      r.phase_ + kCutoff * r.gaussian_one_);
+  unsigned radius2 = (unsigned)(radius * radius);
+
+  // Evaluated once per squared distance, then laid out over the quadrant.
+  vector<double> radial(radius2 + 1);
+  for (unsigned s = 0; s <= radius2; s++) {
+    double distance = sqrt((double)s);
+    radial[s] = gaussian(distance - r.phase_, r.gaussian_one_) *
+        gaussian(distance, r.gaussian_two_) * cos(distance - r.phase_);
+  }
+
+  Profile& profile = profiles_[key];
+  profile.radius2_ = radius2;
+  profile.radius_ = (unsigned)sqrt((double)radius2);
+  unsigned size = profile.radius_ + 1;
+  profile.values_.assign(size * size, 0.0);
+  for (unsigned di = 0; di < size; di++) {
+    for (unsigned dj = 0; dj < size && di * di + dj * dj <= radius2; dj++) {
+      profile.values_[di * size + dj] = radial[di * di + dj * dj];
+    }
+  }
+
+  profile.use_ = profile_uses_.insert(profile_uses_.begin(), key);
+  profile_bytes_ += profile.values_.size() * sizeof(double);
+  while (profile_bytes_ > kProfileBytes && profiles_.size() > 1) {
+    ProfileCache::iterator oldest = profiles_.find(profile_uses_.back());
+    profile_bytes_ -= oldest->second.values_.size() * sizeof(double);
+    profiles_.erase(oldest);
+    profile_uses_.pop_back();
+  }
+  return profile;
+}
+
+Water::Region Water::AddRipple(const Ripple& r, const Profile& profile) {
+  int width = height_map_->GetWidth();
+  int length = height_map_->GetLength();
+  int oi = r.origin_[0];
+  int oj = r.origin_[2];
+  int radius2 = profile.radius2_;
+  int radius = profile.radius_;
+
+  Region region;
+  region.i0_ = max(oi - radius, 0);
+  region.i1_ = min(oi + radius, width - 1);
+  region.j0_ = max(oj - radius, 0);
+  region.j1_ = min(oj + radius, length - 1);
+
+  // Only the cells inside the ripple's disc, one clipped span per row.
+  for (int i = region.i0_; i <= (int)region.i1_; i++) {
+    int di = i - oi;
+    int half = (int)sqrt((double)(radius2 - di * di));
+    int j0 = max(oj - half, 0);
+    int j1 = min(oj + half, length - 1);
+
+    double* row = GetRow(i);
+    const double* quadrant = profile.GetRow(di < 0 ? -di : di);
+    // Left of the origin the quadrant is read backwards.
+    int left = min(oj - 1, j1);
+    for (int j = j0; j <= left; j++) {
+      row[j] += quadrant[oj - j];
+    }
+    for (int j = max(oj, j0); j <= j1; j++) {
+      row[j] += quadrant[j - oj];
+    }
+  }
+
+  return region;
 }
 
-void Water::Animate(bool changed) {
+void Water::Animate(bool) {
   // if changed
   //   move to center of water
   //   render scene in six cardinal directions
   //   update cube
 
+  bool spawned = false;
   if ((rand() % 5 == 0)) {
+    spawned = true;
     Ripple r;
     r.origin_ = Point3D(rand() % height_map_->GetWidth(), 0.0,
                        rand() % height_map_->GetLength());
@@ -97,23 +222,40 @@ void Water::Animate(bool changed) {
     ripples_.push_back(r);
   }
 
-  for (unsigned i = 0; i < height_map_->GetWidth(); i++) {
-    for (unsigned j = 0; j < height_map_->GetLength(); j++) {
-      (*height_map_)[i][j] = height_;
+  if (backend_ == WAVE_EQUATION) {
+    AnimateWaves(spawned);
+  } else {
+    AnimateRipples();
+  }
+}
+
+double* Water::GetRow(unsigned i) {
+  return &surface_[i * height_map_->GetLength()];
+}
+
+void Water::Show(const vector<double>& surface) {
+  if (surface.size() == surface_.size()) {
+    height_map_->SetHeights(&surface[0]);
+  }
+}
+
+void Water::AnimateRipples() {
+  // Level what the ripples displaced last frame rather than the whole
+  // surface.
+  for (unsigned k = 0; k < touched_.size(); k++) {
+    const Region& region = touched_[k];
+    for (unsigned i = region.i0_; i <= region.i1_; i++) {
+      for (unsigned j = region.j0_; j <= region.j1_; j++) {
+        GetRow(i)[j] = height_;
+      }
     }
   }
+  touched_.clear();
 
   list<Ripple>::iterator it;
   for (it = ripples_.begin(); it != ripples_.end(); ) {
     Ripple& r = *it;
-    for (unsigned i = 0; i < height_map_->GetWidth(); i++) {
-      for (unsigned j = 0; j < height_map_->GetLength(); j++) {
-        double distance = Point3D(i, 0, j).Distance(r.origin_);
-        (*height_map_)[i][j] = (*height_map_)[i][j] +
-            gaussian(distance - r.phase_, r.gaussian_one_) *
-            gaussian(distance, r.gaussian_two_) * cos(distance - r.phase_);
-      }
-    }
+    touched_.push_back(AddRipple(r, GetProfile(r)));
     r.phase_++;
 
     if (r.phase_ > r.length_) {
@@ -122,7 +264,67 @@ void Water::Animate(bool changed) {
       ++it;
     }
   }
+}
+
+// Wave speed squared (in cells per step) and damping per step. The explicit
+// scheme is stable for a wave speed squared up to 0.5.
+static const double kWaveSpeed2 = 0.25;
+static const double kDamping = 0.995;
+
+void Water::AnimateWaves(bool spawned) {
+  std::vector<double>& u = waves_[current_];
+  int width = height_map_->GetWidth();
+  int length = height_map_->GetLength();
+
+  // A new ripple becomes a small drop into the field at its origin.
+  if (spawned) {
+    const Ripple& r = ripples_.back();
+    int oi = r.origin_[0];
+    int oj = r.origin_[2];
+    for (int i = max(oi - 2, 0); i <= min(oi + 2, width - 1); i++) {
+      for (int j = max(oj - 2, 0); j <= min(oj + 2, length - 1); j++) {
+        double d2 = (i - oi) * (i - oi) + (j - oj) * (j - oj);
+        unsigned cell = (i + 1) * stride_ + j + 1;
+        u[cell] -= mask_[cell] * 0.2 * r.amplitude_ * exp(-0.5 * d2);
+      }
+    }
+  }
+  ripples_.clear();
 
-  height_map_->ComputeNormals();
+  ThreadPool::GetDefault()->Run(StepWaves, this, width);
+  current_ = 1 - current_;
 }
 
+void Water::StepWaves(void* data, unsigned begin, unsigned end) {
+  Water* water = (Water*)data;
+  unsigned length = water->height_map_->GetLength();
+  unsigned stride = water->stride_;
+  const double* u = &water->waves_[water->current_][0];
+  // Holds the previous step on the way in and the next one on the way out.
+  double* next = &water->waves_[1 - water->current_][0];
+  const double* mask = &water->mask_[0];
+
+  for (unsigned i = begin; i < end; i++) {
+    unsigned offset = (i + 1) * stride + 1;
+    const double* centre = u + offset;
+    const double* up = centre - stride;
+    const double* down = centre + stride;
+    const double* left = centre - 1;
+    const double* right = centre + 1;
+    const double* wet = mask + offset;
+    double* out = next + offset;
+
+    // Branch free over the whole row so the compiler vectorises it.
+    for (unsigned j = 0; j < length; j++) {
+      double laplacian = up[j] + down[j] + left[j] + right[j] -
+          4.0 * centre[j];
+      out[j] = wet[j] * kDamping *
+          (2.0 * centre[j] - out[j] + kWaveSpeed2 * laplacian);
+    }
+
+    double* row = water->GetRow(i);
+    for (unsigned j = 0; j < length; j++) {
+      row[j] = water->height_ + out[j];
+    }
+  }
+}
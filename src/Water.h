@@ -6,7 +6,9 @@
 #include <GL/gl.h>
 #include <GL/glu.h>
 #include <list>
+#include <map>
 #include <string>
+#include <vector>
 
 #include "Primitive.h"
 
@@ -15,12 +17,27 @@ class Node;
 
 class Water {
  public:
-  Water(const HeightMap& height_map, double height);
+  // RIPPLES sums analytic gaussian ripples. WAVE_EQUATION runs a damped wave
+  // equation over the whole surface, with the terrain as walls; ripples only
+  // start waves there, so the cost per step is fixed however many are live.
+  enum Backend {
+    RIPPLES,
+    WAVE_EQUATION
+  };
+
+  Water(const HeightMap& height_map, double height,
+        Backend backend = RIPPLES);
   ~Water();
 
   Node* GetNode() { return node_; }
 
+  // Steps the water's own copy of its surface, leaving what's drawn alone,
+  // so animating can run on another thread than drawing.
   void Animate(bool update_cube);
+  const std::vector<double>& GetSurface() const { return surface_; }
+  // Draws a surface from GetSurface() from now on. Only where it differs from
+  // the last one shown is refreshed.
+  void Show(const std::vector<double>& surface);
   void Render();
 
  private:
@@ -37,10 +54,73 @@ class Water {
     unsigned length_;
   };
 
+  // Identifies one radial profile: the ripple's shape at one phase.
+  struct ProfileKey {
+    double gaussian_one_;
+    double gaussian_two_;
+    unsigned phase_;
+
+    bool operator<(const ProfileKey& other) const;
+  };
+
+  // A ripple's contribution over one quadrant of its disc: row di holds
+  // columns dj = 0..radius_ out from the origin. Ripples start on whole
+  // cells, so no sqrt, exp or cos is needed per cell, and the other quadrants
+  // are mirror images, so every row of the disc is a plain add of a
+  // contiguous span.
+  struct Profile {
+    unsigned radius_;
+    // Cells whose squared distance is above this are cut off.
+    unsigned radius2_;
+    std::vector<double> values_;
+    // Where the key is in profile_uses_.
+    std::list<ProfileKey>::iterator use_;
+
+    const double* GetRow(unsigned di) const {
+      return &values_[di * (radius_ + 1)]; }
+  };
+  typedef std::map<ProfileKey, Profile> ProfileCache;
+
+  // Inclusive rectangle of cells.
+  struct Region {
+    unsigned i0_;
+    unsigned j0_;
+    unsigned i1_;
+    unsigned j1_;
+  };
+
+  const Profile& GetProfile(const Ripple& ripple);
+  Region AddRipple(const Ripple& ripple, const Profile& profile);
+  double* GetRow(unsigned i);
+
+  void AnimateRipples();
+  void AnimateWaves(bool spawned);
+  static void StepWaves(void* water, unsigned begin, unsigned end);
+
   Node* node_;
+  // Only drawn; the animation runs on surface_, laid out the same way.
   HeightMap* height_map_;
+  std::vector<double> surface_;
   std::list<Ripple> ripples_;
   double height_;
+
+  Backend backend_;
+
+  // Kept to kProfileBytes, evicting the least recently used.
+  ProfileCache profiles_;
+  // Keys from most to least recently used.
+  std::list<ProfileKey> profile_uses_;
+  size_t profile_bytes_;
+  // Cells displaced last frame, which have to be levelled again.
+  std::vector<Region> touched_;
+
+  // Wave equation state: displacement from height_ at this step and the
+  // previous one, with a ring of ghost cells so the stencil never branches.
+  // mask_ is 0 where the terrain rises above the water and 1 elsewhere.
+  unsigned stride_;
+  std::vector<double> waves_[2];
+  unsigned current_;
+  std::vector<double> mask_;
 };
 
 #endif
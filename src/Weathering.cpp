@@ -0,0 +1,147 @@
+#include "Weathering.h"
+
+#include <algorithm>
+#include <limits>
+
+#include "Terrain.h"
+#include "ThreadPool.h"
+
+using std::copy;
+using std::max;
+using std::min;
+using std::numeric_limits;
+using std::swap;
+
+static const int neighbours[][2] = {
+  {-1, -1},
+  {-1, 0},
+  {-1, 1},
+  {0, -1},
+  {0, 1},
+  {1, -1},
+  {1, 0},
+  {1, 1}
+};
+
+WeatheringEngine::WeatheringEngine(const HeightMap& height_map,
+                                   ThreadPool* pool)
+    : pool_(pool ? pool : ThreadPool::GetDefault())
+    , width_(height_map.GetWidth())
+    , length_(height_map.GetLength())
+    , talus_(height_map.GetTalus()) {
+  unsigned cells = width_ * length_;
+  front_ = new double[cells];
+  back_ = new double[cells];
+  outflow_ = new double[cells];
+  total_diff_ = new double[cells];
+
+  if (cells > 0) {
+    copy(height_map[0], height_map[0] + cells, front_);
+  }
+}
+
+WeatheringEngine::~WeatheringEngine() {
+  delete[] front_;
+  delete[] back_;
+  delete[] outflow_;
+  delete[] total_diff_;
+}
+
+void WeatheringEngine::Step(unsigned iterations) {
+  for (unsigned t = 0; t < iterations; t++) {
+    pool_->Run(ComputeOutflow, this, width_);
+    pool_->Run(Gather, this, width_);
+    swap(front_, back_);
+  }
+}
+
+void WeatheringEngine::CopyTo(HeightMap& height_map) const {
+  if (height_map.GetWidth() != width_ || height_map.GetLength() != length_) {
+    return;
+  }
+
+  height_map.SetHeights(front_);
+}
+
+void WeatheringEngine::ComputeOutflow(void* data, unsigned begin,
+                                      unsigned end) {
+  WeatheringEngine* engine = (WeatheringEngine*)data;
+  const double* h = engine->front_;
+  int width = engine->width_;
+  int length = engine->length_;
+
+  for (int i = begin; i < (int)end; i++) {
+    for (int j = 0; j < length; j++) {
+      double height = h[i * length + j];
+      double total_diff = 0.0;
+      double min_diff = numeric_limits<double>::infinity();
+      unsigned count = 0;
+
+      for (unsigned n = 0; n < 8; n++) {
+        int ni = i + neighbours[n][0];
+        int nj = j + neighbours[n][1];
+        if (ni < 0 || ni >= width || nj < 0 || nj >= length) {
+          continue;
+        }
+
+        double diff = height - h[ni * length + nj];
+        if (diff > engine->talus_) {
+          count++;
+          total_diff += diff;
+          if (diff < min_diff) {
+            min_diff = diff;
+          }
+        }
+      }
+
+      double redistribute = 0.0;
+      if (count > 0) {
+        redistribute = ((double)count / (count + 1)) * min_diff;
+      }
+
+      engine->outflow_[i * length + j] = redistribute;
+      engine->total_diff_[i * length + j] = total_diff;
+    }
+  }
+}
+
+void WeatheringEngine::Gather(void* data, unsigned begin, unsigned end) {
+  WeatheringEngine* engine = (WeatheringEngine*)data;
+  const double* h = engine->front_;
+  int width = engine->width_;
+  int length = engine->length_;
+
+  for (int i = begin; i < (int)end; i++) {
+    for (int j = 0; j < length; j++) {
+      double height = h[i * length + j];
+      double value = height;
+
+      // Visit the 3x3 block of senders in the order the serial loop would
+      // have processed them, so the floating point sums match exactly.
+      for (int si = i - 1; si <= i + 1; si++) {
+        if (si < 0 || si >= width) {
+          continue;
+        }
+
+        for (int sj = j - 1; sj <= j + 1; sj++) {
+          if (sj < 0 || sj >= length) {
+            continue;
+          }
+
+          unsigned s = si * length + sj;
+          if (si == i && sj == j) {
+            value -= engine->outflow_[s];
+            continue;
+          }
+
+          double diff = h[s] - height;
+          if (diff > engine->talus_) {
+            value += (diff / engine->total_diff_[s]) * engine->outflow_[s];
+          }
+        }
+      }
+
+      engine->back_[i * length + j] = value;
+    }
+  }
+}
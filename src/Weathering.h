@@ -0,0 +1,55 @@
+#ifndef __WEATHERING_H__
+#define __WEATHERING_H__
+
+class HeightMap;
+class ThreadPool;
+
+// Parallel thermal weathering over a copy of a HeightMap.
+//
+// Each pass reads the front buffer and writes the back buffer, then the two
+// are swapped. The grid is split into bands of rows, one per thread; a band
+// reads one halo row above and below it from the shared front buffer, and the
+// pool's join between phases is the halo exchange.
+//
+// The serial algorithm scatters material from each cell to its lower
+// neighbours. Here every cell instead gathers what its neighbours send it, in
+// the same row-major order the serial loop would have added it, so results
+// are bit-identical to the scatter version for any thread count.
+class WeatheringEngine {
+ public:
+  WeatheringEngine(const HeightMap& height_map, ThreadPool* pool = 0);
+  ~WeatheringEngine();
+
+  unsigned GetCellCount() const { return width_ * length_; }
+
+  void Step(unsigned iterations);
+  // The heights after the last step, laid out as HeightMap::SetHeights()
+  // takes them.
+  const double* GetHeights() const { return front_; }
+  // Writes the result back, then refreshes normals and render data for just
+  // the cells that changed.
+  void CopyTo(HeightMap& height_map) const;
+
+ private:
+  WeatheringEngine(const WeatheringEngine&);
+  WeatheringEngine& operator=(const WeatheringEngine&);
+
+  static void ComputeOutflow(void* engine, unsigned begin, unsigned end);
+  static void Gather(void* engine, unsigned begin, unsigned end);
+
+  ThreadPool* pool_;
+
+  unsigned width_;
+  unsigned length_;
+  double talus_;
+
+  double* front_;
+  double* back_;
+
+  // Per cell results of the first phase: the amount of material the cell
+  // gives away and the sum of height differences it is shared out by.
+  double* outflow_;
+  double* total_diff_;
+};
+
+#endif
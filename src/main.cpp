@@ -1,18 +1,67 @@
 #include <gtkglmm.h>
 #include <gtkmm.h>
+#include <cerrno>
+#include <cstdlib>
 #include <iostream>
 
 #include "AppWindow.h"
+#include "Benchmark.h"
+#include "Headless.h"
 #include "Terrain.h"
 
+// Reads a whole decimal argument between 1 and max into value, or leaves it
+// alone if there's no such argument. Returns false if it isn't a number in
+// range, so a typo can't start four billion frames.
+static bool parseCount(int argc, char** argv, int index, unsigned long max,
+                       unsigned& value) {
+  if (index >= argc) {
+    return true;
+  }
+
+  const char* text = argv[index];
+  char* end;
+  errno = 0;
+  long parsed = strtol(text, &end, 10);
+  if (errno != 0 || end == text || *end != '\0' || parsed < 1 ||
+      (unsigned long)parsed > max) {
+    std::cerr << "Expected a number from 1 to " << max << ", not '" << text
+              << "'" << std::endl;
+    return false;
+  }
+  value = parsed;
+  return true;
+}
+
 int main(int argc, char** argv) {
   Terrain::CreateMountain("test.hm");
 
+  if (argc >= 2 && argv[1][0] == 'b') {
+    Benchmark::Run();
+    return 0;
+  }
+
+  // h <mode> [frames] [width] [height] [file pattern]
+  if (argc >= 3 && argv[1][0] == 'h') {
+    unsigned frames = 100;
+    unsigned width = 640;
+    unsigned height = 480;
+    if (!parseCount(argc, argv, 3, 1000000, frames) ||
+        !parseCount(argc, argv, 4, 16384, width) ||
+        !parseCount(argc, argv, 5, 16384, height)) {
+      return 1;
+    }
+    std::string pattern = argc >= 7 ? argv[6] : "frame%04d.jpg";
+    return Headless::Render(argv[2][0], frames, width, height, pattern) ? 0 : 1;
+  }
+
   Gtk::Main kit(argc, argv);
   Gtk::GL::init(argc, argv);
 
   if (argc < 2) {
-    std::cerr << "Usage: " << argv[0] << "l | t | w | f" << std::endl;
+    std::cerr << "Usage: " << argv[0] << "l | t | v | o | w | f | b | "
+              << "h (l | t | v | o | w | f) [frames] [width] [height] "
+              << "[file pattern]"
+              << std::endl;
   }
 
   AppWindow window(argv[1][0]);